@@ -0,0 +1,37 @@
+#!/bin/sh
+# Compares a cold exec per request with a round trip to a warm coprocess.
+#   cold:   every line starts /bin/echo (fork/spawn + exec + dynamic linking)
+#   line:   every line is one request to a `cat` coprocess (coproc NAME)
+#   framed: every line runs `echo` inside a warm "icsh --worker" (coproc -f NAME)
+# Usage: bench/coproc_bench.sh [count]   (run from the repo root after make)
+
+N=${1:-2000}
+ICSH=${ICSH:-./icsh}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+run() {
+    name=$1
+    start=$(date +%s%N)
+    "$ICSH" "$SCRIPT" > /dev/null
+    end=$(date +%s%N)
+    ns=$((end - start))
+    echo "$name: $N requests in $((ns / 1000000)) ms, $((ns / N / 1000)) us/request"
+}
+
+make_script() {
+    : > "$SCRIPT"
+    [ -n "$1" ] && echo "$1" >> "$SCRIPT"
+    i=0
+    while [ $i -lt "$N" ]; do
+        echo "$2" >> "$SCRIPT"
+        i=$((i + 1))
+    done
+}
+
+make_script "" "/bin/echo hello"
+run cold
+make_script "coproc up cat" "coproc -c up hello"
+run line
+make_script "coproc -f w $ICSH --worker" "coproc -c w echo hello"
+run framed
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Times repeated globs over one large directory with the listing cache on and off
+# (ICSH_GLOB_CACHE=0). The first glob reads the directory either way; after that,
+# with the cache on, each glob costs one stat() plus matching.
+# Usage: bench/glob_bench.sh [files] [globs]   (run from the repo root after make)
+
+FILES=${1:-200000}
+N=${2:-50}
+ICSH=${ICSH:-./icsh}
+DIR=$(mktemp -d)
+SCRIPT=$(mktemp)
+trap 'rm -rf "$DIR" "$SCRIPT"' EXIT
+
+(cd "$DIR" && seq -f "app-%06g.log" 1 "$FILES" | xargs touch && touch other.txt)
+sleep 1   # let the directory's mtime age past the cache's racy window
+
+i=0
+while [ $i -lt "$N" ]; do
+    echo "echo $DIR/app-*7.log > /dev/null" >> "$SCRIPT"
+    i=$((i + 1))
+done
+
+for cache in 0 1; do
+    start=$(date +%s%N)
+    ICSH_GLOB_CACHE=$cache "$ICSH" "$SCRIPT" > /dev/null
+    end=$(date +%s%N)
+    ns=$((end - start))
+    echo "cache=$cache: $N globs over $FILES files in $((ns / 1000000)) ms, $((ns / N / 1000)) us/glob"
+done
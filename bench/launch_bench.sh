@@ -0,0 +1,23 @@
+#!/bin/sh
+# Measures how many external commands per second icsh can launch with the
+# fork launcher and with the posix_spawn launcher (ICSH_LAUNCHER=fork|spawn).
+# Usage: bench/launch_bench.sh [count]   (run from the repo root after make)
+
+N=${1:-2000}
+ICSH=${ICSH:-./icsh}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+i=0
+while [ $i -lt "$N" ]; do
+    echo "/bin/true" >> "$SCRIPT"
+    i=$((i + 1))
+done
+
+for mode in fork spawn; do
+    start=$(date +%s%N)
+    ICSH_LAUNCHER=$mode "$ICSH" "$SCRIPT" > /dev/null
+    end=$(date +%s%N)
+    ns=$((end - start))
+    echo "$mode: $N commands in $((ns / 1000000)) ms, $((N * 1000000000 / ns)) cmds/sec"
+done
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Loop iterations per second for a body of built-ins: nested "for" loops over the
+# digits 0-9, LEVELS deep, with an echo of the counter in the innermost body
+# (10^LEVELS iterations). The same script also runs under sh and bash, when they
+# exist, for comparison; all three understand it.
+# Usage: bench/loop_bench.sh [levels]   (run from the repo root after make)
+
+LEVELS=${1:-6}
+ICSH=${ICSH:-./icsh}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+i=0
+body='echo'
+while [ $i -lt "$LEVELS" ]; do
+    echo "for d$i in 0 1 2 3 4 5 6 7 8 9; do" >> "$SCRIPT"
+    body="$body \$d$i"
+    i=$((i + 1))
+done
+echo "$body" >> "$SCRIPT"
+i=0
+while [ $i -lt "$LEVELS" ]; do
+    echo "done" >> "$SCRIPT"
+    i=$((i + 1))
+done
+
+n=1
+i=0
+while [ $i -lt "$LEVELS" ]; do
+    n=$((n * 10))
+    i=$((i + 1))
+done
+
+for shell in "$ICSH" sh bash; do
+    command -v "$shell" > /dev/null 2>&1 || continue
+    start=$(date +%s%N)
+    "$shell" "$SCRIPT" > /dev/null
+    end=$(date +%s%N)
+    ns=$((end - start))
+    echo "$shell: $n iterations in $((ns / 1000000)) ms, $((n * 1000 / (ns / 1000000 + 1))) iterations/sec"
+done
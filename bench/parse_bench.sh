@@ -0,0 +1,10 @@
+#!/bin/sh
+# Measures parser throughput (lines/sec) over a corpus of real-world command lines,
+# both parsing from scratch and through the parse cache.
+# Usage: bench/parse_bench.sh [iterations] [corpus]   (run from the repo root after make)
+
+ITERS=${1:-10000}
+CORPUS=${2:-bench/parse_corpus.txt}
+ICSH=${ICSH:-./icsh}
+
+"$ICSH" --parse-bench "$CORPUS" "$ITERS"
@@ -0,0 +1,165 @@
+#!/bin/sh
+# Shell-level benchmarks: `make bench`, from the repo root. Writes one JSON object
+# to $BENCH_OUT (default bench-results.json), one metric per line:
+#   builtin_lines_per_sec     script lines of built-ins (echo, :, test, assignments)
+#   external_cmds_per_sec     script lines that each launch /bin/true
+#   bg_fanout_ms              start $FANOUT background jobs, then wait for all of them
+#   interactive_cmd_ms        type "echo tick" at the prompt until the next prompt shows
+#   tab_complete_ms           type "ech" and Tab until the line editor shows "echo "
+#   ctrlz_fg_roundtrip_ms     Ctrl-Z a running cat, fg it, and see it echo a line
+# Script benchmarks take the best of $BENCH_RUNS runs; the pty ones are medians.
+# With BENCH_BASELINE=old.json, every metric is compared with the old run, and the
+# script fails if one got worse by more than $BENCH_TOLERANCE percent (default 15).
+# Usage: bench/run.sh [scale]   (scale multiplies the work, default 1)
+
+SCALE=${1:-1}
+ICSH=${ICSH:-./icsh}
+DRIVE=${DRIVE:-tests/ptydrive}
+OUT=${BENCH_OUT:-bench-results.json}
+RUNS=${BENCH_RUNS:-3}
+TOLERANCE=${BENCH_TOLERANCE:-15}
+FANOUT=${FANOUT:-50}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+ICSH_HISTFILE=$TMP/history
+export ICSH_HISTFILE
+
+# best_ns SCRIPT: the fastest of $RUNS runs, in nanoseconds
+best_ns() {
+    best=0
+    r=0
+    while [ $r -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        "$ICSH" "$1" > /dev/null 2>&1
+        ns=$(($(date +%s%N) - start))
+        if [ $best -eq 0 ] || [ $ns -lt $best ]; then best=$ns; fi
+        r=$((r + 1))
+    done
+    echo $best
+}
+
+# repeat_lines N LINE...: the lines, over and over, N lines in all
+repeat_lines() {
+    n=$1
+    shift
+    awk -v n="$n" 'BEGIN { m = ARGC - 1; for (i = 0; i < n; i++) print ARGV[i % m + 1]; exit }' "$@"
+}
+
+rate() {
+    awk -v n="$1" -v ns="$2" 'BEGIN { printf "%.0f", n * 1e9 / ns }'
+}
+
+: > "$TMP/metrics"
+metric() {
+    echo "$1 $2" >> "$TMP/metrics"
+    echo "$1: $2"
+}
+
+N=$((20000 * SCALE))
+repeat_lines $N 'echo bench' ':' 'x=1' 'test 1 = 1' 'true' > "$TMP/builtins.sh"
+metric builtin_lines_per_sec "$(rate $N "$(best_ns "$TMP/builtins.sh")")"
+
+N=$((2000 * SCALE))
+repeat_lines $N '/bin/true' > "$TMP/external.sh"
+metric external_cmds_per_sec "$(rate $N "$(best_ns "$TMP/external.sh")")"
+
+BATCHES=$((10 * SCALE))
+{
+    b=0
+    while [ $b -lt $BATCHES ]; do
+        repeat_lines "$FANOUT" '/bin/true &'
+        echo wait
+        b=$((b + 1))
+    done
+} > "$TMP/fanout.sh"
+metric bg_fanout_ms "$(awk -v ns="$(best_ns "$TMP/fanout.sh")" -v b=$BATCHES \
+                       'BEGIN { printf "%.3f", ns / b / 1e6 }')"
+
+# lap_median PTYFILE LAP: the median of one lap from a ptydrive run
+lap_median() {
+    "$DRIVE" "$1" "$ICSH" > "$TMP/pty.json" || { cat "$TMP/pty.json" >&2; echo 0; return; }
+    sed -n "s/.*\"$2\": {[^}]*\"median_ms\": \\([0-9.]*\\).*/\\1/p" "$TMP/pty.json"
+}
+
+N=$((200 * SCALE))
+cat > "$TMP/interactive.pty" <<EOF
+expect icsh \$
+repeat $N
+mark
+send echo tick\n
+expect tick\r\nicsh \$
+lap cmd
+end
+send exit\n
+status 0
+EOF
+metric interactive_cmd_ms "$(lap_median "$TMP/interactive.pty" cmd)"
+
+N=$((200 * SCALE))
+cat > "$TMP/complete.pty" <<EOF
+expect icsh \$
+repeat $N
+mark
+send ech\t
+expect echo 
+lap tab
+send \x15
+expect \\e[J
+end
+send exit\n
+status 0
+EOF
+metric tab_complete_ms "$(lap_median "$TMP/complete.pty" tab)"
+
+N=$((50 * SCALE))
+cat > "$TMP/ctrlz.pty" <<EOF
+expect icsh \$
+send cat\n
+send warm\n
+expect warm\r\nwarm\r\n
+repeat $N
+mark
+send \x1a
+expect Stopped
+send fg\n
+expect fg\r\ncat\r\n
+send ping\n
+expect ping\r\nping\r\n
+lap roundtrip
+end
+send \x04
+expect icsh \$
+send exit\n
+status 0
+EOF
+metric ctrlz_fg_roundtrip_ms "$(lap_median "$TMP/ctrlz.pty" roundtrip)"
+
+{
+    echo "{"
+    echo "  \"suite\": \"icsh-bench\","
+    echo "  \"commit\": \"$(git rev-parse --short HEAD 2>/dev/null)\","
+    echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+    echo "  \"scale\": $SCALE,"
+    echo "  \"metrics\": {"
+    awk '{ printf "%s    \"%s\": %s", (NR > 1 ? ",\n" : ""), $1, $2 } END { print "" }' "$TMP/metrics"
+    echo "  }"
+    echo "}"
+} > "$OUT"
+echo "results in $OUT"
+
+[ -n "$BENCH_BASELINE" ] || exit 0
+
+# a rate (*_per_sec) is better higher, a time (*_ms) better lower
+echo "compared with $BENCH_BASELINE (tolerance $TOLERANCE%):"
+sed -n 's/^ *"\([a-z_]*\)": \([0-9.]*\),\{0,1\}$/\1 \2/p' "$BENCH_BASELINE" > "$TMP/base"
+awk -v tol="$TOLERANCE" '
+    NR == FNR { base[$1] = $2; next }
+    ($1 in base) && base[$1] > 0 {
+        change = ($2 - base[$1]) / base[$1] * 100
+        worse  = ($1 ~ /_per_sec$/) ? -change : change
+        flag   = (worse > tol) ? "REGRESSION" : ""
+        if (flag != "") bad++
+        printf "  %-24s %12s -> %-12s %+7.1f%%  %s\n", $1, base[$1], $2, change, flag
+    }
+    END { exit bad > 0 }
+' "$TMP/base" "$TMP/metrics"
@@ -3,6 +3,7 @@
 * StudentID: 6380164
 */
 
+#define _GNU_SOURCE   // splice, vmsplice, pipe2
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -10,621 +11,8559 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <fcntl.h>
-#include <errno.h>    // I need this to check errors in handle_sigchld()
+#include <errno.h>    // I need this to check errors in reap_children()
+#include <spawn.h>    // posix_spawn fast path for external commands
+#include <sys/stat.h> // stat() when I resolve commands on $PATH
+#include <sys/mman.h> // mmap'd echo output for vmsplice
+#include <sys/uio.h>  // struct iovec for vmsplice
+#include <sys/sendfile.h> // icsh --worker sends its captured output back
+#include <sys/signalfd.h> // SIGCHLD/SIGINT/SIGTSTP as events in my main loop
+#include <sys/timerfd.h>  // timeout/at/every deadlines as events in my main loop
+#include <stdint.h>
+#include <poll.h>
+#include <termios.h>  // terminal modes saved per job for job control
+#include <sys/ioctl.h> // FIONREAD and the terminal width for the line editor
+#include <time.h>     // clock_gettime for --parse-bench
+#include <sys/time.h>     // timeradd/timersub on rusage times
+#include <sys/resource.h> // struct rusage from wait4() for time, wait and jobs -l
+#include <dirent.h>   // directory listings for filename globbing
+#include <stdarg.h>   // out_printf() for built-in output
+#include <stdio_ext.h> // __fpending(): is anything left in stdout's stdio buffer
+#include <limits.h>   // PATH_MAX for per-job cgroup paths
 
-#define MAX_CMD_BUFFER 255
-#define MAX_ARGS       128
-#define MAX_JOBS       64
+extern char **environ;
+
+#define MAX_STAGES     16    // most commands I allow in one pipeline
 
 // ────────────────────────────────────────────────────────────────────────────
 // Global state (from Milestone 5)
 
-// I keep track of the PID of the process currently running in foreground.
-// If no foreground child is running, fg_pid is -1.
-pid_t fg_pid = -1;
-
 // I store the exit status of the last foreground process here.
 int last_status = 0;
 
+// now_ns: a monotonic timestamp in nanoseconds.
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Arena allocator
 // ────────────────────────────────────────────────────────────────────────────
-// Milestone 6: job table + SIGCHLD handler + built-in job control
 
-typedef enum { JOB_RUNNING, JOB_STOPPED } job_state_t;
+// An arena is a chain of chunks I bump-allocate from and free in one go. Every AST
+// lives in its own, so a parsed line never needs malloc/free per node.
+#define ARENA_CHUNK 4096
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t              used;
+    size_t              cap;
+    char                data[];
+} arena_chunk_t;
 
-// I define a struct job_t to store each background job’s ID, PID, state, and command line.
 typedef struct {
-    int          id;               // my job ID (1, 2, 3, …)
-    pid_t        pid;              // child PID
-    job_state_t  state;            // either JOB_RUNNING or JOB_STOPPED
-    char         cmdline[MAX_CMD_BUFFER];  // the full command line I launched
-} job_t;
+    arena_chunk_t *head;
+} arena_t;
+
+// arena_alloc: I hand out n bytes (8-byte aligned), starting a new chunk when the
+// current one is full. A request bigger than a chunk gets a chunk of its own.
+static void *arena_alloc(arena_t *a, size_t n) {
+    n = (n + 7) & ~(size_t)7;
+    if (a->head == NULL || a->head->used + n > a->head->cap) {
+        size_t cap = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+        arena_chunk_t *c = malloc(sizeof(arena_chunk_t) + cap);
+        if (c == NULL) {
+            perror("icsh: arena");
+            exit(1);
+        }
+        c->next = a->head;
+        c->used = 0;
+        c->cap  = cap;
+        a->head = c;
+    }
+    void *p = a->head->data + a->head->used;
+    a->head->used += n;
+    return p;
+}
+
+static char *arena_strndup(arena_t *a, const char *s, size_t n) {
+    char *p = arena_alloc(a, n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+static void arena_free(arena_t *a) {
+    while (a->head != NULL) {
+        arena_chunk_t *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
+
+// A mark remembers how full an arena is; arena_reset() gives back everything allocated
+// since. Loops reset their scratch arena after every iteration this way, so a million
+// iterations use no more memory than one.
+typedef struct {
+    arena_chunk_t *head;
+    size_t         used;
+} arena_mark_t;
+
+static arena_mark_t arena_mark(arena_t *a) {
+    arena_mark_t m = { a->head, a->head ? a->head->used : 0 };
+    return m;
+}
+
+static void arena_reset(arena_t *a, arena_mark_t m) {
+    while (a->head != m.head) {
+        arena_chunk_t *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    if (a->head != NULL) a->head->used = m.used;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Shell output: my own stdout, queued and written with one writev per prompt cycle
+// ────────────────────────────────────────────────────────────────────────────
+
+// Everything I print on stdout myself (built-in output, "[1] 1234", the newline after
+// a Ctrl-C, prompts) goes through here instead of stdio. tty_out holds output that
+// must stay in order with the commands I run; tty_notes holds job notices (Done,
+// Stopped, ...), which are held back until the next prompt. tty_cycle() writes both
+// plus the prompt with a single writev(). Before I launch or fork anything, or block,
+// tty_sync() writes out tty_out alone, so my output never lands after a child's.
+// Signal events only queue text, never write.
+typedef struct {
+    char  *buf;
+    size_t len;
+    size_t cap;
+} tty_queue_t;
+
+static tty_queue_t tty_out;
+static tty_queue_t tty_notes;
+static int         tty_reprompt = 0;    // a Ctrl-C at the prompt wants a fresh prompt
+static const char *tty_prompt   = "";   // the last prompt I printed, for the line editor
+
+#define TTY_HIGH_WATER (64 * 1024)      // past this I write tty_out without waiting
+
+static int tty_reserve(tty_queue_t *q, size_t n) {
+    if (q->len + n <= q->cap) return 0;
+    size_t cap = q->cap ? q->cap : 1024;
+    while (cap < q->len + n) cap *= 2;
+    char *grown = realloc(q->buf, cap);
+    if (grown == NULL) return -1;
+    q->buf = grown;
+    q->cap = cap;
+    return 0;
+}
+
+static void tty_writev(struct iovec *iov, int n);
+
+static void tty_put(tty_queue_t *q, const char *s, size_t n) {
+    if (tty_reserve(q, n) < 0) return;
+    memcpy(q->buf + q->len, s, n);
+    q->len += n;
+    if (q == &tty_out && q->len >= TTY_HIGH_WATER) {
+        struct iovec iov = { q->buf, q->len };
+        tty_writev(&iov, 1);
+        q->len = 0;
+    }
+}
+
+static void tty_printf(tty_queue_t *q, const char *fmt, ...) {
+    char    small[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(small, sizeof(small), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < sizeof(small)) {
+        tty_put(q, small, n);
+        return;
+    }
+    if (tty_reserve(q, n + 1) < 0) return;
+    va_start(ap, fmt);
+    vsnprintf(q->buf + q->len, n + 1, fmt, ap);
+    va_end(ap);
+    q->len += n;
+}
+
+// tty_writev: I write all of iov to stdout, picking up after short writes. Anything
+// some other code left in stdio goes first.
+static void tty_writev(struct iovec *iov, int n) {
+    if (__fpending(stdout) > 0) fflush(stdout);
+    while (n > 0) {
+        ssize_t w = writev(STDOUT_FILENO, iov, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return;
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+}
+
+// tty_sync: write out tty_out now (notices stay queued).
+static void tty_sync(void) {
+    if (tty_out.len == 0) return;
+    struct iovec iov = { tty_out.buf, tty_out.len };
+    tty_writev(&iov, 1);
+    tty_out.len = 0;
+}
+
+// tty_cycle: tty_out, then the job notices, then prompt (if not NULL), in one writev().
+static void tty_cycle(const char *prompt) {
+    struct iovec iov[3];
+    int          n = 0;
+    if (tty_out.len > 0)   iov[n++] = (struct iovec){ tty_out.buf, tty_out.len };
+    if (tty_notes.len > 0) iov[n++] = (struct iovec){ tty_notes.buf, tty_notes.len };
+    if (prompt != NULL)    iov[n++] = (struct iovec){ (char *)prompt, strlen(prompt) };
+    if (prompt != NULL)    tty_prompt = prompt;
+    if (n > 0) tty_writev(iov, n);
+    tty_out.len   = 0;
+    tty_notes.len = 0;
+    tty_reprompt  = 0;
+}
+
+// My diagnostics go to stderr through stdio, from many places. So that an error never
+// overtakes output still queued in tty_out ("echo one; cd /nowhere"), stderr_hook()
+// turns stderr into an unbuffered stream whose writes sync tty_out first.
+static ssize_t stderr_write(void *cookie, const char *buf, size_t n) {
+    (void)cookie;
+    tty_sync();
+    for (size_t off = 0; off < n; ) {
+        ssize_t w = write(STDERR_FILENO, buf + off, n - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return off > 0 ? (ssize_t)off : -1;
+        off += w;
+    }
+    return n;
+}
+
+static void stderr_hook(void) {
+    cookie_io_functions_t io = { .write = stderr_write };
+    FILE *f = fopencookie(NULL, "w", io);
+    if (f == NULL) return;
+    setvbuf(f, NULL, _IONBF, 0);
+    stderr = f;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Built-in output: one shared buffer, handed on once per command
+// ────────────────────────────────────────────────────────────────────────────
+
+// Built-ins print into out_buf instead of through stdio, and run_builtin() hands the
+// whole output on when the command is done: into tty_out when it goes to my own
+// stdout (so it keeps its place among my other output and is batched with it), or
+// with one write() to whatever fd a redirection points it at, which needs no dup2().
+// The buffer is shared by every command and only ever grows.
+static char  *out_buf = NULL;
+static size_t out_len = 0;
+static size_t out_cap = 0;
+
+// While a command substitution runs built-ins in the shell, what they print on my
+// stdout is captured here instead of going into tty_out (see cmd_subst()).
+static tty_queue_t *out_capture = NULL;
+
+static int out_reserve(size_t n) {
+    if (out_len + n <= out_cap) return 0;
+    size_t cap = out_cap ? out_cap : 4096;
+    while (cap < out_len + n) cap *= 2;
+    char *grown = realloc(out_buf, cap);
+    if (grown == NULL) return -1;
+    out_buf = grown;
+    out_cap = cap;
+    return 0;
+}
+
+static void out_put(const char *s, size_t n) {
+    if (out_reserve(n) < 0) return;
+    memcpy(out_buf + out_len, s, n);
+    out_len += n;
+}
+
+static void out_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(out_buf + out_len, out_cap - out_len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if (out_len + n >= out_cap) {
+        if (out_reserve(n + 1) < 0) return;
+        va_start(ap, fmt);
+        vsnprintf(out_buf + out_len, out_cap - out_len, fmt, ap);
+        va_end(ap);
+    }
+    out_len += n;
+}
+
+// out_flush: I hand the buffer to fd (-1 is a closed stdout) and empty it. I return
+// -1 if there was output and it could not go anywhere.
+static int out_flush(int fd) {
+    if (out_len == 0) return 0;
+    int rc = 0;
+    if (fd == STDOUT_FILENO) {
+        tty_put(out_capture ? out_capture : &tty_out, out_buf, out_len);
+    } else if (fd < 0) {
+        rc = -1;
+    } else {
+        tty_sync();
+        for (size_t off = 0; off < out_len; ) {
+            ssize_t w = write(fd, out_buf + off, out_len - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                rc = -1;
+                break;
+            }
+            off += w;
+        }
+    }
+    out_len = 0;
+    return rc;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Variables and the environment
+// ────────────────────────────────────────────────────────────────────────────
+
+// Shell variables live in a chained hash map whose nodes and strings all come from
+// var_arena. Each variable is one "NAME=value" string, so an exported one can sit in
+// env_vec[] as it is. env_vec is the envp every child gets; export, unset and
+// assignments update it one entry at a time, so nothing is rebuilt per exec. A new
+// value that fits in the old string overwrites it in place; otherwise the variable
+// gets a new string and the old one is dead space, which vars_compact() reclaims
+// once there is more dead than live.
+typedef struct var {
+    char       *kv;         // "NAME=value"
+    size_t      name_len;
+    size_t      cap;        // bytes at kv, for "NAME=value" and its '\0'
+    unsigned    hash;
+    int         env_idx;    // index in env_vec[] if exported, else -1
+    struct var *next;       // next in the same bucket
+} var_t;
+
+static arena_t var_arena    = { NULL };
+static var_t **var_buckets  = NULL;
+static int     var_nbuckets = 0;      // always a power of two
+static int     var_count    = 0;
+static size_t  var_live     = 0;      // bytes in use in var_arena
+static size_t  var_dead     = 0;      // bytes of strings and nodes I replaced
+static char  **env_vec      = NULL;   // NULL-terminated envp for my children
+static int     env_count    = 0;
+static int     env_cap      = 0;
+static pid_t   shell_pid    = 0;      // "$$"
+
+// Positional parameters: $0 is the script (or "icsh"), and $1, $2 ... are the
+// script's arguments, or a function's while it runs.
+static const char *pos_zero  = "icsh";
+static char      **pos_args  = NULL;
+static int         pos_count = 0;
+
+static unsigned var_hash(const char *name, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static var_t *var_find(const char *name, size_t len) {
+    if (var_nbuckets == 0) return NULL;
+    unsigned h = var_hash(name, len);
+    for (var_t *v = var_buckets[h & (var_nbuckets - 1)]; v != NULL; v = v->next) {
+        if (v->hash == h && v->name_len == len && memcmp(v->kv, name, len) == 0) return v;
+    }
+    return NULL;
+}
+
+// var_get: the value of NAME, or NULL if it is not set.
+static const char *var_get(const char *name) {
+    var_t *v = var_find(name, strlen(name));
+    return v ? v->kv + v->name_len + 1 : NULL;
+}
+
+// A name is letters, digits and '_', not starting with a digit.
+static int name_char(char c, int first) {
+    return c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+           (!first && c >= '0' && c <= '9');
+}
+
+static int valid_var_name(const char *s, size_t len) {
+    if (len == 0) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!name_char(s[i], i == 0)) return 0;
+    }
+    return 1;
+}
+
+static void env_export(var_t *v) {
+    if (v->env_idx >= 0) return;
+    if (env_count + 1 >= env_cap) {
+        int    cap   = env_cap ? env_cap * 2 : 64;
+        char **grown = realloc(env_vec, cap * sizeof(char *));
+        if (grown == NULL) return;
+        env_vec = grown;
+        env_cap = cap;
+        environ = env_vec;   // getenv() and friends see the same environment
+    }
+    v->env_idx           = env_count;
+    env_vec[env_count++] = v->kv;
+    env_vec[env_count]   = NULL;
+}
+
+// I take v out of env_vec[] by moving the last entry into its place.
+static void env_unexport(var_t *v) {
+    if (v->env_idx < 0) return;
+    int last = --env_count;
+    if (v->env_idx != last) {
+        char  *moved = env_vec[last];
+        var_t *mv    = var_find(moved, strchr(moved, '=') - moved);
+        env_vec[v->env_idx] = moved;
+        if (mv != NULL) mv->env_idx = v->env_idx;
+    }
+    env_vec[last] = NULL;
+    v->env_idx    = -1;
+}
+
+// vars_compact: I copy every live variable into a fresh arena and drop the old one.
+static void vars_compact(void) {
+    arena_t fresh = { NULL };
+    var_live = 0;
+    for (int b = 0; b < var_nbuckets; b++) {
+        var_t **pp = &var_buckets[b];
+        for (var_t *v = *pp; v != NULL; v = v->next) {
+            size_t used = strlen(v->kv) + 1;
+            var_t *nv   = arena_alloc(&fresh, sizeof(var_t));
+            *nv         = *v;
+            nv->kv      = arena_strndup(&fresh, v->kv, used - 1);
+            nv->cap     = used;
+            if (nv->env_idx >= 0) env_vec[nv->env_idx] = nv->kv;
+            var_live += sizeof(var_t) + used;
+            *pp = nv;
+            pp  = &nv->next;
+        }
+    }
+    arena_free(&var_arena);
+    var_arena = fresh;
+    var_dead  = 0;
+}
+
+// var_set: NAME=value. An exported variable's env_vec[] entry follows along.
+static void var_set(const char *name, size_t nlen, const char *value, size_t vlen) {
+    size_t need = nlen + 1 + vlen + 1;
+    var_t *v    = var_find(name, nlen);
+    if (v != NULL && need <= v->cap) {
+        memcpy(v->kv + nlen + 1, value, vlen);
+        v->kv[nlen + 1 + vlen] = '\0';
+        return;
+    }
+
+    // room to grow a little, so a counter does not need a new string every time
+    size_t cap = (need + 15) & ~(size_t)15;
+    char  *kv  = arena_alloc(&var_arena, cap);
+    memcpy(kv, name, nlen);
+    kv[nlen] = '=';
+    memcpy(kv + nlen + 1, value, vlen);
+    kv[need - 1] = '\0';
+    var_live += cap;
+
+    if (v != NULL) {
+        var_dead += v->cap;
+        var_live -= v->cap;
+        v->kv     = kv;
+        v->cap    = cap;
+        if (v->env_idx >= 0) env_vec[v->env_idx] = kv;
+    }
+    else {
+        if (var_count >= var_nbuckets) {
+            // grow the table to twice the variables and rehash
+            int     nb    = var_nbuckets ? var_nbuckets * 2 : 64;
+            var_t **table = calloc(nb, sizeof(var_t *));
+            if (table == NULL) return;
+            for (int b = 0; b < var_nbuckets; b++) {
+                for (var_t *o = var_buckets[b], *next; o != NULL; o = next) {
+                    next = o->next;
+                    o->next = table[o->hash & (nb - 1)];
+                    table[o->hash & (nb - 1)] = o;
+                }
+            }
+            free(var_buckets);
+            var_buckets  = table;
+            var_nbuckets = nb;
+        }
+        v = arena_alloc(&var_arena, sizeof(var_t));
+        v->kv       = kv;
+        v->name_len = nlen;
+        v->cap      = cap;
+        v->hash     = var_hash(name, nlen);
+        v->env_idx  = -1;
+        v->next     = var_buckets[v->hash & (var_nbuckets - 1)];
+        var_buckets[v->hash & (var_nbuckets - 1)] = v;
+        var_live += sizeof(var_t);
+        var_count++;
+    }
+    if (var_dead > 65536 && var_dead > var_live) {
+        vars_compact();
+    }
+}
+
+// var_assign: "NAME=value" as one string, the way an assignment word expands.
+static void var_assign(const char *kv) {
+    const char *eq = strchr(kv, '=');
+    var_set(kv, eq - kv, eq + 1, strlen(eq + 1));
+}
+
+static void var_unset(const char *name) {
+    size_t len = strlen(name);
+    var_t *v   = var_find(name, len);
+    if (v == NULL) return;
+    env_unexport(v);
+    for (var_t **pp = &var_buckets[v->hash & (var_nbuckets - 1)]; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == v) {
+            *pp = v->next;
+            break;
+        }
+    }
+    var_dead += v->cap + sizeof(var_t);
+    var_live -= v->cap + sizeof(var_t);
+    var_count--;
+}
+
+// vars_init: I start with my own environment, all of it exported.
+static void vars_init(void) {
+    shell_pid = getpid();
+    for (char **e = environ; e != NULL && *e != NULL; e++) {
+        const char *eq = strchr(*e, '=');
+        if (eq == NULL || !valid_var_name(*e, eq - *e)) continue;
+        var_set(*e, eq - *e, eq + 1, strlen(eq + 1));
+        env_export(var_find(*e, eq - *e));
+    }
+    if (env_vec == NULL) {
+        // nothing exported: children still need an empty, NULL-terminated envp
+        env_cap = 64;
+        env_vec = calloc(env_cap, sizeof(char *));
+        environ = env_vec;
+    }
+}
+
+// Built-in "export": "export NAME[=value]..." exports (and maybe sets) each NAME;
+// plain "export" lists what my children get.
+static void builtin_export(char **args) {
+    last_status = 0;
+    if (args[0] == NULL) {
+        for (int i = 0; i < env_count; i++) {
+            out_printf("export %s\n", env_vec[i]);
+        }
+        return;
+    }
+    for (; *args != NULL; args++) {
+        const char *eq  = strchr(*args, '=');
+        size_t      len = eq ? (size_t)(eq - *args) : strlen(*args);
+        if (!valid_var_name(*args, len)) {
+            fprintf(stderr, "export: '%s': not a valid identifier\n", *args);
+            last_status = 1;
+            continue;
+        }
+        if (eq != NULL) {
+            var_set(*args, len, eq + 1, strlen(eq + 1));
+        } else if (var_find(*args, len) == NULL) {
+            var_set(*args, len, "", 0);
+        }
+        env_export(var_find(*args, len));
+    }
+}
+
+// Built-in "unset": removes each NAME, from the environment too.
+static void builtin_unset(char **args) {
+    for (; *args != NULL; args++) {
+        var_unset(*args);
+    }
+    last_status = 0;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Tracing: where a script's time goes, shell versus children
+// ────────────────────────────────────────────────────────────────────────────
+
+// ICSH_TRACE=file turns tracing on. I time each phase of a command, and each timing is
+// one event: parse (ast_acquire), spawn (launch_external, which with posix_spawn
+// includes the exec), run (launch to reap of each child), reap (one pass of
+// reap_children()), wait (a foreground job), fg (builtin_fg), builtin, and cmd (all of
+// runCmd). Events go into a fixed ring with no locks and no allocation. The ring is
+// drained to the file only when it is half full and at exit, so the file write costs
+// nothing on the path being timed. The file gets JSON lines, or Chrome's trace format
+// (chrome://tracing, Perfetto) with ICSH_TRACE_FORMAT=chrome. It is opened O_APPEND,
+// so icsh processes started by a traced one add their events to the same file. At
+// exit I print a log2 latency histogram per phase to stderr.
+typedef enum {
+    TR_PARSE, TR_SPAWN, TR_RUN, TR_REAP, TR_WAIT, TR_FG, TR_BUILTIN, TR_CMD, TR_NPHASES
+} trace_phase_t;
+
+static const char *const trace_names[TR_NPHASES] = {
+    "parse", "spawn", "run", "reap", "wait", "fg", "builtin", "cmd"
+};
+
+#define TRACE_RING    4096   // a power of two
+#define TRACE_BUCKETS 40     // bucket b holds durations in [2^b, 2^(b+1)) ns
+
+typedef struct {
+    long long start_ns;
+    long long dur_ns;
+    int       phase;
+    int       pid;           // the child it is about, or 0
+    char      what[40];      // command name or line prefix (NUL-terminated)
+} trace_event_t;
+
+static int           trace_fd     = -1;
+static int           trace_chrome = 0;
+static long long     trace_t0     = 0;
+static trace_event_t trace_ring[TRACE_RING];
+static unsigned      trace_head   = 0;   // events recorded
+static unsigned      trace_tail   = 0;   // events written out
+static unsigned long trace_hist[TR_NPHASES][TRACE_BUCKETS];
+static long long     trace_sum[TR_NPHASES], trace_max[TR_NPHASES];
+
+// trace_now: a start timestamp, or 0 when tracing is off so callers skip the clock.
+static long long trace_now(void) {
+    return trace_fd >= 0 ? now_ns() : 0;
+}
+
+// trace_json_str: s (at most n bytes) as a JSON string body.
+static size_t trace_json_str(char *out, const char *s, size_t n) {
+    size_t o = 0;
+    for (size_t i = 0; i < n && s[i]; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            out[o++] = '\\';
+            out[o++] = (char)c;
+        } else if (c < 0x20) {
+            o += sprintf(out + o, "\\u%04x", c);
+        } else {
+            out[o++] = (char)c;
+        }
+    }
+    out[o] = '\0';
+    return o;
+}
+
+// trace_drain: I write out the events recorded since the last drain. A forked copy of
+// me drains its own events before it exits, labelled with its own pid.
+static void trace_drain(void) {
+    char   buf[64 * 1024];
+    size_t len  = 0;
+    int    self = (int)getpid();
+    for (; trace_tail != trace_head; trace_tail++) {
+        const trace_event_t *e = &trace_ring[trace_tail & (TRACE_RING - 1)];
+        char what[6 * sizeof(e->what) + 1];
+        trace_json_str(what, e->what, sizeof(e->what));
+        long long ts = (e->start_ns - trace_t0) / 1000;
+        if (trace_chrome) {
+            len += snprintf(buf + len, sizeof(buf) - len,
+                            "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%.3f,\"pid\":%d,"
+                            "\"tid\":%d,\"args\":{\"what\":\"%s\"}},\n",
+                            trace_names[e->phase], ts, e->dur_ns / 1e3, self,
+                            e->pid ? e->pid : self, what);
+        } else {
+            len += snprintf(buf + len, sizeof(buf) - len,
+                            "{\"ts_us\":%lld,\"phase\":\"%s\",\"dur_us\":%.3f,\"shell\":%d,"
+                            "\"pid\":%d,\"what\":\"%s\"}\n",
+                            ts, trace_names[e->phase], e->dur_ns / 1e3, self, e->pid, what);
+        }
+        if (len > sizeof(buf) - 512) {
+            if (write(trace_fd, buf, len) < 0) break;
+            len = 0;
+        }
+    }
+    if (len > 0 && write(trace_fd, buf, len) < 0) {
+        // nowhere left to complain to; the histogram at exit still has everything
+    }
+}
+
+// trace_forget: a forked copy of me starts with none of my events, written out or not,
+// so nothing reaches the file twice and its histograms are its own.
+static void trace_forget(void) {
+    trace_tail = trace_head;
+    memset(trace_hist, 0, sizeof(trace_hist));
+    memset(trace_sum, 0, sizeof(trace_sum));
+    memset(trace_max, 0, sizeof(trace_max));
+}
+
+// trace_event: a phase that began at start (from trace_now()) ended now.
+static void trace_event(trace_phase_t phase, long long start, int pid, const char *what,
+                        size_t what_len) {
+    if (trace_fd < 0) return;
+    long long dur = now_ns() - start;
+    if (trace_head - trace_tail == TRACE_RING) trace_drain();   // only if nobody drained
+
+    trace_event_t *e = &trace_ring[trace_head & (TRACE_RING - 1)];
+    e->start_ns = start;
+    e->dur_ns   = dur;
+    e->phase    = phase;
+    e->pid      = pid;
+    size_t n    = what_len < sizeof(e->what) - 1 ? what_len : sizeof(e->what) - 1;
+    memcpy(e->what, what, n);
+    e->what[n]  = '\0';
+    trace_head++;
+
+    int b = 0;
+    while (b < TRACE_BUCKETS - 1 && (dur >> (b + 1)) > 0) b++;
+    trace_hist[phase][b]++;
+    trace_sum[phase] += dur;
+    if (dur > trace_max[phase]) trace_max[phase] = dur;
+
+    if (trace_head - trace_tail >= TRACE_RING / 2) trace_drain();
+}
+
+static void trace_fmt_ns(char *buf, size_t size, double ns) {
+    if (ns < 1e3)      snprintf(buf, size, "%.0fns", ns);
+    else if (ns < 1e6) snprintf(buf, size, "%.1fus", ns / 1e3);
+    else if (ns < 1e9) snprintf(buf, size, "%.2fms", ns / 1e6);
+    else               snprintf(buf, size, "%.2fs", ns / 1e9);
+}
+
+// trace_finish (atexit): drain the ring and print the histograms. A percentile is
+// the upper edge of the bucket it falls in (or the max), so it is right to within a
+// factor of 2.
+static void trace_finish(void) {
+    if (trace_fd < 0) return;
+    trace_drain();
+    if (getpid() != shell_pid) return;   // a copy of me that called exit()
+    close(trace_fd);
+    trace_fd = -1;
+
+    fprintf(stderr, "icsh trace: %u events\n%-8s %8s %9s %9s %9s %9s\n", trace_head,
+            "phase", "count", "mean", "p50", "p99", "max");
+    for (int p = 0; p < TR_NPHASES; p++) {
+        unsigned long count = 0, peak = 0;
+        for (int b = 0; b < TRACE_BUCKETS; b++) {
+            count += trace_hist[p][b];
+            if (trace_hist[p][b] > peak) peak = trace_hist[p][b];
+        }
+        if (count == 0) continue;
+        char mean[16], p50[16], p99[16], max[16];
+        unsigned long seen = 0;
+        p50[0] = p99[0] = '\0';
+        for (int b = 0; b < TRACE_BUCKETS; b++) {
+            seen += trace_hist[p][b];
+            double edge = (2LL << b) < trace_max[p] ? (double)(2LL << b) : (double)trace_max[p];
+            if (!p50[0] && seen * 2 >= count)        trace_fmt_ns(p50, sizeof(p50), edge);
+            if (!p99[0] && seen * 100 >= count * 99) trace_fmt_ns(p99, sizeof(p99), edge);
+        }
+        trace_fmt_ns(mean, sizeof(mean), (double)trace_sum[p] / count);
+        trace_fmt_ns(max, sizeof(max), (double)trace_max[p]);
+        fprintf(stderr, "%-8s %8lu %9s %9s %9s %9s\n", trace_names[p], count, mean, p50, p99, max);
+        for (int b = 0; b < TRACE_BUCKETS; b++) {
+            if (trace_hist[p][b] == 0) continue;
+            char lo[16];
+            trace_fmt_ns(lo, sizeof(lo), (double)(1LL << b));
+            int bar = (int)((trace_hist[p][b] * 40 + peak - 1) / peak);
+            fprintf(stderr, "  >=%-8s %-40.*s %lu\n", lo, bar,
+                    "########################################", trace_hist[p][b]);
+        }
+    }
+}
+
+// trace_init: I read ICSH_TRACE and ICSH_TRACE_FORMAT once at startup.
+static void trace_init(void) {
+    const char *file = var_get("ICSH_TRACE");
+    if (file == NULL || *file == '\0') return;
+    trace_fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        fprintf(stderr, "icsh: trace: %s: %s\n", file, strerror(errno));
+        return;
+    }
+    const char *fmt = var_get("ICSH_TRACE_FORMAT");
+    trace_chrome = (fmt != NULL && strcmp(fmt, "chrome") == 0);
+    // a Chrome trace is one JSON array; the viewer accepts it without the closing ']'
+    struct stat sb;
+    if (trace_chrome && fstat(trace_fd, &sb) == 0 && sb.st_size == 0 &&
+        write(trace_fd, "[\n", 2) < 0) {
+        perror("icsh: trace");
+    }
+    trace_t0 = now_ns();
+    atexit(trace_finish);
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Resource limits: ulimit, and a cgroup v2 directory per job
+// ────────────────────────────────────────────────────────────────────────────
+
+// Built-in "ulimit [-H|-S] [-a | -c|-d|-f|-l|-m|-n|-s|-t|-u|-v [value]]". The limits
+// are mine, and every command I start after that inherits them. Without -H or -S I
+// show the soft limit and set both, like bash; with no resource flag it is -f.
+typedef struct {
+    char        opt;
+    int         resource;
+    int         unit;       // bytes per unit of the value the user types
+    const char *desc;
+} ulimit_t;
+
+static const ulimit_t ulimits[] = {
+    { 'c', RLIMIT_CORE,    1024, "core file size (blocks)" },
+    { 'd', RLIMIT_DATA,    1024, "data seg size (kbytes)" },
+    { 'f', RLIMIT_FSIZE,   512,  "file size (blocks)" },
+    { 'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)" },
+    { 'm', RLIMIT_RSS,     1024, "max memory size (kbytes)" },
+    { 'n', RLIMIT_NOFILE,  1,    "open files" },
+    { 's', RLIMIT_STACK,   1024, "stack size (kbytes)" },
+    { 't', RLIMIT_CPU,     1,    "cpu time (seconds)" },
+    { 'u', RLIMIT_NPROC,   1,    "max user processes" },
+    { 'v', RLIMIT_AS,      1024, "virtual memory (kbytes)" },
+};
+
+#define NULIMITS (int)(sizeof(ulimits) / sizeof(ulimits[0]))
+
+static void ulimit_show(const ulimit_t *u, int hard, int label) {
+    struct rlimit rl;
+    getrlimit(u->resource, &rl);
+    rlim_t v = hard ? rl.rlim_max : rl.rlim_cur;
+    if (label) out_printf("%-28s (-%c) ", u->desc, u->opt);
+    if (v == RLIM_INFINITY) out_printf("unlimited\n");
+    else                    out_printf("%llu\n", (unsigned long long)(v / u->unit));
+}
+
+static void builtin_ulimit(char **args) {
+    int hard = 0, soft = 0, all = 0;
+    const ulimit_t *u = &ulimits[2];   // -f
+    for (; *args != NULL && (*args)[0] == '-' && (*args)[1] != '\0'; args++) {
+        for (const char *o = *args + 1; *o; o++) {
+            if (*o == 'H') hard = 1;
+            else if (*o == 'S') soft = 1;
+            else if (*o == 'a') all = 1;
+            else {
+                int i = 0;
+                while (i < NULIMITS && ulimits[i].opt != *o) i++;
+                if (i == NULIMITS) {
+                    fprintf(stderr, "icsh: ulimit: -%c: invalid option\n", *o);
+                    last_status = 2;
+                    return;
+                }
+                u = &ulimits[i];
+            }
+        }
+    }
+    last_status = 0;
+    if (all) {
+        for (int i = 0; i < NULIMITS; i++) ulimit_show(&ulimits[i], hard && !soft, 1);
+        return;
+    }
+    if (*args == NULL) {
+        ulimit_show(u, hard && !soft, 0);
+        return;
+    }
+
+    rlim_t v;
+    if (strcmp(*args, "unlimited") == 0) {
+        v = RLIM_INFINITY;
+    } else {
+        char *end;
+        unsigned long long n = strtoull(*args, &end, 10);
+        if (**args == '\0' || *end != '\0' || **args == '-') {
+            fprintf(stderr, "icsh: ulimit: %s: invalid number\n", *args);
+            last_status = 1;
+            return;
+        }
+        v = (rlim_t)n * u->unit;
+    }
+    struct rlimit rl;
+    getrlimit(u->resource, &rl);
+    if (hard || !soft) rl.rlim_max = v;
+    if (soft || !hard) rl.rlim_cur = v;
+    if (setrlimit(u->resource, &rl) < 0) {
+        fprintf(stderr, "icsh: ulimit: %s\n", strerror(errno));
+        last_status = 1;
+    }
+}
+
+// With ICSH_CGROUP set to a cgroup v2 directory I may write to (a delegated subtree),
+// every pipeline I launch gets a child directory of its own there, icsh-<pid>-<n>,
+// and its processes join it before they exec. ICSH_JOB_CPU ("50%", a share of one
+// CPU) and ICSH_JOB_MEM ("512M") become its cpu.max and memory.max. The directory
+// is removed when the job is done. ICSH_CGROUP itself must hold no processes, or the
+// kernel will not enable the cpu and memory controllers below it.
+static int launch_cg_fd = -1;   // cgroup.procs of the job being launched, or -1
+static int cg_seq       = 0;
+
+// parse_size: "512", "64K", "512M", "2G" → bytes. I return -1 if it is not a size.
+static long long parse_size(const char *s) {
+    char     *end;
+    long long v = strtoll(s, &end, 10);
+    if (*s < '0' || *s > '9' || v < 0) return -1;
+    switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+        case 'g': case 'G': v <<= 30; end++; break;
+    }
+    return (*end == '\0') ? v : -1;
+}
+
+static int cg_write(const char *dir, const char *file, const char *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t w = write(fd, value, strlen(value));
+    close(fd);
+    return (w < 0) ? -1 : 0;
+}
+
+// cg_read_key: the number after "key " in a flat-keyed file like cpu.stat, or the
+// whole file when key is NULL (memory.current). -1 if I cannot read it.
+static long long cg_read_key(const char *dir, const char *file, const char *key) {
+    char path[PATH_MAX], buf[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t r = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (r <= 0) return -1;
+    buf[r] = '\0';
+    if (key == NULL) return atoll(buf);
+    size_t klen = strlen(key);
+    for (char *line = buf; line != NULL && *line; ) {
+        if (strncmp(line, key, klen) == 0 && line[klen] == ' ') return atoll(line + klen + 1);
+        line = strchr(line, '\n');
+        if (line != NULL) line++;
+    }
+    return -1;
+}
+
+// cg_cpu_max / cg_mem_max: a user's limit as the text for cpu.max / memory.max.
+static int cg_cpu_max(const char *spec, char *out, size_t size) {
+    if (strcmp(spec, "max") == 0) {
+        snprintf(out, size, "max 100000");
+        return 0;
+    }
+    char  *end;
+    double pct = strtod(spec, &end);
+    if (end == spec || (*end != '\0' && strcmp(end, "%") != 0) || pct <= 0) return -1;
+    long long quota = (long long)(pct * 1000);   // microseconds per 100ms period
+    snprintf(out, size, "%lld 100000", quota < 1000 ? 1000 : quota);
+    return 0;
+}
+
+static int cg_mem_max(const char *spec, char *out, size_t size) {
+    if (strcmp(spec, "max") == 0) {
+        snprintf(out, size, "max");
+        return 0;
+    }
+    long long v = parse_size(spec);
+    if (v < 0) return -1;
+    snprintf(out, size, "%lld", v);
+    return 0;
+}
+
+// cgroup_create: a fresh cgroup for the next job. I return its path (malloc'd) and
+// the open cgroup.procs in *procs_fd, or NULL when cgroups are off or it failed
+// (then I have said why, once).
+static char *cgroup_create(int *procs_fd) {
+    static int warned = 0;
+    const char *parent = var_get("ICSH_CGROUP");
+    if (parent == NULL || *parent == '\0') return NULL;
+    const char *cpu = var_get("ICSH_JOB_CPU");
+    const char *mem = var_get("ICSH_JOB_MEM");
+    char cpu_max[64], mem_max[64];
+    if ((cpu && cg_cpu_max(cpu, cpu_max, sizeof(cpu_max)) < 0) ||
+        (mem && cg_mem_max(mem, mem_max, sizeof(mem_max)) < 0)) {
+        if (!warned++) fprintf(stderr, "icsh: cgroup: bad ICSH_JOB_CPU or ICSH_JOB_MEM\n");
+        return NULL;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/icsh-%d-%d", parent, (int)shell_pid, ++cg_seq);
+    if (mkdir(path, 0755) < 0) {
+        if (!warned++) fprintf(stderr, "icsh: cgroup: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    // the controllers must be on in the parent before the child has the files
+    const char *failed = NULL;
+    if (cpu && (cg_write(parent, "cgroup.subtree_control", "+cpu") < 0 ||
+                cg_write(path, "cpu.max", cpu_max) < 0))    failed = "cpu.max";
+    if (mem && (cg_write(parent, "cgroup.subtree_control", "+memory") < 0 ||
+                cg_write(path, "memory.max", mem_max) < 0)) failed = "memory.max";
+    char procs[PATH_MAX + 16];
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", path);
+    *procs_fd = (failed == NULL) ? open(procs, O_WRONLY | O_CLOEXEC) : -1;
+    if (*procs_fd < 0) {
+        if (!warned++) {
+            fprintf(stderr, "icsh: cgroup: cannot set %s: %s\n", failed ? failed : "cgroup.procs",
+                    strerror(errno));
+        }
+        rmdir(path);
+        return NULL;
+    }
+    return strdup(path);
+}
+
+// cgroup_remove: the job is done. If something it left behind still runs there, the
+// rmdir fails and the directory stays, which is what I want.
+static void cgroup_remove(char *path) {
+    if (path == NULL) return;
+    rmdir(path);
+    free(path);
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Job output capture: per-job logs for joblog
+// ────────────────────────────────────────────────────────────────────────────
+
+// With ICSH_JOBLOG=1, a background job's stdout and stderr go into a pipe instead of
+// onto the terminal, so what many jobs print does not run into my prompt. I drain
+// the pipe from the event loop into the job's log: a ring that starts as JOBLOG_MEM
+// bytes of memory and, once the job outgrows that, moves into a mapping of an
+// unlinked temporary file of ICSH_JOBLOG_MAX bytes (default 16M). The ring keeps the
+// last that many bytes; total counts all of them. "joblog %N" prints it.
+#define JOBLOG_MEM (64 * 1024)
+#define JOBLOG_MAX (16LL << 20)
+
+typedef struct joblog {
+    int            fd;       // read end of the job's pipe, -1 after EOF
+    char          *ring;     // cap bytes: malloc'd, or the file mapping once mapped
+    size_t         cap;
+    size_t         max;      // how big the ring may get by spilling to the file
+    long long      total;    // bytes read so far; the ring holds the last min(total, cap)
+    int            mapped;
+    int            refs;     // the job (or its done_ring[] record), and joblog --follow
+    int            echo;     // the job is in the foreground: what I read goes to stdout too
+    struct joblog *next;     // logs whose pipe is still open, polled by wait_for_events()
+} joblog_t;
+
+static joblog_t *open_logs  = NULL;
+static int       nopen_logs = 0;
+static int       joblogs_off = 0;   // in a forked copy of me, which has nobody to drain them
+
+static void joblog_free(joblog_t *l) {
+    if (l->mapped) munmap(l->ring, l->cap);
+    else           free(l->ring);
+    free(l);
+}
+
+// joblog_open: a log for the job I am about to launch, if ICSH_JOBLOG asks for one.
+// *wfd gets the write end of its pipe (close-on-exec: the launch dups it onto 1 and 2,
+// and I close it once the job is running).
+static joblog_t *joblog_open(int *wfd) {
+    const char *v = var_get("ICSH_JOBLOG");
+    if (joblogs_off || v == NULL || *v == '\0' || strcmp(v, "0") == 0) return NULL;
+
+    const char *m   = var_get("ICSH_JOBLOG_MAX");
+    long long   max = (m != NULL) ? parse_size(m) : -1;
+    if (max <= 0) max = JOBLOG_MAX;
+
+    int       p[2];
+    joblog_t *l = calloc(1, sizeof(*l));
+    if (l != NULL) {
+        l->max = max;
+        l->cap = max < JOBLOG_MEM ? max : JOBLOG_MEM;
+        l->ring = malloc(l->cap);
+    }
+    if (l == NULL || l->ring == NULL || pipe2(p, O_CLOEXEC) < 0) {
+        perror("icsh: joblog");
+        if (l != NULL) free(l->ring);
+        free(l);
+        return NULL;
+    }
+    // only my end is non-blocking: a job that fills the pipe waits for me to drain it
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    l->fd     = p[0];
+    l->refs   = 1;
+    l->next   = open_logs;
+    open_logs = l;
+    nopen_logs++;
+    *wfd = p[1];
+    return l;
+}
+
+// joblog_release: one holder of l lets go. It goes away once nobody holds it and its
+// pipe is closed; until then I keep draining the pipe, so whatever the job left
+// running behind it never blocks on a full pipe.
+static void joblog_release(joblog_t *l) {
+    if (l == NULL) return;
+    if (--l->refs == 0 && l->fd < 0) joblog_free(l);
+}
+
+static void joblog_close(joblog_t *l) {
+    close(l->fd);
+    l->fd = -1;
+    for (joblog_t **pp = &open_logs; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == l) {
+            *pp = l->next;
+            nopen_logs--;
+            break;
+        }
+    }
+    if (l->refs == 0) joblog_free(l);
+}
+
+// joblog_spill: the memory ring is full and may grow. I move it into a mapping of an
+// unlinked file in $TMPDIR, whose pages the kernel can write back rather than keep
+// in my heap. If that fails, the ring stays where it is and wraps.
+static void joblog_spill(joblog_t *l) {
+    const char *dir = var_get("TMPDIR");
+    int   fd  = open(dir != NULL && *dir ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    char *map = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, l->max) == 0) {
+        map = mmap(NULL, l->max, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0) close(fd);
+    if (map == MAP_FAILED) {
+        l->max = l->cap;
+        return;
+    }
+    memcpy(map, l->ring, l->cap);   // it never wrapped, so it is already in order
+    free(l->ring);
+    l->ring   = map;
+    l->cap    = l->max;
+    l->mapped = 1;
+}
+
+// joblog_read: the job's pipe is readable. I read straight into the ring, a few times
+// at most so one chatty job cannot hold up the loop, and close the pipe at EOF.
+static void joblog_read(joblog_t *l) {
+    for (int k = 0; k < 16 && l->fd >= 0; k++) {
+        if (!l->mapped && (size_t)l->total >= l->cap && l->cap < l->max) joblog_spill(l);
+        size_t  off = l->total % l->cap;
+        ssize_t n   = read(l->fd, l->ring + off, l->cap - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return;
+        if (n <= 0) {
+            joblog_close(l);
+            return;
+        }
+        l->total += n;
+        if (l->echo) {
+            struct iovec iov = { l->ring + off, n };
+            tty_writev(&iov, 1);
+        }
+    }
+}
+
+// joblog_write: bytes from..total of l to stdout, or as many of them as the ring still
+// holds (I say how many are gone). I return where the next call should start.
+static long long joblog_write(joblog_t *l, long long from) {
+    long long first = l->total > (long long)l->cap ? l->total - (long long)l->cap : 0;
+    if (from < first) {
+        fprintf(stderr, "joblog: %lld earlier bytes dropped\n", first - from);
+        from = first;
+    }
+    size_t       off = from % l->cap, len = l->total - from;
+    struct iovec iov[2];
+    int          n = 0;
+    if (len > 0) iov[n++] = (struct iovec){ l->ring + off, len < l->cap - off ? len : l->cap - off };
+    if (len > l->cap - off) iov[n++] = (struct iovec){ l->ring, len - (l->cap - off) };
+    if (n > 0) tty_writev(iov, n);
+    return l->total;
+}
+
+// joblogs_forget: in a forked copy of me. The pipes are the shell's to drain, not the
+// copy's; the copy only closes its duplicates of them. Its own background jobs print
+// wherever it prints, since it may be gone before they are.
+static void joblogs_forget(void) {
+    joblogs_off = 1;
+    for (joblog_t *l = open_logs; l != NULL; l = l->next) {
+        close(l->fd);
+        l->fd = -1;
+    }
+    open_logs  = NULL;
+    nopen_logs = 0;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Milestone 6: job table + SIGCHLD reaping + built-in job control
+
+typedef enum { JOB_RUNNING, JOB_STOPPED } job_state_t;
+
+// A job is a whole pipeline, so I keep every stage's PID. A stage that has exited
+// gets its slot set to 0 and nlive goes down; the job is Done when nlive hits 0.
+typedef struct job {
+    int          id;               // my job ID (1, 2, 3, …)
+    pid_t        pgid;             // process group of the pipeline, 0 without job control
+    pid_t        pids[MAX_STAGES]; // child PIDs, one per stage (0 once reaped)
+    int          npids;            // how many stages I launched
+    int          nlive;            // how many of them have not exited yet
+    pid_t        last_pid;         // PID of the last stage, which is what I print
+    job_state_t  state;            // either JOB_RUNNING or JOB_STOPPED
+    char        *cmdline;          // the full command line I launched (malloc'd, owned by the table)
+    long long    start_ns;         // now_ns() when I launched it
+    struct rusage ru;              // summed over the stages reaped so far (wait4)
+    char        *cgroup;           // its cgroup directory (malloc'd, owned like cmdline), or NULL
+    struct termios tmodes;         // its terminal modes when it stopped (if has_tmodes)
+    int          has_tmodes;
+    unsigned     deadline;         // ID of its "timeout" deadline, 0 if it has none
+    int          timed_out;        // that deadline fired and I signalled the job
+    joblog_t    *log;              // its captured output (ICSH_JOBLOG), or NULL
+
+    // if set, I call on_done instead of reporting "Done" (used by -j workers)
+    void       (*on_done)(struct job *j, int status);
+    void        *on_done_arg;
+
+    // table bookkeeping, only touched by the job table functions below
+    int          in_use;               // 1 while this slot holds a job
+    int          prev, next;           // live jobs, oldest → newest (next is the free list link too)
+    int          id_next;              // next slot in the same id bucket
+    int          pid_next[MAX_STAGES]; // next pid node in the same pid bucket
+} job_t;
+
+// job_list[] is a growable array of slots. Free slots are chained through .next from
+// free_slot, live jobs form a list from job_head (oldest) to job_tail (newest), and two
+// chained hash tables map a pid or a job ID straight to its slot. A pid node is encoded
+// as slot * MAX_STAGES + stage, so the pid chains live inside the slots themselves.
+// That way inserting, finding and removing a job are all O(1), and removing (which
+// reap_children() does) never allocates.
+static job_t *job_list    = NULL;
+static int    job_cap     = 0;
+static int    num_jobs    = 0;
+static int    free_slot   = -1;
+static int    job_head    = -1;
+static int    job_tail    = -1;
+static int   *pid_buckets = NULL;   // pid hash → first pid node, or -1
+static int   *id_buckets  = NULL;   // job ID hash → first slot, or -1
+static int    nbuckets    = 0;      // always a power of two
+static int    next_job_id = 1;
+
+// fg_job points at the job I am waiting for in the foreground (it is not in job_list[]),
+// and fg_stopped is set when one of its stages stops. fg_job is NULL otherwise.
+static job_t *fg_job         = NULL;
+static int    fg_stopped     = 0;
+static int    fg_interrupted = 0;   // a stage died from SIGINT (Ctrl-C)
+
+// in_wait is set while the wait built-in blocks; Ctrl-C then ends the wait
+// (wait_interrupted) instead of reprinting the prompt.
+static int in_wait          = 0;
+static int wait_interrupted = 0;
+// sigint_seen is set by every Ctrl-C; a loop that only runs built-ins never waits for
+// a child, so it looks at this to know it should stop.
+static int sigint_seen      = 0;
+
+// sig_fd is a signalfd for SIGCHLD, SIGINT and SIGTSTP. I keep those three blocked and
+// read them as events in my main loop, so no signal handler ever runs in the middle of
+// stdio or a job table update.
+static int sig_fd = -1;
+
+// job_control is on when I am interactive on a terminal: then every pipeline gets its
+// own process group and the foreground one owns the terminal. shell_pgid is mine, and
+// the kernel sends Ctrl-C/Ctrl-Z straight to the foreground group, not through me.
+// tty_fd is my own copy of the terminal, so a job whose stdin is redirected can still
+// take the terminal over; shell_tmodes are my terminal settings, put back each time
+// I take the terminal back. launch_fg is set while I launch a foreground pipeline:
+// the stage that founds its process group also makes it the terminal's foreground
+// group, before it execs, so it can never read the terminal while still in the
+// background.
+static int            job_control = 0;
+static pid_t          shell_pgid  = 0;
+static int            tty_fd      = -1;
+static struct termios shell_tmodes;
+static int            launch_fg   = 0;
+
+// in_subshell is set in a copy of me forked to run "( ... )", a command substitution
+// or a background list: exit leaves just the copy, and the copy stops along with the
+// job it waits for, so whoever waits for the copy sees the stop (see wait_for_job()).
+static int in_subshell = 0;
+
+// Multiplicative hashing; nbuckets is a power of two so I can mask.
+static int job_hash(unsigned key) {
+    return (int)((key * 2654435761u) & (unsigned)(nbuckets - 1));
+}
+
+static void pid_index_add(int slot, int k) {
+    int h = job_hash((unsigned)job_list[slot].pids[k]);
+    job_list[slot].pid_next[k] = pid_buckets[h];
+    pid_buckets[h] = slot * MAX_STAGES + k;
+}
+
+static void id_index_add(int slot) {
+    int h = job_hash((unsigned)job_list[slot].id);
+    job_list[slot].id_next = id_buckets[h];
+    id_buckets[h] = slot;
+}
+
+// I unlink stage k of a job from the pid hash (its process was reaped).
+static void pid_index_remove(int slot, int k) {
+    int  node = slot * MAX_STAGES + k;
+    int *pp   = &pid_buckets[job_hash((unsigned)job_list[slot].pids[k])];
+    while (*pp != -1) {
+        if (*pp == node) {
+            *pp = job_list[slot].pid_next[k];
+            return;
+        }
+        pp = &job_list[*pp / MAX_STAGES].pid_next[*pp % MAX_STAGES];
+    }
+}
+
+static void id_index_remove(int slot) {
+    int *pp = &id_buckets[job_hash((unsigned)job_list[slot].id)];
+    while (*pp != -1) {
+        if (*pp == slot) {
+            *pp = job_list[slot].id_next;
+            return;
+        }
+        pp = &job_list[*pp].id_next;
+    }
+}
+
+// I double the slot array and rebuild both hash tables at twice the slot count.
+// Called only from add_job_entry().
+static int grow_job_table(void) {
+    int    new_cap = job_cap ? job_cap * 2 : 16;
+    job_t *slots   = realloc(job_list, new_cap * sizeof(job_t));
+    int   *pidb    = malloc(2 * new_cap * sizeof(int));
+    int   *idb     = malloc(2 * new_cap * sizeof(int));
+    if (slots == NULL || pidb == NULL || idb == NULL) {
+        if (slots != NULL) job_list = slots;
+        free(pidb);
+        free(idb);
+        return -1;
+    }
+    job_list = slots;
+    for (int i = new_cap - 1; i >= job_cap; i--) {
+        job_list[i].in_use = 0;
+        job_list[i].next   = free_slot;
+        free_slot = i;
+    }
+    job_cap = new_cap;
+
+    free(pid_buckets);
+    free(id_buckets);
+    pid_buckets = pidb;
+    id_buckets  = idb;
+    nbuckets    = 2 * new_cap;
+    for (int h = 0; h < nbuckets; h++) {
+        pid_buckets[h] = -1;
+        id_buckets[h]  = -1;
+    }
+    for (int i = job_head; i != -1; i = job_list[i].next) {
+        id_index_add(i);
+        for (int k = 0; k < job_list[i].npids; k++) {
+            if (job_list[i].pids[k] > 0) pid_index_add(i, k);
+        }
+    }
+    return 0;
+}
+
+// I look the pid up in the pid hash. I return the job's slot (and the stage in *stage)
+// or -1.
+static int find_job_by_pid(pid_t pid, int *stage) {
+    if (nbuckets == 0) return -1;
+    for (int node = pid_buckets[job_hash((unsigned)pid)]; node != -1; ) {
+        int slot = node / MAX_STAGES, k = node % MAX_STAGES;
+        if (job_list[slot].pids[k] == pid) {
+            if (stage) *stage = k;
+            return slot;
+        }
+        node = job_list[slot].pid_next[k];
+    }
+    return -1;
+}
+
+// I look the job ID up in the id hash. I return its slot or -1.
+static int find_job_by_id(int jid) {
+    if (nbuckets == 0) return -1;
+    for (int slot = id_buckets[job_hash((unsigned)jid)]; slot != -1; slot = job_list[slot].id_next) {
+        if (job_list[slot].id == jid) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// A stage of a job exited: I drop its pid from the index and mark it reaped.
+static void job_stage_done(int slot, int k) {
+    pid_index_remove(slot, k);
+    job_list[slot].pids[k] = 0;
+    job_list[slot].nlive--;
+}
+
+// When a job finishes or is removed, I unlink it from the live list and both indexes
+// and put its slot back on the free list.
+static void remove_job_by_index(int slot) {
+    if (slot < 0 || slot >= job_cap || !job_list[slot].in_use) return;
+    job_t *j = &job_list[slot];
+    for (int k = 0; k < j->npids; k++) {
+        if (j->pids[k] > 0) pid_index_remove(slot, k);
+    }
+    id_index_remove(slot);
+    free(j->cmdline);
+    j->cmdline = NULL;
+    cgroup_remove(j->cgroup);
+    j->cgroup  = NULL;
+    joblog_release(j->log);
+    j->log     = NULL;
+    if (j->prev != -1) job_list[j->prev].next = j->next; else job_head = j->next;
+    if (j->next != -1) job_list[j->next].prev = j->prev; else job_tail = j->prev;
+    j->in_use = 0;
+    j->next   = free_slot;
+    free_slot = slot;
+    num_jobs--;
+}
+
+// usage_add: I fold one reaped process's rusage into a job's total. Times and context
+// switches add up; for memory the interesting number is the biggest stage.
+static void usage_add(struct rusage *acc, const struct rusage *ru) {
+    timeradd(&acc->ru_utime, &ru->ru_utime, &acc->ru_utime);
+    timeradd(&acc->ru_stime, &ru->ru_stime, &acc->ru_stime);
+    if (ru->ru_maxrss > acc->ru_maxrss) acc->ru_maxrss = ru->ru_maxrss;
+    acc->ru_nvcsw  += ru->ru_nvcsw;
+    acc->ru_nivcsw += ru->ru_nivcsw;
+}
+
+// format_usage: the one-line report shared by time and jobs -l.
+static void format_usage(char *buf, size_t size, long long wall_ns, const struct rusage *ru) {
+    snprintf(buf, size, "real %.3fs  user %.3fs  sys %.3fs  maxrss %ldKB  ctxsw %ld/%ld",
+             wall_ns / 1e9,
+             ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+             ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+             ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+// Background jobs leave job_list[] the moment they are reaped, so I keep the last
+// DONE_RING of them here: jobs -l lists them and wait reads their exit status.
+#define DONE_RING 16
+
+typedef struct {
+    int           id;
+    pid_t         last_pid;
+    int           status;     // raw wait status
+    char         *cmdline;    // taken over from the job
+    joblog_t     *log;        // taken over from the job too, so joblog still finds it
+    long long     wall_ns;
+    struct rusage ru;
+} done_job_t;
+
+static done_job_t done_ring[DONE_RING];
+static int        done_total = 0;   // how many jobs were ever recorded
+
+// record_done_job: j just finished; I copy its numbers and take over its cmdline.
+static void record_done_job(job_t *j, int status) {
+    done_job_t *d = &done_ring[done_total % DONE_RING];
+    free(d->cmdline);
+    joblog_release(d->log);
+    d->id       = j->id;
+    d->last_pid = j->last_pid;
+    d->status   = status;
+    d->cmdline  = j->cmdline;
+    d->log      = j->log;
+    d->wall_ns  = now_ns() - j->start_ns;
+    d->ru       = j->ru;
+    j->cmdline  = NULL;
+    j->log      = NULL;
+    done_total++;
+}
+
+// I return the record of finished job jid, or NULL if it is not (or no longer) there.
+static done_job_t *find_done_job(int jid) {
+    int first = done_total > DONE_RING ? done_total - DONE_RING : 0;
+    for (int i = done_total - 1; i >= first; i--) {
+        if (done_ring[i % DONE_RING].id == jid) return &done_ring[i % DONE_RING];
+    }
+    return NULL;
+}
+
+// I send sig to every process of the job: to the whole group if it has one,
+// otherwise to each stage that is still alive.
+static void signal_job(const job_t *j, int sig) {
+    if (j->pgid > 0) {
+        kill(-j->pgid, sig);
+        return;
+    }
+    for (int k = 0; k < j->npids; k++) {
+        if (j->pids[k] > 0) kill(j->pids[k], sig);
+    }
+}
+
+// With job control on, I hand the terminal to a foreground pipeline and take it back after.
+static void give_terminal_to(pid_t pgid) {
+    if (job_control) {
+        tcsetpgrp(tty_fd, pgid);
+    }
+}
+
+// take_terminal_back: j has stopped or finished. A stopped job keeps its terminal
+// modes for fg; either way I get my own modes back, in case it left the terminal raw.
+static void take_terminal_back(job_t *j, int stopped) {
+    if (!job_control) return;
+    if (stopped) j->has_tmodes = (tcgetattr(tty_fd, &j->tmodes) == 0);
+    tcsetpgrp(tty_fd, shell_pgid);
+    tcsetattr(tty_fd, TCSADRAIN, &shell_tmodes);
+}
+
+// init_job_control: job control needs the terminal. If another shell started me in
+// the background I stop myself until it puts me in the foreground, then I make my
+// own process group, so no job of mine ever shares one with me, and take the
+// terminal. I ignore the terminal stop signals and SIGQUIT myself; children get them
+// back (see spawn_external()).
+static void init_job_control(void) {
+    if (!isatty(STDIN_FILENO)) return;
+    pid_t fg;
+    while ((fg = tcgetpgrp(STDIN_FILENO)) >= 0 && fg != getpgrp()) {
+        kill(-getpgrp(), SIGTTIN);
+    }
+    if (fg < 0) return;
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    if (getpgrp() != getpid() && setpgid(0, 0) < 0) {
+        perror("icsh: setpgid");
+        return;
+    }
+    tty_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+    if (tty_fd < 0 || tcgetattr(tty_fd, &shell_tmodes) < 0) {
+        if (tty_fd >= 0) close(tty_fd);
+        tty_fd = -1;
+        return;
+    }
+    shell_pgid  = getpid();
+    tcsetpgrp(tty_fd, shell_pgid);
+    job_control = 1;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Timers: deadlines for timeout, at and every
+// ────────────────────────────────────────────────────────────────────────────
+
+// Every deadline I keep, a job's "timeout" as well as a command scheduled with "at" or
+// "every", is one entry of a binary min-heap ordered by when it is due, and a single
+// CLOCK_MONOTONIC timerfd is armed for the earliest. wait_for_events() polls that fd
+// next to the signalfd, so a deadline fires on time while I sit at the prompt, run a
+// script, or wait for a foreground job, and adding or firing one is O(log n) however
+// many are pending. A finished job drops its deadline; one I miss anyway (the ID is
+// never reused) finds no job and does nothing.
+typedef enum { DL_KILL, DL_RUN } deadline_kind_t;
+
+typedef struct {
+    long long       when;    // now_ns() at which it is due
+    long long       every;   // DL_RUN: the period of an "every", 0 for an "at"
+    long long       grace;   // DL_KILL: "timeout -k", when after sig to send SIGKILL
+    unsigned        id;      // what job_t.deadline or "at -d" refers to (per kind)
+    deadline_kind_t kind;
+    int             sig;     // DL_KILL: the signal to send
+    char           *cmd;     // DL_RUN: the command line (malloc'd, owned by the heap)
+} deadline_t;
+
+static deadline_t *deadlines     = NULL;
+static int         ndeadlines    = 0;
+static int         deadline_cap  = 0;
+static unsigned    next_deadline = 1;   // timeout IDs; "at" numbers its own entries
+static int         timer_fd      = -1;   // created along with the first deadline
+
+// launch_timeout is set by a "timeout" prefix while I launch its pipeline; run_pipeline()
+// gives the job a deadline from it.
+static struct { long long after, grace; int sig; } launch_timeout;
+
+// launch_log is the log of the background pipeline I am launching, if it has one
+// (see joblog_open()); run_pipeline() hands it to the job.
+static joblog_t *launch_log = NULL;
+
+static void deadline_fire(deadline_t *d);
+
+static int deadline_before(int a, int b) {
+    return deadlines[a].when < deadlines[b].when;
+}
+
+static void deadline_swap(int a, int b) {
+    deadline_t t = deadlines[a];
+    deadlines[a] = deadlines[b];
+    deadlines[b] = t;
+}
+
+static int deadline_sift_up(int i) {
+    while (i > 0 && deadline_before(i, (i - 1) / 2)) {
+        deadline_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    return i;
+}
+
+static void deadline_sift_down(int i) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < ndeadlines && deadline_before(l, m)) m = l;
+        if (r < ndeadlines && deadline_before(r, m)) m = r;
+        if (m == i) return;
+        deadline_swap(i, m);
+        i = m;
+    }
+}
+
+// timer_arm: I point the timerfd at the earliest deadline, or disarm it if none is left.
+static void timer_arm(void) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (ndeadlines > 0) {
+        long long when = deadlines[0].when > 0 ? deadlines[0].when : 1;   // 0 would disarm
+        its.it_value.tv_sec  = when / 1000000000LL;
+        its.it_value.tv_nsec = when % 1000000000LL;
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// deadline_add: I put a copy of d in the heap (it takes over d->cmd), with a fresh ID
+// unless it has one, and re-arm the timer if it is now the earliest. I return its ID,
+// or 0 if I could not keep it.
+static unsigned deadline_add(const deadline_t *d) {
+    if (timer_fd < 0) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    }
+    if (timer_fd >= 0 && ndeadlines == deadline_cap) {
+        int         cap   = deadline_cap ? deadline_cap * 2 : 16;
+        deadline_t *grown = realloc(deadlines, cap * sizeof(*grown));
+        if (grown != NULL) {
+            deadlines    = grown;
+            deadline_cap = cap;
+        }
+    }
+    if (timer_fd < 0 || ndeadlines == deadline_cap) {
+        fprintf(stderr, "icsh: cannot keep a timer: %s\n", strerror(errno));
+        free(d->cmd);
+        return 0;
+    }
+    int i = ndeadlines++;
+    deadlines[i] = *d;
+    if (deadlines[i].id == 0) deadlines[i].id = next_deadline++;
+    unsigned id = deadlines[i].id;
+    if (deadline_sift_up(i) == 0) timer_arm();
+    return id;
+}
+
+// deadline_drop: I take that deadline out of the heap, if it is still there.
+static void deadline_drop(deadline_kind_t kind, unsigned id) {
+    for (int i = 0; i < ndeadlines; i++) {
+        if (deadlines[i].id != id || deadlines[i].kind != kind) continue;
+        free(deadlines[i].cmd);
+        deadlines[i] = deadlines[--ndeadlines];
+        if (i < ndeadlines) {
+            deadline_sift_down(i);
+            deadline_sift_up(i);
+        }
+        if (i == 0) timer_arm();
+        return;
+    }
+}
+
+// handle_timer_events: the timerfd went off, so I fire every deadline that is due (a
+// late wakeup may cover several) and arm the timer for the next one.
+static void handle_timer_events(void) {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) return;
+    long long now = now_ns();
+    while (ndeadlines > 0 && deadlines[0].when <= now) {
+        deadline_t d = deadlines[0];
+        deadlines[0] = deadlines[--ndeadlines];
+        deadline_sift_down(0);
+        deadline_fire(&d);
+    }
+    timer_arm();
+}
+
+// deadlines_forget: a forked copy of me must not fire my deadlines, and I must not
+// fire twice what it inherited, so the copy starts with none.
+static void deadlines_forget(void) {
+    for (int i = 0; i < ndeadlines; i++) free(deadlines[i].cmd);
+    ndeadlines = 0;
+    if (timer_fd >= 0) close(timer_fd);
+    timer_fd = -1;
+}
+
+// Whenever a background job changes state (Done, Stopped, Continued), I queue its
+// status line in tty_notes; it starts with "\r" so it overwrites the prompt. A burst of
+// completions goes out with the next prompt in a single write. A job that ended
+// because its timeout fired is "Timed out" instead of "Done".
+static void report_job_status(job_t *j, int status) {
+    const char *what;
+    if ((WIFEXITED(status) || WIFSIGNALED(status)) && j->timed_out) {
+        what = "Timed out   ";
+    }
+    else if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        // the job terminated normally or was killed by a signal
+        what = "Done        ";
+    }
+    else if (WIFSTOPPED(status)) {
+        // the job was stopped by SIGTSTP
+        what = "Stopped     ";
+    }
+    else if (WIFCONTINUED(status)) {
+        // the job was resumed by SIGCONT
+        what = "Continued   ";
+    }
+    else {
+        return;
+    }
+    tty_printf(&tty_notes, "\r[%d]  %s%s\n", j->id, what, j->cmdline);
+}
+
+// flush_job_notices: if there are notices (or a Ctrl-C wants a fresh prompt), I write
+// them with whatever output is queued, plus "icsh $ " when I am sitting at the prompt
+// and have to put it back.
+static void flush_job_notices(int reprint_prompt) {
+    if (tty_notes.len == 0 && !tty_reprompt) return;
+    tty_cycle(reprint_prompt ? "icsh $ " : NULL);
+}
+
+// reap_children: I run this from the main loop whenever signalfd reports SIGCHLD.
+// I loop on waitpid(..., WNOHANG|WUNTRACED|WCONTINUED) to collect every change.
+// Stages of the foreground job update fg_job; for a job in job_list[] I update or
+// remove it and queue a notice. A pipeline only counts as Done when its last stage
+// is gone, and I report a stop or continue once per job, not once per stage.
+static void reap_children(void) {
+    pid_t pid;
+    int status;
+    struct rusage ru;
+    long long t0 = trace_now();
+
+    // keep collecting children that changed state; wait4 also tells me what each one cost
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0) {
+        if (fg_job != NULL) {
+            int k = -1;
+            for (int i = 0; i < fg_job->npids; i++) {
+                if (fg_job->pids[i] == pid) k = i;
+            }
+            if (k >= 0) {
+                if (WIFSTOPPED(status)) {
+                    fg_job->state = JOB_STOPPED;
+                    fg_stopped = 1;
+                }
+                else if (WIFEXITED(status) || WIFSIGNALED(status)) {
+                    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+                        fg_interrupted = 1;
+                    }
+                    if (pid == fg_job->last_pid) {
+                        // if it exited normally or by signal, record its exit code
+                        last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+                    }
+                    usage_add(&fg_job->ru, &ru);
+                    trace_event(TR_RUN, fg_job->start_ns, pid, "foreground", 10);
+                    fg_job->pids[k] = 0;
+                    fg_job->nlive--;
+                }
+                continue;
+            }
+        }
+
+        int stage;
+        int idx = find_job_by_pid(pid, &stage);
+        if (idx >= 0) {
+            job_t *j = &job_list[idx];
+
+            if (WIFEXITED(status) || WIFSIGNALED(status)) {
+                // one stage finished; when all are gone, report "Done" and remove the job
+                usage_add(&j->ru, &ru);
+                const char *what = j->cmdline ? j->cmdline : "";
+                trace_event(TR_RUN, j->start_ns, pid, what, strlen(what));
+                job_stage_done(idx, stage);
+                if (j->nlive == 0) {
+                    // a timed-out job exits 124, like timeout(1) says, for wait
+                    if (j->deadline) deadline_drop(DL_KILL, j->deadline);
+                    if (j->timed_out) status = W_EXITCODE(124, 0);
+                    if (j->on_done != NULL) j->on_done(j, status);
+                    else                    report_job_status(j, status);
+                    record_done_job(j, status);
+                    remove_job_by_index(idx);
+                }
+            }
+            else if (WIFSTOPPED(status)) {
+                // job was stopped: mark as stopped, then report "Stopped"
+                if (j->state != JOB_STOPPED) {
+                    j->state = JOB_STOPPED;
+                    report_job_status(j, status);
+                }
+            }
+            else if (WIFCONTINUED(status)) {
+                // job was resumed: mark as running, then report "Continued"
+                if (j->state != JOB_RUNNING) {
+                    j->state = JOB_RUNNING;
+                    report_job_status(j, status);
+                }
+            }
+        }
+        // anything else (a feeder helper I already forgot about) is just reaped
+    }
+    trace_event(TR_REAP, t0, 0, "", 0);
+}
+
+// Ctrl-C / Ctrl-Z arrive as events. With a foreground job I pass the signal on to the
+// whole job (with job control the kernel already sent it there, without it the job
+// shares my process group); otherwise I just reprint the prompt.
+// The newline only gets queued; the prompt comes from flush_job_notices().
+static void on_terminal_signal(int sig) {
+    if (sig == SIGINT) sigint_seen = 1;
+    tty_put(&tty_out, "\n", 1);
+    if (fg_job != NULL) {
+        signal_job(fg_job, sig);
+    } else if (in_wait) {
+        if (sig == SIGINT) wait_interrupted = 1;
+    } else {
+        tty_reprompt = 1;
+    }
+}
+
+// handle_signal_events: I drain the signalfd. Many SIGCHLDs collapse into one
+// reap_children() pass.
+static void handle_signal_events(void) {
+    struct signalfd_siginfo si[16];
+    int     chld = 0;
+    ssize_t n;
+    while ((n = read(sig_fd, si, sizeof(si))) > 0) {
+        for (size_t i = 0; i < n / sizeof(si[0]); i++) {
+            if (si[i].ssi_signo == SIGCHLD) chld = 1;
+            else on_terminal_signal(si[i].ssi_signo);
+        }
+    }
+    if (chld) {
+        reap_children();
+    }
+}
+
+// While I wait for the commands of a command substitution, subst_fd is the read end
+// of the pipe they write to, and I drain it into subst_q as I go, so a command that
+// prints more than a pipe holds never blocks (see cmd_subst()).
+static int          subst_fd = -1;
+static tty_queue_t *subst_q  = NULL;
+
+// subst_read: one read() from fd onto the end of q. I return what read() did.
+static ssize_t subst_read(int fd, tty_queue_t *q) {
+    if (tty_reserve(q, 16384) < 0) return -1;
+    ssize_t n = read(fd, q->buf + q->len, q->cap - q->len);
+    if (n < 0 && errno == EINTR) return 1;
+    if (n > 0) q->len += n;
+    return n;
+}
+
+// wait_for_events: the heart of my event loop. I poll the signalfd, the timerfd, the
+// pipes of the job logs and, if input_fd is not -1, that input too. Log, signal and
+// timer events are handled right here. I return 1 when input_fd is readable (or hung
+// up), 0 on timeout or after handling events.
+static int wait_for_events(int input_fd, int timeout_ms) {
+    static struct pollfd *pfd     = NULL;
+    static joblog_t     **pfd_log = NULL;   // the log behind pfd[4 + i]
+    static int            pfd_cap = 0;
+
+    if (timeout_ms != 0) tty_sync();   // about to block: what I printed must be visible
+    if (4 + nopen_logs > pfd_cap) {
+        int   cap = pfd_cap ? pfd_cap : 16;
+        while (cap < 4 + nopen_logs) cap *= 2;
+        void *a = realloc(pfd, cap * sizeof(*pfd));
+        if (a != NULL) pfd = a;
+        void *b = realloc(pfd_log, cap * sizeof(*pfd_log));
+        if (b != NULL) pfd_log = b;
+        if (a != NULL && b != NULL) pfd_cap = cap;
+    }
+    if (pfd_cap == 0) return 0;
+    pfd[0] = (struct pollfd){ .fd = sig_fd,   .events = POLLIN };
+    pfd[1] = (struct pollfd){ .fd = input_fd, .events = POLLIN };
+    pfd[2] = (struct pollfd){ .fd = subst_fd, .events = POLLIN };   // poll() skips an fd of -1
+    pfd[3] = (struct pollfd){ .fd = timer_fd, .events = POLLIN };
+    int npfd = 4;
+    for (joblog_t *l = open_logs; l != NULL && npfd < pfd_cap; l = l->next) {
+        pfd_log[npfd - 4] = l;
+        pfd[npfd++] = (struct pollfd){ .fd = l->fd, .events = POLLIN };
+    }
+    int n = poll(pfd, npfd, timeout_ms);
+    if (n <= 0) {
+        return 0;
+    }
+    // the handlers below may end up back in here and reuse pfd[], so I take what I need
+    // first, and drain the logs before a job's exit is reported
+    short sig_ev = pfd[0].revents, in_ev = pfd[1].revents;
+    short sub_ev = pfd[2].revents, timer_ev = pfd[3].revents;
+    for (int i = 4; i < npfd; i++) {
+        if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) joblog_read(pfd_log[i - 4]);
+    }
+    if (sig_ev & POLLIN) {
+        handle_signal_events();
+    }
+    if (timer_ev & POLLIN) {
+        handle_timer_events();
+    }
+    if ((sub_ev & (POLLIN | POLLHUP | POLLERR)) && subst_read(subst_fd, subst_q) <= 0) {
+        subst_fd = -1;   // no more writers: the rest is picked up after the wait
+    }
+    return input_fd >= 0 && (in_ev & (POLLIN | POLLHUP | POLLERR)) != 0;
+}
+
+// I copy a finished-launching job into a free slot of job_list[] with a fresh ID
+// (the slot takes over tmpl->cmdline),
+// index it, append it to the live list and return it.
+// If the table cannot grow, I print an error and return NULL.
+static job_t *add_job_entry(const job_t *tmpl, job_state_t state) {
+    if (free_slot == -1 && grow_job_table() < 0) {
+        fprintf(stderr, "icsh: cannot add job: out of memory\n");
+        free(tmpl->cmdline);
+        cgroup_remove(tmpl->cgroup);
+        joblog_release(tmpl->log);
+        return NULL;
+    }
+    int slot  = free_slot;
+    job_t *j  = &job_list[slot];
+    free_slot = j->next;
+
+    *j = *tmpl;
+    j->id     = next_job_id++;
+    j->state  = state;
+    j->in_use = 1;
+    j->prev   = job_tail;
+    j->next   = -1;
+    if (job_tail != -1) job_list[job_tail].next = slot; else job_head = slot;
+    job_tail  = slot;
+    num_jobs++;
+
+    id_index_add(slot);
+    for (int k = 0; k < j->npids; k++) {
+        if (j->pids[k] > 0) pid_index_add(slot, k);
+    }
+    return j;
+}
+
+// When I launch a new background job, I add it to job_list[] and print its job ID and
+// the PID of its last stage.
+static void add_job(const job_t *tmpl) {
+    job_t *j = add_job_entry(tmpl, JOB_RUNNING);
+    if (j == NULL) return;
+
+    // show "[jobID] pid" (a pipeline ending in echo has no last process, so I show its newest)
+    tty_printf(&tty_out, "[%d] %d\n", j->id, j->last_pid ? j->last_pid : j->pids[j->npids - 1]);
+}
+
+// A foreground job got stopped by Ctrl-Z: I keep it as a stopped job and queue
+// "[id]  Stopped  cmdline" for the next prompt.
+static void add_stopped_job(const job_t *tmpl) {
+    job_t *j = add_job_entry(tmpl, JOB_STOPPED);
+    if (j == NULL) return;
+    tty_printf(&tty_notes, "\r[%d]  Stopped     %s\n", j->id, j->cmdline);
+}
+
+// wait_for_job: I make j the foreground job and run the event loop until every stage
+// has exited or one of them stops. I return 1 if it stopped. The exit status of the
+// last stage becomes last_status, like in other shells.
+static int wait_for_job(job_t *j) {
+    tty_sync();   // the job owns the terminal now, so my output must be out first
+    long long t0   = trace_now();
+    fg_job         = j;
+    fg_stopped     = 0;
+    fg_interrupted = 0;
+    for (;;) {
+        while (j->nlive > 0 && !fg_stopped) {
+            wait_for_events(-1, -1);
+        }
+        // SIGCONT to my process group (fg in the shell that waits for me) wakes the
+        // job and me together, and I go back to waiting for it
+        if (!fg_stopped || !in_subshell) break;
+        raise(SIGSTOP);
+        fg_stopped = 0;
+    }
+    fg_job = NULL;
+    trace_event(TR_WAIT, t0, j->last_pid, "", 0);
+
+    // a job that is done has no use for its deadline; if that fired, it exits 124
+    if (!fg_stopped && j->deadline) {
+        deadline_drop(DL_KILL, j->deadline);
+        if (j->timed_out) last_status = 124;
+    }
+
+    // with job control the Ctrl-C went straight to the job, so I add the newline myself
+    if (fg_interrupted && job_control) {
+        tty_put(&tty_out, "\n", 1);
+    }
+    return fg_stopped;
+}
+
+// job_live_usage: what a running job costs right now. With a cgroup that is its
+// cpu.stat and memory.current, which also count the stages already gone; otherwise I
+// add up /proc/<pid>/stat and statm of the live stages, plus the reaped ones' rusage.
+static void job_live_usage(const job_t *j, double *cpu_s, long *rss_kb) {
+    long long usec = j->cgroup ? cg_read_key(j->cgroup, "cpu.stat", "usage_usec") : -1;
+    long long mem  = j->cgroup ? cg_read_key(j->cgroup, "memory.current", NULL) : -1;
+    *cpu_s  = (usec >= 0) ? usec / 1e6 : j->ru.ru_utime.tv_sec + j->ru.ru_utime.tv_usec / 1e6 +
+                                         j->ru.ru_stime.tv_sec + j->ru.ru_stime.tv_usec / 1e6;
+    *rss_kb = (mem >= 0) ? (long)(mem / 1024) : 0;
+
+    long ticks = sysconf(_SC_CLK_TCK), page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    for (int k = 0; k < j->npids; k++) {
+        if (j->pids[k] <= 0) continue;
+        char path[64], buf[1024];
+        if (usec < 0) {
+            snprintf(path, sizeof(path), "/proc/%d/stat", (int)j->pids[k]);
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            ssize_t r = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+            if (fd >= 0) close(fd);
+            char *p = r > 0 ? (buf[r] = '\0', strrchr(buf, ')')) : NULL;
+            unsigned long ut, st;
+            // after "pid (comm)": state, then 10 fields before utime and stime
+            if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                            &ut, &st) == 2) {
+                *cpu_s += (double)(ut + st) / ticks;
+            }
+        }
+        if (mem < 0) {
+            snprintf(path, sizeof(path), "/proc/%d/statm", (int)j->pids[k]);
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            ssize_t r = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+            if (fd >= 0) close(fd);
+            long size, resident;
+            if (r > 0 && (buf[r] = '\0', sscanf(buf, "%ld %ld", &size, &resident) == 2)) {
+                *rss_kb += resident * page_kb;
+            }
+        }
+    }
+}
+
+// Built-in "jobs": I walk the live list from oldest to newest, and for each job I print
+// its ID, then "Running" or "Stopped", then the saved cmdline plus "&".
+// "jobs -l" adds the last PID, what the reaped stages cost, and the CPU time and
+// memory of the whole job right now (job_live_usage()), and then lists the recently
+// finished jobs from done_ring[] with their final numbers. A job with a log (see
+// joblog_open()) also shows how many bytes it has printed.
+static void builtin_jobs(char **args) {
+    int  long_fmt = (args[0] != NULL && strcmp(args[0], "-l") == 0);
+    char usage[160], logged[48];
+    for (int i = job_head; i != -1; i = job_list[i].next) {
+        job_t *j = &job_list[i];
+        const char *st = (j->state == JOB_RUNNING ? "Running" : "Stopped");
+        logged[0] = '\0';
+        if (j->log != NULL) snprintf(logged, sizeof(logged), "  (%lld bytes)", j->log->total);
+        if (!long_fmt) {
+            out_printf("[%d] %s %s &%s\n", j->id, st, j->cmdline, logged);
+            continue;
+        }
+        double cpu_s;
+        long   rss_kb;
+        format_usage(usage, sizeof(usage), now_ns() - j->start_ns, &j->ru);
+        job_live_usage(j, &cpu_s, &rss_kb);
+        out_printf("[%d] %d %s  %s  now cpu %.3fs rss %ldKB%s  %s &%s\n", j->id,
+               j->last_pid ? j->last_pid : j->pids[0], st, usage, cpu_s, rss_kb,
+               j->cgroup ? " (cgroup)" : "", j->cmdline, logged);
+    }
+    if (!long_fmt) return;
+
+    int first = done_total > DONE_RING ? done_total - DONE_RING : 0;
+    for (int i = first; i < done_total; i++) {
+        done_job_t *d = &done_ring[i % DONE_RING];
+        format_usage(usage, sizeof(usage), d->wall_ns, &d->ru);
+        int code = WIFEXITED(d->status) ? WEXITSTATUS(d->status) : 128 + WTERMSIG(d->status);
+        logged[0] = '\0';
+        if (d->log != NULL) snprintf(logged, sizeof(logged), "  (%lld bytes)", d->log->total);
+        out_printf("[%d] %d Done(%d)  %s  %s%s\n", d->id, d->last_pid, code, usage, d->cmdline,
+                   logged);
+    }
+}
+
+// Built-in "fg": bring a stopped or background job to the foreground.
+// If arg is NULL, I pick the most recent job. Otherwise I parse the job ID (allowing a leading '%').
+// If that job was stopped, I send SIGCONT. Then I remove it from job_list and wait for it.
+// If it stops again (WIFSTOPPED), I re-add it as a stopped job. Otherwise I store its exit code.
+static void builtin_fg(char *arg) {
+    int jid;
+    if (arg == NULL) {
+        // no argument → pick most recent job
+        if (num_jobs == 0) {
+            fprintf(stderr, "fg: no current job\n");
+            last_status = 1;
+            return;
+        }
+        jid = job_list[job_tail].id;
+    }
+    else {
+        if (arg[0] == '%') arg++;
+        jid = atoi(arg);
+        if (jid == 0) {
+            fprintf(stderr, "fg: invalid job ID %s\n", arg);
+            last_status = 1;
+            return;
+        }
+    }
+    int idx = find_job_by_id(jid);
+    if (idx < 0) {
+        fprintf(stderr, "fg: no such job %d\n", jid);
+        last_status = 1;
+        return;
+    }
+
+    job_t     j  = job_list[idx];
+    long long t0 = trace_now();
+
+    // remove it from job_list since it's going to run in foreground (I keep its cmdline
+    // and cgroup)
+    job_list[idx].cmdline = NULL;
+    job_list[idx].cgroup  = NULL;
+    job_list[idx].log     = NULL;
+    remove_job_by_index(idx);
+
+    // print the command before blocking (like "sleep 20"); wait_for_job() writes it out
+    tty_printf(&tty_out, "%s\n", j.cmdline);
+
+    // if it was stopped, resume it, with the terminal set up the way it left it
+    give_terminal_to(j.pgid);
+    if (job_control && j.has_tmodes) tcsetattr(tty_fd, TCSADRAIN, &j.tmodes);
+    if (j.state == JOB_STOPPED) {
+        signal_job(&j, SIGCONT);
+        j.state = JOB_RUNNING;
+    }
+
+    // wait for it in foreground (allow catching Stop or exit); what it prints into its
+    // log shows up on the terminal as well while it is there
+    if (j.log != NULL) j.log->echo = 1;
+    int stopped = wait_for_job(&j);
+    take_terminal_back(&j, stopped);
+    if (j.log != NULL) j.log->echo = 0;
+
+    // if it got stopped again, re-add as a stopped job (the table takes the cmdline back)
+    const char *what = j.cmdline ? j.cmdline : "";
+    trace_event(TR_FG, t0, j.last_pid, what, strlen(what));
+    if (stopped) {
+        add_stopped_job(&j);
+    } else {
+        free(j.cmdline);
+        cgroup_remove(j.cgroup);
+        joblog_release(j.log);
+    }
+}
+
+// Built-in "bg": resume a stopped job in the background.
+// If arg is NULL, pick most recent job. Otherwise parse job ID (allow leading '%').
+// If the job is already running, I print an error. Otherwise I send SIGCONT,
+// set state to JOB_RUNNING, and print "[id] cmdline &".
+static void builtin_bg(char *arg) {
+    int jid;
+    if (arg == NULL) {
+        if (num_jobs == 0) {
+            fprintf(stderr, "bg: no current job\n");
+            last_status = 1;
+            return;
+        }
+        jid = job_list[job_tail].id;
+    }
+    else {
+        if (arg[0] == '%') arg++;
+        jid = atoi(arg);
+        if (jid == 0) {
+            fprintf(stderr, "bg: invalid job ID %s\n", arg);
+            last_status = 1;
+            return;
+        }
+    }
+    int idx = find_job_by_id(jid);
+    if (idx < 0) {
+        fprintf(stderr, "bg: no such job %d\n", jid);
+        last_status = 1;
+        return;
+    }
+    job_t *j = &job_list[idx];
+    if (j->state == JOB_RUNNING) {
+        fprintf(stderr, "bg: job %d already running\n", j->id);
+        last_status = 1;
+        return;
+    }
+    // resume it in background
+    signal_job(j, SIGCONT);
+    j->state = JOB_RUNNING;
+    last_status = 0;
+    out_printf("[%d] %s &\n", j->id, j->cmdline);
+}
+
+// Built-in "renice": "renice [-n] PRIO JOB..." sets the nice value of every process
+// of each job; "renice -c CPU JOB..." and "renice -m MEM JOB..." throttle a job that
+// has its own cgroup (ICSH_CGROUP) by rewriting its cpu.max or memory.max, with
+// values as in ICSH_JOB_CPU and ICSH_JOB_MEM. A JOB is %N or a pid.
+static void builtin_renice(char **args) {
+    char mode = 'n';
+    if (args[0] != NULL && (strcmp(args[0], "-n") == 0 || strcmp(args[0], "-c") == 0 ||
+                            strcmp(args[0], "-m") == 0)) {
+        mode = args[0][1];
+        args++;
+    }
+    if (args[0] == NULL || args[1] == NULL) {
+        fprintf(stderr, "icsh: renice: usage: renice [-n PRIO | -c CPU | -m MEM] JOB...\n");
+        last_status = 2;
+        return;
+    }
+
+    char value[64];
+    int  prio = 0;
+    if (mode == 'n') {
+        char *end;
+        prio = (int)strtol(args[0], &end, 10);
+        if (args[0][0] == '\0' || *end != '\0') {
+            fprintf(stderr, "icsh: renice: %s: invalid priority\n", args[0]);
+            last_status = 2;
+            return;
+        }
+    } else if ((mode == 'c' ? cg_cpu_max(args[0], value, sizeof(value))
+                            : cg_mem_max(args[0], value, sizeof(value))) < 0) {
+        fprintf(stderr, "icsh: renice: %s: invalid limit\n", args[0]);
+        last_status = 2;
+        return;
+    }
+
+    last_status = 0;
+    for (char **a = args + 1; *a != NULL; a++) {
+        int idx = (**a == '%') ? find_job_by_id(atoi(*a + 1)) : find_job_by_pid(atoi(*a), NULL);
+        job_t *j = (idx >= 0) ? &job_list[idx] : NULL;
+        if (j == NULL && (**a == '%' || mode != 'n')) {
+            fprintf(stderr, "icsh: renice: %s: no such job\n", *a);
+            last_status = 1;
+            continue;
+        }
+        if (mode != 'n') {
+            const char *file = (mode == 'c') ? "cpu.max" : "memory.max";
+            if (j->cgroup == NULL || cg_write(j->cgroup, file, value) < 0) {
+                fprintf(stderr, "icsh: renice: %s: cannot set %s: %s\n", *a, file,
+                        j->cgroup ? strerror(errno) : "the job has no cgroup");
+                last_status = 1;
+            }
+            continue;
+        }
+        int rc = 0;
+        if (j == NULL) {
+            rc = setpriority(PRIO_PROCESS, (id_t)atoi(*a), prio);
+        } else if (j->pgid > 0) {
+            rc = setpriority(PRIO_PGRP, (id_t)j->pgid, prio);
+        } else {
+            for (int k = 0; k < j->npids; k++) {
+                if (j->pids[k] > 0 && setpriority(PRIO_PROCESS, (id_t)j->pids[k], prio) < 0) rc = -1;
+            }
+        }
+        if (rc < 0) {
+            fprintf(stderr, "icsh: renice: %s: %s\n", *a, strerror(errno));
+            last_status = 1;
+        }
+    }
+}
+
+// Built-in "kill [-SIG | -s SIG | -n NUM] JOB...", and "kill -l". A %N job gets the
+// signal as a whole process group, so every stage of its pipeline sees it; a pid is
+// signalled on its own. TERM or HUP to a stopped job also sends CONT, or the job
+// would only see it once somebody resumed it.
+static const struct { const char *name; int sig; } signal_names[] = {
+    { "HUP", SIGHUP },   { "INT", SIGINT },   { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM },
+    { "TERM", SIGTERM }, { "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP },
+    { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN }, { "TTOU", SIGTTOU }, { "WINCH", SIGWINCH },
+};
+
+#define NSIGNAMES (int)(sizeof(signal_names) / sizeof(signal_names[0]))
+
+static int signal_by_name(const char *s) {
+    if (*s >= '0' && *s <= '9') return atoi(s);
+    if (strncmp(s, "SIG", 3) == 0) s += 3;
+    for (int i = 0; i < NSIGNAMES; i++) {
+        if (strcmp(s, signal_names[i].name) == 0) return signal_names[i].sig;
+    }
+    return -1;
+}
+
+static void builtin_kill(char **args) {
+    int sig = SIGTERM;
+    if (args[0] != NULL && strcmp(args[0], "-l") == 0) {
+        for (int i = 0; i < NSIGNAMES; i++) {
+            out_printf("%2d) SIG%s\n", signal_names[i].sig, signal_names[i].name);
+        }
+        last_status = 0;
+        return;
+    }
+    if (args[0] != NULL && args[0][0] == '-' && args[0][1] != '\0') {
+        const char *name = args[0] + 1;
+        if ((strcmp(args[0], "-s") == 0 || strcmp(args[0], "-n") == 0) && args[1] != NULL) {
+            name = *++args;
+        }
+        sig = signal_by_name(name);
+        args++;
+        if (sig < 0) {
+            fprintf(stderr, "icsh: kill: %s: invalid signal\n", name);
+            last_status = 2;
+            return;
+        }
+    }
+    if (args[0] == NULL) {
+        fprintf(stderr, "icsh: kill: usage: kill [-SIG] %%job|pid...\n");
+        last_status = 2;
+        return;
+    }
+
+    last_status = 0;
+    for (; *args != NULL; args++) {
+        if (**args == '%') {
+            int idx = find_job_by_id(atoi(*args + 1));
+            if (idx < 0) {
+                fprintf(stderr, "icsh: kill: %s: no such job\n", *args);
+                last_status = 1;
+                continue;
+            }
+            job_t *j = &job_list[idx];
+            signal_job(j, sig);
+            if (j->state == JOB_STOPPED && (sig == SIGTERM || sig == SIGHUP)) {
+                signal_job(j, SIGCONT);
+            }
+        } else if (kill((pid_t)atoi(*args), sig) < 0) {
+            fprintf(stderr, "icsh: kill: %s: %s\n", *args, strerror(errno));
+            last_status = 1;
+        }
+    }
+}
+
+// Built-in "wait": with no argument I wait until no background job is running and
+// set status 0. With %id or a pid I wait for that one job and take its exit status,
+// also if it already finished (from done_ring[]). A job that stops ends the wait with
+// 128+SIGTSTP, and Ctrl-C ends it with 130.
+static void builtin_wait(char *arg) {
+    int jid = 0;
+    if (arg != NULL) {
+        if (arg[0] == '%') {
+            jid = atoi(arg + 1);
+        } else {
+            int idx = find_job_by_pid((pid_t)atoi(arg), NULL);
+            if (idx >= 0) {
+                jid = job_list[idx].id;
+            } else {
+                // maybe it finished already: look for its last PID among the done jobs
+                int first = done_total > DONE_RING ? done_total - DONE_RING : 0;
+                for (int i = done_total - 1; i >= first && jid == 0; i--) {
+                    if (done_ring[i % DONE_RING].last_pid == atoi(arg)) jid = done_ring[i % DONE_RING].id;
+                }
+            }
+        }
+        if (jid <= 0 || (find_job_by_id(jid) < 0 && find_done_job(jid) == NULL)) {
+            fprintf(stderr, "wait: no such job %s\n", arg);
+            last_status = 127;
+            return;
+        }
+    }
+
+    in_wait          = 1;
+    wait_interrupted = 0;
+    for (;;) {
+        int busy = 0;
+        if (jid > 0) {
+            int idx = find_job_by_id(jid);
+            busy = (idx >= 0 && job_list[idx].state == JOB_RUNNING);
+        } else {
+            for (int i = job_head; i != -1 && !busy; i = job_list[i].next) {
+                busy = (job_list[i].state == JOB_RUNNING);
+            }
+        }
+        if (!busy || wait_interrupted) break;
+        wait_for_events(-1, -1);
+    }
+    in_wait = 0;
+
+    if (wait_interrupted) {
+        last_status = 130;
+    } else if (jid == 0) {
+        last_status = 0;
+    } else if (find_job_by_id(jid) >= 0) {
+        last_status = 128 + SIGTSTP;   // it stopped instead of finishing
+    } else {
+        done_job_t *d = find_done_job(jid);
+        last_status = (d == NULL) ? 127
+                    : WIFEXITED(d->status) ? WEXITSTATUS(d->status) : 128 + WTERMSIG(d->status);
+    }
+}
+
+// Built-in "joblog %N [--follow]": what job N has printed so far, from its log (see
+// joblog_open()). The log outlives the job as long as its done_ring[] record does.
+// With --follow (or -f) I go on printing what the job writes until its output ends,
+// even from things it left running, or until Ctrl-C.
+static void builtin_joblog(char **args) {
+    const char *spec   = NULL;
+    int         follow = 0;
+    for (; *args != NULL; args++) {
+        if (strcmp(*args, "--follow") == 0 || strcmp(*args, "-f") == 0) follow = 1;
+        else if (spec == NULL && (*args)[0] == '%')                      spec = *args;
+        else {
+            spec = NULL;
+            break;
+        }
+    }
+    if (spec == NULL || *args != NULL) {
+        fprintf(stderr, "joblog: usage: joblog %%N [--follow]\n");
+        last_status = 2;
+        return;
+    }
+
+    int         jid = atoi(spec + 1);
+    int         idx = jid > 0 ? find_job_by_id(jid) : -1;
+    done_job_t *d   = (idx < 0 && jid > 0) ? find_done_job(jid) : NULL;
+    joblog_t   *l   = idx >= 0 ? job_list[idx].log : d != NULL ? d->log : NULL;
+    if (l == NULL) {
+        if (idx < 0 && d == NULL) fprintf(stderr, "joblog: no such job %s\n", spec);
+        else                      fprintf(stderr, "joblog: job %d has no log (ICSH_JOBLOG is off)\n", jid);
+        last_status = 1;
+        return;
+    }
+
+    // what is still in the pipe belongs to what the job has printed so far
+    tty_sync();
+    if (l->fd >= 0) joblog_read(l);
+    long long pos = joblog_write(l, 0);
+    last_status = 0;
+    if (!follow) return;
+
+    l->refs++;   // the job may be done and its record dropped while I follow it
+    in_wait          = 1;
+    wait_interrupted = 0;
+    while (l->fd >= 0 && !wait_interrupted) {
+        wait_for_events(-1, -1);
+        pos = joblog_write(l, pos);
+    }
+    in_wait = 0;
+    joblog_release(l);
+    if (wait_interrupted) last_status = 130;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Milestone 5: combination of built-ins, I/O redirection, history, and external commands
+// ────────────────────────────────────────────────────────────────────────────
+
+// ────────────────────────────────────────────────────────────────────────────
+// History: a persistent, mmap'd history file with a lazily built line index
+// ────────────────────────────────────────────────────────────────────────────
+
+// Entries are numbered from 1 across the history file (as it was when I started) and
+// then this session. At startup I only mmap the file; the offset of every line is
+// worked out the first time something needs entry numbers (history, !n, !prefix,
+// !?text), so startup stays flat however long the file gets. New lines are queued in
+// pend[] and appended with one write() + fsync() once the user has sat idle at the
+// prompt for HIST_SYNC_IDLE_MS (and when I exit), never between Enter and the command.
+// Only a session on a terminal records history and has a history file. Anywhere else
+// (a script, or commands piped into me) I keep just the newest line, for "!!".
+#define HIST_SYNC_IDLE_MS 1000
+
+typedef struct {
+    const char *ptr;
+    size_t      len;
+} hist_entry_t;
+
+static struct {
+    int           fd;         // history file opened O_APPEND, -1 without one
+    pid_t         owner;      // only this process writes it, never a forked copy of me
+    char         *map;        // the file as it was at startup
+    size_t        map_len;
+    size_t       *idx;        // idx[i] = offset of file entry i+1, once indexed
+    size_t        nfile;
+    int           indexed;
+    hist_entry_t *sess;       // this session's entries (views that live until I exit)
+    size_t        nsess;
+    size_t        sess_cap;
+    char         *pend;       // lines not in the file yet, "\n"-terminated
+    size_t        pend_len;
+    size_t        pend_cap;
+    int           record;     // a terminal session: history_open() turned it on
+    const char   *last;       // otherwise the newest line, a view or in keep
+    size_t        last_len;
+    char         *keep;       // one buffer, reused for every line that is not stable
+    size_t        keep_cap;
+} hist = { .fd = -1 };
+
+// history_sync: I append the queued lines to the file in one write and fsync it.
+static void history_sync(void) {
+    if (hist.fd < 0 || hist.pend_len == 0 || getpid() != hist.owner) return;
+    size_t off = 0;
+    while (off < hist.pend_len) {
+        ssize_t n = write(hist.fd, hist.pend + off, hist.pend_len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += n;
+    }
+    fsync(hist.fd);
+    hist.pend_len = 0;
+}
+
+// history_open: $ICSH_HISTFILE, else ~/.icsh_history. If I cannot open it, history
+// simply stays in memory.
+static void history_open(void) {
+    hist.record = 1;
+    char        path[4096];
+    const char *file = var_get("ICSH_HISTFILE");
+    if (file == NULL) {
+        const char *home = var_get("HOME");
+        if (home == NULL) return;
+        snprintf(path, sizeof(path), "%s/.icsh_history", home);
+        file = path;
+    }
+    hist.fd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (hist.fd < 0) return;
+    hist.owner = getpid();
+
+    struct stat st;
+    if (fstat(hist.fd, &st) == 0 && st.st_size > 0) {
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hist.fd, 0);
+        if (m != MAP_FAILED) {
+            hist.map     = m;
+            hist.map_len = st.st_size;
+        }
+    }
+    atexit(history_sync);
+}
+
+// history_index: one memchr pass over the mapped file, done the first time I need it.
+static void history_index(void) {
+    if (hist.indexed) return;
+    hist.indexed = 1;
+    size_t cap = 0;
+    for (size_t off = 0; off < hist.map_len; ) {
+        if (hist.nfile == cap) {
+            size_t *grown = realloc(hist.idx, (cap ? cap * 2 : 1024) * sizeof(size_t));
+            if (grown == NULL) return;
+            hist.idx = grown;
+            cap      = cap ? cap * 2 : 1024;
+        }
+        hist.idx[hist.nfile++] = off;
+        const char *nl = memchr(hist.map + off, '\n', hist.map_len - off);
+        off = nl ? (size_t)(nl - hist.map) + 1 : hist.map_len;
+    }
+}
+
+static size_t history_count(void) {
+    history_index();
+    return hist.nfile + hist.nsess;
+}
+
+// history_get: entry n (1-based) as a view. I return 0 if there is no such entry.
+static int history_get(size_t n, const char **p, size_t *len) {
+    history_index();
+    if (n == 0 || n > hist.nfile + hist.nsess) return 0;
+    if (n > hist.nfile) {
+        *p   = hist.sess[n - hist.nfile - 1].ptr;
+        *len = hist.sess[n - hist.nfile - 1].len;
+        return 1;
+    }
+    size_t start = hist.idx[n - 1];
+    size_t end   = (n < hist.nfile) ? hist.idx[n] - 1 : hist.map_len;
+    if (end > start && hist.map[end - 1] == '\n') end--;
+    *p   = hist.map + start;
+    *len = end - start;
+    return 1;
+}
+
+// history_last: the newest entry. "!!" is the common case, so I find it without the
+// index: a session entry, or the last line of the file.
+static int history_last(const char **p, size_t *len) {
+    if (!hist.record) {
+        *p   = hist.last;
+        *len = hist.last_len;
+        return hist.last != NULL;
+    }
+    if (hist.nsess > 0) {
+        *p   = hist.sess[hist.nsess - 1].ptr;
+        *len = hist.sess[hist.nsess - 1].len;
+        return 1;
+    }
+    size_t end = hist.map_len;
+    if (end > 0 && hist.map[end - 1] == '\n') end--;
+    if (end == 0) return 0;
+    const char *nl    = memrchr(hist.map, '\n', end);
+    size_t      start = nl ? (size_t)(nl - hist.map) + 1 : 0;
+    *p   = hist.map + start;
+    *len = end - start;
+    return 1;
+}
+
+// history_add: a new entry. A view that does not outlive the next read is copied.
+static void history_add(const char *line, size_t len, int stable) {
+    if (!hist.record) {
+        if (!stable) {
+            if (len > hist.keep_cap) {
+                char *grown = realloc(hist.keep, len);
+                if (grown == NULL) return;
+                hist.keep     = grown;
+                hist.keep_cap = len;
+            }
+            memcpy(hist.keep, line, len);
+            line = hist.keep;
+        }
+        hist.last     = line;
+        hist.last_len = len;
+        return;
+    }
+    if (hist.nsess == hist.sess_cap) {
+        size_t        cap   = hist.sess_cap ? hist.sess_cap * 2 : 64;
+        hist_entry_t *grown = realloc(hist.sess, cap * sizeof(hist_entry_t));
+        if (grown == NULL) return;
+        hist.sess     = grown;
+        hist.sess_cap = cap;
+    }
+    const char *ptr = stable ? line : strndup(line, len);
+    if (ptr == NULL) return;
+    hist.sess[hist.nsess].ptr = ptr;
+    hist.sess[hist.nsess].len = len;
+    hist.nsess++;
+
+    if (hist.fd < 0) return;
+    if (hist.pend_len + len + 1 > hist.pend_cap) {
+        size_t cap = hist.pend_cap ? hist.pend_cap : 4096;
+        while (cap < hist.pend_len + len + 1) cap *= 2;
+        char *grown = realloc(hist.pend, cap);
+        if (grown == NULL) return;
+        hist.pend     = grown;
+        hist.pend_cap = cap;
+    }
+    memcpy(hist.pend + hist.pend_len, line, len);
+    hist.pend[hist.pend_len + len] = '\n';
+    hist.pend_len += len + 1;
+}
+
+// history_expand: spec is what follows the "!". I find the entry it names, newest
+// first for the searches, and return 0 if there is none.
+static int history_expand(const char *spec, size_t n, const char **p, size_t *len) {
+    if (n == 1 && spec[0] == '!') {
+        return history_last(p, len);
+    }
+    if (spec[0] >= '0' && spec[0] <= '9') {
+        return history_get(strtoul(spec, NULL, 10), p, len);
+    }
+    if (spec[0] == '-' && n > 1) {
+        size_t back  = strtoul(spec + 1, NULL, 10);
+        size_t total = history_count();
+        return back > 0 && back <= total && history_get(total - back + 1, p, len);
+    }
+    int    contains = (spec[0] == '?');
+    size_t tlen     = contains ? n - 1 : n;
+    const char *text = contains ? spec + 1 : spec;
+    if (contains && tlen > 0 && text[tlen - 1] == '?') tlen--;   // "!?text?" as in bash
+
+    for (size_t i = history_count(); i > 0; i--) {
+        const char *e;
+        size_t      elen;
+        history_get(i, &e, &elen);
+        if (contains ? memmem(e, elen, text, tlen) != NULL
+                     : (elen >= tlen && memcmp(e, text, tlen) == 0)) {
+            *p   = e;
+            *len = elen;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// handleHistory: a line starting with "!" names an earlier entry: "!!" the last one,
+// "!n" entry n, "!-n" the n-th newest, "!prefix" the newest starting with prefix, and
+// "!?text" the newest containing text. I print the expansion and the line becomes it.
+// Every line I run becomes a new entry. stable says whether the view outlives the next
+// read. I return 0 if there is nothing to run.
+static int handleHistory(const char **line, size_t *len, int stable) {
+    if (*len >= 2 && (*line)[0] == '!' && (*line)[1] != ' ' && (*line)[1] != '\t') {
+        const char *p;
+        size_t      n;
+        if (!history_expand(*line + 1, *len - 1, &p, &n)) {
+            // a "!!" with no history yet is quietly ignored, like it always was
+            if (!(*len == 2 && (*line)[1] == '!')) {
+                fprintf(stderr, "icsh: %.*s: event not found\n", (int)*len, *line);
+            }
+            return 0;
+        }
+        tty_printf(&tty_out, "%.*s\n", (int)n, p);
+        *line  = p;
+        *len   = n;
+        stable = 1;   // entries stay put until I exit
+    }
+    if (*len > 0) {
+        history_add(*line, *len, stable);
+    }
+    return 1;
+}
+
+// Built-in "history": every entry with its number, "history N" only the last N, and
+// "history -s text" the entries that contain text.
+static void builtin_history(char **args) {
+    size_t      total = history_count();
+    size_t      first = 1;
+    const char *text  = NULL;
+    if (args[0] != NULL && strcmp(args[0], "-s") == 0) {
+        if (args[1] == NULL) {
+            fprintf(stderr, "history: -s needs a search string\n");
+            last_status = 1;
+            return;
+        }
+        text = args[1];
+    } else if (args[0] != NULL) {
+        size_t last = strtoul(args[0], NULL, 10);
+        if (last < total) first = total - last + 1;
+    }
+
+    for (size_t i = first; i <= total; i++) {
+        const char *e;
+        size_t      elen;
+        history_get(i, &e, &elen);
+        if (text != NULL && memmem(e, elen, text, strlen(text)) == NULL) continue;
+        out_printf("%5zu  %.*s\n", i, (int)elen, e);
+    }
+    last_status = 0;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// PATH cache: command name -> absolute path, plus the "hash" built-in
+// ────────────────────────────────────────────────────────────────────────────
+
+// execvp walks every $PATH directory on every launch. I remember where each command
+// was found, so the next launch can exec the absolute path directly.
+#define PATH_CACHE_BUCKETS 64
+
+typedef struct path_entry {
+    char              *name;   // command name as typed, e.g. "ls"
+    char              *path;   // resolved absolute path, e.g. "/usr/bin/ls"
+    int                hits;   // how many launches used this entry
+    struct path_entry *next;   // next entry in the same bucket
+} path_entry_t;
+
+static path_entry_t *path_cache[PATH_CACHE_BUCKETS];
+static char         *path_cache_env = NULL;   // the $PATH value the cache was filled with
+
+// FNV-1a over the command name picks the bucket.
+static unsigned path_hash(const char *name) {
+    unsigned h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h % PATH_CACHE_BUCKETS;
+}
+
+// hash -r, or $PATH changed: I drop every entry.
+static void path_cache_clear(void) {
+    for (int b = 0; b < PATH_CACHE_BUCKETS; b++) {
+        path_entry_t *e = path_cache[b];
+        while (e != NULL) {
+            path_entry_t *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        path_cache[b] = NULL;
+    }
+}
+
+// If $PATH is not what I filled the cache with, every entry may be wrong.
+static void path_cache_check_env(void) {
+    const char *env = var_get("PATH");
+    if (env == NULL) env = "";
+    if (path_cache_env != NULL && strcmp(path_cache_env, env) == 0) {
+        return;
+    }
+    path_cache_clear();
+    free(path_cache_env);
+    path_cache_env = strdup(env);
+}
+
+// Remove one entry, used when the cached file is gone or no longer executable.
+static void path_cache_forget(const char *name) {
+    path_entry_t **pp = &path_cache[path_hash(name)];
+    while (*pp != NULL) {
+        if (strcmp((*pp)->name, name) == 0) {
+            path_entry_t *dead = *pp;
+            *pp = dead->next;
+            free(dead->name);
+            free(dead->path);
+            free(dead);
+            return;
+        }
+        pp = &(*pp)->next;
+    }
+}
+
+// I walk $PATH the same way execvp does (an empty element means ".") and return a
+// malloc'd path to the first regular executable file, or NULL (also when out of
+// memory).
+static char *path_search(const char *name) {
+    const char *dirs = path_cache_env;
+    size_t nlen = strlen(name);
+    while (dirs != NULL) {
+        const char *colon = strchr(dirs, ':');
+        size_t dlen = colon ? (size_t)(colon - dirs) : strlen(dirs);
+
+        char *full = malloc(dlen + nlen + 3);
+        if (full == NULL) return NULL;
+        if (dlen == 0) {
+            sprintf(full, "./%s", name);
+        } else {
+            memcpy(full, dirs, dlen);
+            full[dlen] = '/';
+            memcpy(full + dlen + 1, name, nlen + 1);
+        }
+        struct stat st;
+        if (stat(full, &st) == 0 && S_ISREG(st.st_mode) && access(full, X_OK) == 0) {
+            return full;
+        }
+        free(full);
+        dirs = colon ? colon + 1 : NULL;
+    }
+    return NULL;
+}
+
+// path_cache_lookup: I return the cached entry for name, filling it lazily from $PATH.
+// NULL means the command is not on $PATH at all, or I ran out of memory for it.
+static path_entry_t *path_cache_lookup(const char *name) {
+    path_cache_check_env();
+    unsigned b = path_hash(name);
+    for (path_entry_t *e = path_cache[b]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+    char *full = path_search(name);
+    if (full == NULL) {
+        return NULL;
+    }
+    path_entry_t *e = malloc(sizeof(*e));
+    char         *dup = strdup(name);
+    if (e == NULL || dup == NULL) {
+        free(e);
+        free(dup);
+        free(full);
+        return NULL;
+    }
+    e->name = dup;
+    e->path = full;
+    e->hits = 0;
+    e->next = path_cache[b];
+    path_cache[b] = e;
+    return e;
+}
+
+// Built-in "hash": with no arguments I list the cache like bash does (hits, path),
+// "hash -r" forgets everything, and "hash name..." looks names up without running them.
+static void builtin_hash(char **args) {
+    if (args[0] != NULL && strcmp(args[0], "-r") == 0) {
+        path_cache_clear();
+        last_status = 0;
+        return;
+    }
+    if (args[0] != NULL) {
+        last_status = 0;
+        for (int i = 0; args[i] != NULL; i++) {
+            if (strchr(args[i], '/') != NULL) continue;
+            if (path_cache_lookup(args[i]) == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+                last_status = 1;
+            }
+        }
+        return;
+    }
+
+    path_cache_check_env();
+    int empty = 1;
+    for (int b = 0; b < PATH_CACHE_BUCKETS; b++) {
+        for (path_entry_t *e = path_cache[b]; e != NULL; e = e->next) {
+            if (empty) {
+                out_printf("hits\tcommand\n");
+                empty = 0;
+            }
+            out_printf("%4d\t%s\n", e->hits, e->path);
+        }
+    }
+    if (empty) {
+        out_printf("hash: hash table empty\n");
+    }
+    last_status = 0;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Redirections: one engine for launched commands, in-shell stages and built-ins
+// ────────────────────────────────────────────────────────────────────────────
+
+// A command's redirections, expanded and in source order. "2>&1 >f" and ">f 2>&1"
+// mean different things, so order matters.
+#define MAX_REDIRS 16   // most redirections I allow on one command
+
+// A plan has a step per redirection, plus the two pipeline ends and the dups I put in
+// front of a command's own redirections (a command substitution's pipe, a job log's
+// stdout and stderr).
+#define MAX_PLAN_STEPS (MAX_REDIRS + 5)
+
+typedef enum {
+    RS_READ,      // N<file
+    RS_WRITE,     // N>file
+    RS_APPEND,    // N>>file
+    RS_DUP,       // N>&M, N<&M
+    RS_CLOSE,     // N>&-, N<&-
+    RS_DATA,      // N<<DELIM and N<<<word: the body is already in memory
+} redir_spec_kind_t;
+
+typedef struct {
+    redir_spec_kind_t kind;
+    int               fd;     // the fd being redirected
+    int               src;    // RS_DUP: the fd it becomes a copy of
+    const char       *path;   // RS_READ/RS_WRITE/RS_APPEND
+    const char       *data;   // RS_DATA
+    size_t            len;
+} redir_spec_t;
+
+// redir_plan() turns the specs into a list of "make target a copy of src" steps
+// (src -1 closes target). Files and here-document bodies are opened in the parent,
+// close-on-exec, so a failed open is reported the same way for every launcher, and
+// the pipeline ends come first, so a redirection wins over the pipe. A launched child
+// just replays the steps (dup2 file actions with posix_spawn), and in-shell stages
+// like echo use redir_target_of() to find out where their output goes without a
+// single dup2.
+typedef struct {
+    int target;
+    int src;
+    int internal;   // src is one of my fds (a pipe end or a file I opened), not the command's
+} fd_step_t;
+
+typedef struct {
+    fd_step_t steps[MAX_PLAN_STEPS];
+    int       nsteps;
+    int       opened[2 * MAX_PLAN_STEPS];   // fds I opened, and fds I moved out of a clash
+    int       nopened;
+} redir_plan_t;
+
+// open_data_fd: a read fd that yields len bytes of data, without touching the disk.
+// A body that fits in an empty pipe goes into one (3 syscalls, no feeder needed);
+// a bigger one goes into a memfd.
+static int open_data_fd(const char *data, size_t len) {
+    if (len <= 4096) {
+        int p[2];
+        if (pipe2(p, O_CLOEXEC) < 0) return -1;
+        if (len > 0 && write(p[1], data, len) < 0) {
+            close(p[0]);
+            close(p[1]);
+            return -1;
+        }
+        close(p[1]);
+        return p[0];
+    }
+    int fd = memfd_create("icsh-heredoc", MFD_CLOEXEC);
+    if (fd < 0) return -1;
+    for (size_t off = 0; off < len; ) {
+        ssize_t n = write(fd, data + off, len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        off += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+static void redir_done(redir_plan_t *pl) {
+    for (int i = 0; i < pl->nopened; i++) {
+        close(pl->opened[i]);
+    }
+    pl->nopened = 0;
+}
+
+static void plan_step(redir_plan_t *pl, int target, int src, int internal) {
+    pl->steps[pl->nsteps].target   = target;
+    pl->steps[pl->nsteps].src      = src;
+    pl->steps[pl->nsteps].internal = internal;
+    pl->nsteps++;
+}
+
+// redir_plan: I build the plan for one command. pipe_in/pipe_out are its pipeline
+// ends (-1 if none). I return 0, or -1 after printing why a file could not be opened.
+static int redir_plan(redir_plan_t *pl, const redir_spec_t *rs, int n, int pipe_in, int pipe_out) {
+    pl->nsteps  = 0;
+    pl->nopened = 0;
+    if (pipe_in >= 0)  plan_step(pl, STDIN_FILENO, pipe_in, 1);
+    if (pipe_out >= 0) plan_step(pl, STDOUT_FILENO, pipe_out, 1);
+
+    for (int i = 0; i < n; i++) {
+        int fd = -1;
+        switch (rs[i].kind) {
+            case RS_READ:
+                fd = open(rs[i].path, O_RDONLY | O_CLOEXEC);
+                if (fd < 0) perror("open input");
+                break;
+            case RS_WRITE:
+                fd = open(rs[i].path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (fd < 0) perror("open output");
+                break;
+            case RS_APPEND:
+                fd = open(rs[i].path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                if (fd < 0) perror("open output");
+                break;
+            case RS_DATA:
+                fd = open_data_fd(rs[i].data, rs[i].len);
+                if (fd < 0) perror("here-document");
+                break;
+            case RS_DUP:
+                plan_step(pl, rs[i].fd, rs[i].src, 0);
+                continue;
+            case RS_CLOSE:
+                plan_step(pl, rs[i].fd, -1, 0);
+                continue;
+        }
+        if (fd < 0) {
+            redir_done(pl);
+            return -1;
+        }
+        pl->opened[pl->nopened++] = fd;
+        plan_step(pl, rs[i].fd, fd, 1);
+    }
+
+    // An fd I opened (or a pipe end) may have the same number as an earlier target,
+    // e.g. "3>&1 <file" when the file got fd 3; replaying the steps would overwrite
+    // it before use. Only then do I move it out of the way. The source of "N>&M" is
+    // the command's own fd M, which an earlier step is meant to set up, so it stays.
+    for (int i = 0; i < pl->nsteps; i++) {
+        int src = pl->steps[i].src;
+        if (!pl->steps[i].internal) continue;
+        int clash = 0;
+        for (int k = 0; k < i; k++) {
+            if (pl->steps[k].target == src) clash = 1;
+        }
+        if (!clash) continue;
+        int moved = fcntl(src, F_DUPFD_CLOEXEC, 10);
+        if (moved < 0) {
+            // replaying the plan as it is would read the wrong fd
+            perror("icsh: redirection");
+            redir_done(pl);
+            return -1;
+        }
+        pl->opened[pl->nopened++] = moved;
+        pl->steps[i].src = moved;
+    }
+    return 0;
+}
+
+// redir_target_of: which of my fds the command's fd would be a copy of after the plan,
+// or -1 if the plan closes it. Nothing is dup'd; I just walk the steps backwards.
+static int redir_target_of(const redir_plan_t *pl, int fd) {
+    for (int i = pl->nsteps - 1; i >= 0; i--) {
+        if (pl->steps[i].target == fd) {
+            if (pl->steps[i].src < 0) return -1;
+            fd = pl->steps[i].src;
+        }
+    }
+    return fd;
+}
+
+// A built-in that prints through stdio needs the redirections on my own fds. I save
+// every target the first time I change it (only those) and put them back afterwards.
+typedef struct {
+    int fd;
+    int saved;   // copy of the original, or -1 if fd was not open
+} fd_save_t;
+
+static int redir_apply(const redir_plan_t *pl, fd_save_t *saves) {
+    int nsaves = 0;
+    tty_sync();
+    for (int i = 0; i < pl->nsteps; i++) {
+        int t = pl->steps[i].target, seen = 0;
+        for (int k = 0; k < nsaves; k++) {
+            if (saves[k].fd == t) seen = 1;
+        }
+        if (!seen) {
+            saves[nsaves].fd    = t;
+            saves[nsaves].saved = fcntl(t, F_DUPFD_CLOEXEC, 10);
+            nsaves++;
+        }
+        if (pl->steps[i].src < 0) close(t);
+        else                      dup2(pl->steps[i].src, t);
+    }
+    return nsaves;
+}
+
+static void redir_restore(fd_save_t *saves, int nsaves) {
+    tty_sync();
+    for (int k = nsaves - 1; k >= 0; k--) {
+        if (saves[k].saved >= 0) {
+            dup2(saves[k].saved, saves[k].fd);
+            close(saves[k].saved);
+        } else {
+            close(saves[k].fd);
+        }
+    }
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Launcher: posix_spawn fast path for external commands, with fork as fallback
+// ────────────────────────────────────────────────────────────────────────────
+
+// A full fork() has to copy the page tables of the whole shell, which is slow on
+// big-RSS hosts. posix_spawn (glibc uses clone(CLONE_VM|CLONE_VFORK) underneath)
+// skips that copy, so I use it by default. ICSH_LAUNCHER=fork switches back. A job
+// with its own cgroup also forks: the child joins the cgroup before exec, and
+// posix_spawn has no step where it could.
+typedef enum { LAUNCH_SPAWN, LAUNCH_FORK } launcher_t;
+static launcher_t launcher = LAUNCH_SPAWN;
+
+// I read ICSH_LAUNCHER once at startup so the benchmark can compare both paths.
+static void init_launcher(void) {
+    const char *mode = var_get("ICSH_LAUNCHER");
+    if (mode != NULL && strcmp(mode, "fork") == 0) {
+        launcher = LAUNCH_FORK;
+    }
+}
+
+// posix_spawn path: the plan's steps become dup2/close file actions. The dup2'd copies
+// are not close-on-exec, while the originals are, so nothing else leaks into the child.
+// path is already resolved, so I return the spawn error instead of printing it.
+// pgid < 0 keeps my process group, 0 starts a new one, > 0 joins that one.
+static pid_t spawn_external(const char *path, char **argv, char **envp,
+                            const redir_plan_t *pl, pid_t pgid, int *err) {
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+#if !defined(POSIX_SPAWN_TCSETPGROUP) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+    // glibc takes the terminal handoff as a file action instead of an attribute; it
+    // runs in the child after it joined its new group, before any dup2 could touch
+    // tty_fd's number
+    if (pgid == 0 && launch_fg) posix_spawn_file_actions_addtcsetpgrp_np(&fa, tty_fd);
+#endif
+    for (int i = 0; i < pl->nsteps; i++) {
+        if (pl->steps[i].src < 0) posix_spawn_file_actions_addclose(&fa, pl->steps[i].target);
+        else posix_spawn_file_actions_adddup2(&fa, pl->steps[i].src, pl->steps[i].target);
+    }
+
+    // I keep SIGCHLD, SIGINT and SIGTSTP blocked for my signalfd, so the child must start
+    // with a clean mask, and the signals I ignore myself (SIGPIPE, SIGTTOU) go back to
+    // their defaults.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t empty, dflt;
+    sigemptyset(&empty);
+    sigemptyset(&dflt);
+    sigaddset(&dflt, SIGPIPE);
+    sigaddset(&dflt, SIGTTOU);
+    sigaddset(&dflt, SIGTTIN);
+    sigaddset(&dflt, SIGQUIT);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setsigdefault(&attr, &dflt);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+#ifdef POSIX_SPAWN_TCSETPGROUP
+    if (pgid == 0 && launch_fg) {
+        posix_spawnattr_tcsetpgrp_np(&attr, tty_fd);
+        flags |= POSIX_SPAWN_TCSETPGROUP;
+    }
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid;
+    *err = posix_spawn(&pid, path, &fa, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    return (*err == 0) ? pid : -1;
+}
+
+// I put a freshly forked child into its pipeline's process group. Both the parent and
+// the child call this, so it does not matter which of them runs first.
+static void join_pgid(pid_t pid, pid_t pgid) {
+    if (pgid >= 0) {
+        setpgid(pid, pgid);
+    }
+}
+
+// fork path: what I did before, kept as the fallback. I write out my queued output
+// first and use _exit() in the child, so a failed exec cannot print a copy of it.
+static pid_t fork_external(const char *path, char **argv, char **envp, const redir_plan_t *pl,
+                           pid_t pgid) {
+    tty_sync();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("failed to fork");
+        return -1;
+    }
+    if (pid == 0) {
+        join_pgid(0, pgid);
+        if (pgid == 0 && launch_fg) tcsetpgrp(tty_fd, getpid());   // SIGTTOU is still ignored
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        for (int i = 0; i < pl->nsteps; i++) {
+            if (pl->steps[i].src < 0) close(pl->steps[i].target);
+            else                      dup2(pl->steps[i].src, pl->steps[i].target);
+        }
+        // "0" moves the writer itself, so the job is confined before it runs anything
+        if (launch_cg_fd >= 0 && write(launch_cg_fd, "0", 1) < 0) {
+            perror("icsh: cannot join the job's cgroup");
+            _exit(126);
+        }
+        execve(path, argv, envp);
+        perror("failed to execute");
+        _exit(1);
+    }
+    join_pgid(pid, pgid);
+    return pid;
+}
+
+// launch_external: I plan the redirections, resolve argv[0] through the PATH cache,
+// start it with the selected launcher, and close the fds I opened for it.
+// pipe_in/pipe_out are the pipeline ends for this stage (-1 if none); a file
+// redirection wins over the pipe, like in other shells. envp NULL means env_vec.
+// I return the child pid or -1 on failure.
+static pid_t launch_external(char **argv, char **envp, const redir_spec_t *rs, int nrs,
+                             int pipe_in, int pipe_out, pid_t pgid) {
+    if (envp == NULL) envp = env_vec;
+    redir_plan_t plan;
+    if (redir_plan(&plan, rs, nrs, pipe_in, pipe_out) < 0) {
+        return -1;
+    }
+
+    // names with a '/' are used as-is; everything else goes through the cache
+    const char   *path  = argv[0];
+    path_entry_t *entry = NULL;
+    if (strchr(argv[0], '/') == NULL) {
+        entry = path_cache_lookup(argv[0]);
+        path  = entry ? entry->path : NULL;
+    }
+
+    pid_t     pid = -1;
+    int       err = ENOENT;
+    long long t0  = trace_now();
+    if (path != NULL && launcher == LAUNCH_SPAWN && launch_cg_fd < 0) {
+        pid = spawn_external(path, argv, envp, &plan, pgid, &err);
+        if (pid < 0 && entry != NULL && (err == ENOENT || err == EACCES)) {
+            // the cached file went away or lost its x bit: forget it and search again
+            path_cache_forget(argv[0]);
+            entry = path_cache_lookup(argv[0]);
+            if (entry != NULL) {
+                pid = spawn_external(entry->path, argv, envp, &plan, pgid, &err);
+            }
+        }
+        if (pid < 0) {
+            fprintf(stderr, "failed to execute: %s\n", strerror(err));
+        }
+    }
+    else if (path != NULL) {
+        // the fork child cannot tell me exec failed, so I re-check a cached path first
+        if (entry != NULL && access(path, X_OK) != 0) {
+            path_cache_forget(argv[0]);
+            entry = path_cache_lookup(argv[0]);
+            path  = entry ? entry->path : NULL;
+        }
+        if (path != NULL) {
+            pid = fork_external(path, argv, envp, &plan, pgid);
+        } else {
+            fprintf(stderr, "failed to execute: %s\n", strerror(ENOENT));
+        }
+    }
+    else {
+        fprintf(stderr, "failed to execute: %s\n", strerror(err));
+    }
+
+    if (pid > 0 && entry != NULL) {
+        entry->hits++;
+    }
+    if (pid > 0) trace_event(TR_SPAWN, t0, pid, argv[0], strlen(argv[0]));
+    redir_done(&plan);
+    return pid;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Pipelines: "a | b | c" with one process group per pipeline
+// ────────────────────────────────────────────────────────────────────────────
+
+// One stage of a pipeline after expansion: argv plus its redirections, and the
+// "NAME=value" words in front of it.
+typedef struct {
+    char         **argv;
+    char         **assigns;
+    int            nassigns;
+    char         **envp;      // env_vec plus the assignments, or NULL for env_vec
+    redir_spec_t  *redirs;
+    int            nredirs;
+} stage_t;
+
+// A feeder is a stage I run inside the shell instead of starting a process: an "echo",
+// or a bare "< file" at the head of a pipeline. It pushes its data into the next
+// stage's pipe with vmsplice (from buf) or splice (from src_fd), so nothing goes
+// through stdio.
+typedef struct {
+    int     fd_out;   // write end of the pipe to the next stage
+    char   *buf;      // mmap'd echo output, or NULL
+    size_t  len;      // bytes in buf
+    size_t  off;      // bytes already handed to the pipe
+    size_t  maplen;   // length of the mapping, for munmap
+    int     src_fd;   // file for a "< file" feeder, or -1
+} feeder_t;
+
+// echo_render: I build echo's output (the words joined by spaces, plus "\n")
+// in a private anonymous mapping. vmsplice only references these pages, and munmap
+// later just drops my mapping, so the pipe keeps valid data until it is read.
+static char *echo_render(char **args, size_t *len, size_t *maplen) {
+    size_t need = 1;
+    for (int i = 0; args[i]; i++) need += strlen(args[i]) + 1;
+    long page = sysconf(_SC_PAGESIZE);
+    *maplen = (need + page - 1) / page * page;
+    char *buf = mmap(NULL, *maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (int i = 0; args[i]; i++) {
+        size_t l = strlen(args[i]);
+        memcpy(buf + n, args[i], l);
+        n += l;
+        if (args[i + 1]) buf[n++] = ' ';
+    }
+    buf[n++] = '\n';
+    *len = n;
+    return buf;
+}
+
+// feed: I move a feeder's data into its pipe. With nonblock set I stop as soon as the
+// pipe is full and return 0; I return 1 once everything is written (or the reader
+// went away, which is EPIPE since I ignore SIGPIPE).
+static int feed(feeder_t *f, int nonblock) {
+    unsigned flags = nonblock ? SPLICE_F_NONBLOCK : 0;
+    for (;;) {
+        ssize_t n;
+        if (f->buf != NULL) {
+            if (f->off == f->len) return 1;
+            struct iovec iov = { f->buf + f->off, f->len - f->off };
+            n = vmsplice(f->fd_out, &iov, 1, flags);
+        } else {
+            n = splice(f->src_fd, NULL, f->fd_out, NULL, 1 << 20, flags | SPLICE_F_MOVE);
+            if (n == 0) return 1;
+            if (n < 0 && errno == EINVAL) {
+                // this file type cannot splice (e.g. /proc): plain read/write instead
+                char tmp[8192];
+                n = read(f->src_fd, tmp, sizeof(tmp));
+                if (n <= 0) return 1;
+                if (write(f->fd_out, tmp, n) < 0 && errno == EPIPE) return 1;
+                continue;
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0;
+            return 1;
+        }
+        if (f->buf != NULL) f->off += n;
+    }
+}
+
+// If a feeder still has data after the non-blocking pass, I hand the rest to a small
+// helper child in the pipeline's group, so I never block on a slow reader.
+static pid_t feed_in_helper(feeder_t *feeders, int nfeed, int which, pid_t pgid) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("failed to fork");
+        return -1;
+    }
+    if (pid == 0) {
+        join_pgid(0, pgid);
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        // keep only my own pipe, so the other readers still see EOF on time
+        for (int i = 0; i < nfeed; i++) {
+            if (i != which) close(feeders[i].fd_out);
+        }
+        feed(&feeders[which], 0);
+        _exit(0);
+    }
+    join_pgid(pid, pgid);
+    return pid;
+}
+
+struct func;
+struct builtin;
+static struct func *func_find(const char *name);
+static void call_function(struct func *f, stage_t *st, arena_t *scratch);
+static const struct builtin *builtin_find(const char *name);
+static int run_builtin(stage_t *st);
+
+// fork_shell_stage: a function (f) or a built-in (f NULL) in a pipeline runs in a
+// forked copy of me, like a subshell, with the stage's pipe ends as its stdin and
+// stdout; the built-in's own redirections go through run_builtin() as usual. The copy
+// never execs, so O_CLOEXEC does not close the other pipe ends for it: I close them
+// myself, or the next stage would never see EOF.
+static pid_t fork_shell_stage(struct func *f, stage_t *st, arena_t *scratch, int pipe_in,
+                              const int p[2], const feeder_t *feeders, int nfeed,
+                              pid_t pgid) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("failed to fork");
+        return -1;
+    }
+    if (pid == 0) {
+        join_pgid(0, pgid);
+        if (pgid == 0 && launch_fg) tcsetpgrp(tty_fd, getpid());   // SIGTTOU is still ignored
+        if (pipe_in >= 0) dup2(pipe_in, STDIN_FILENO);
+        if (p[1] >= 0) dup2(p[1], STDOUT_FILENO);
+        if (pipe_in >= 0) close(pipe_in);
+        if (p[0] >= 0) close(p[0]);
+        if (p[1] >= 0) close(p[1]);
+        for (int k = 0; k < nfeed; k++) {
+            close(feeders[k].fd_out);
+            if (feeders[k].src_fd >= 0) close(feeders[k].src_fd);
+        }
+        job_control = 0;
+        in_subshell = 1;
+        out_capture = NULL;
+        subst_fd    = -1;
+        deadlines_forget();
+        joblogs_forget();
+        trace_forget();
+        if (f != NULL) call_function(f, st, scratch);
+        else           run_builtin(st);
+        tty_sync();
+        trace_drain();
+        _exit(last_status);
+    }
+    join_pgid(pid, pgid);
+    return pid;
+}
+
+// run_pipeline: I connect n stages with pipes (O_CLOEXEC, so only the dup2'd ends
+// survive into each child), put them all in one process group, run echo and
+// "< file" stages as in-shell feeders, function and built-in stages in forked copies
+// of me, and then either add the whole thing as a job (&) or wait for it in the
+// foreground. If usage is not NULL, I add what the foreground job's processes cost to
+// it (for the time prefix).
+static void run_pipeline(stage_t *st, int n, int background, const char *cmd, size_t cmdlen,
+                         struct rusage *usage, arena_t *scratch) {
+    for (int i = 0; i < n; i++) {
+        int file_source = (i == 0 && n > 1 && st[i].argv[0] == NULL && st[i].nredirs > 0);
+        if (st[i].argv[0] == NULL && !file_source) {
+            fprintf(stderr, "icsh: syntax error near '|'\n");
+            last_status = 2;
+            return;
+        }
+    }
+
+    job_t j;
+    memset(&j, 0, sizeof(j));
+    j.start_ns = now_ns();
+    j.cgroup   = cgroup_create(&launch_cg_fd);
+
+    // anything I printed so far must reach stdout before the children write to it
+    tty_sync();
+    pid_t pgid = job_control ? 0 : -1;
+    launch_fg  = job_control && !background;
+
+    feeder_t feeders[MAX_STAGES];
+    int nfeed = 0;
+    int prev_read = -1;
+    int last_failed = 0;
+
+    for (int i = 0; i < n; i++) {
+        int p[2] = { -1, -1 };
+        if (i < n - 1 && pipe2(p, O_CLOEXEC) < 0) {
+            perror("pipe");
+            break;
+        }
+        int is_echo = (st[i].argv[0] != NULL && strcmp(st[i].argv[0], "echo") == 0);
+
+        if (is_echo || st[i].argv[0] == NULL) {
+            // in-shell stage: echo ignores its stdin, so I just drop the read end.
+            // Its redirections are planned but never dup'd: redir_target_of() tells me
+            // which fd the data goes to (or comes from).
+            feeder_t *f = &feeders[nfeed];
+            memset(f, 0, sizeof(*f));
+            f->fd_out = p[1];
+            f->src_fd = -1;
+            redir_plan_t plan;
+            if (redir_plan(&plan, st[i].redirs, st[i].nredirs, -1, p[1]) < 0) {
+                if (i == n - 1) last_failed = 1;
+            }
+            else if (is_echo) {
+                f->buf  = echo_render(st[i].argv + 1, &f->len, &f->maplen);
+                int out = redir_target_of(&plan, STDOUT_FILENO);
+                if (f->buf != NULL && out != p[1]) {
+                    // "echo ... > file" writes the file, not the pipe; the last stage
+                    // writes to my stdout
+                    tty_sync();
+                    if (out >= 0 && write(out, f->buf, f->len) < 0) perror("echo");
+                    munmap(f->buf, f->maplen);
+                    f->buf = NULL;
+                    if (i == n - 1) last_status = 0;
+                }
+                redir_done(&plan);
+            }
+            else {
+                // the feeder outlives the plan, so it gets its own copy of the source
+                int in = redir_target_of(&plan, STDIN_FILENO);
+                f->src_fd = (in >= 0) ? fcntl(in, F_DUPFD_CLOEXEC, 3) : -1;
+                redir_done(&plan);
+            }
+
+            if (f->fd_out >= 0 && (f->buf != NULL || f->src_fd >= 0)) {
+                nfeed++;
+            } else {
+                // nothing to feed: close the pipe so the next stage sees EOF
+                if (f->fd_out >= 0) close(f->fd_out);
+                if (f->src_fd >= 0) close(f->src_fd);
+                if (f->buf != NULL) munmap(f->buf, f->maplen);
+            }
+        }
+        else {
+            struct func *fn = func_find(st[i].argv[0]);
+            pid_t pid = (fn != NULL || builtin_find(st[i].argv[0]) != NULL)
+                ? fork_shell_stage(fn, &st[i], scratch, prev_read, p, feeders, nfeed, pgid)
+                : launch_external(st[i].argv, st[i].envp, st[i].redirs, st[i].nredirs,
+                                  prev_read, p[1], pgid);
+            if (p[1] >= 0) close(p[1]);
+            if (pid > 0) {
+                if (pgid == 0) pgid = pid;
+                j.pids[j.npids++] = pid;
+                if (i == n - 1) j.last_pid = pid;
+            }
+            else if (i == n - 1) {
+                last_failed = 1;
+            }
+        }
+        if (prev_read >= 0) close(prev_read);
+        prev_read = p[0];
+    }
+    if (prev_read >= 0) close(prev_read);
+
+    // now that every reader is running, I push the feeders' data into their pipes
+    for (int k = 0; k < nfeed; k++) {
+        if (!feed(&feeders[k], 1)) {
+            pid_t pid = feed_in_helper(feeders, nfeed, k, pgid);
+            if (pid > 0) {
+                if (pgid == 0) pgid = pid;
+                j.pids[j.npids++] = pid;
+            }
+        }
+    }
+    for (int k = 0; k < nfeed; k++) {
+        close(feeders[k].fd_out);
+        if (feeders[k].buf != NULL) munmap(feeders[k].buf, feeders[k].maplen);
+        if (feeders[k].src_fd >= 0) close(feeders[k].src_fd);
+    }
+    if (launch_cg_fd >= 0) {
+        close(launch_cg_fd);
+        launch_cg_fd = -1;
+    }
+    launch_fg = 0;
+
+    j.pgid  = (pgid > 0) ? pgid : 0;
+    j.nlive = j.npids;
+    if (last_failed) {
+        last_status = 1;
+    }
+    if (j.npids == 0) {
+        cgroup_remove(j.cgroup);
+        return;
+    }
+    if (launch_timeout.after > 0) {
+        deadline_t d = { .when = j.start_ns + launch_timeout.after, .kind = DL_KILL,
+                         .sig = launch_timeout.sig, .grace = launch_timeout.grace };
+        j.deadline = deadline_add(&d);
+    }
+
+    // parent process:
+    if (background) {
+        // if user said "&", I add it to my job list and return without waiting.
+        // Only now do I copy the command text, since the table keeps it.
+        j.cmdline = strndup(cmd, cmdlen);
+        if (launch_log != NULL) {
+            j.log = launch_log;
+            j.log->refs++;
+        }
+        add_job(&j);
+        return;
+    }
+
+    // otherwise this is a foreground job: wait for it, but allow it to stop (WUNTRACED)
+    give_terminal_to(j.pgid);
+    int stopped = wait_for_job(&j);
+    take_terminal_back(&j, stopped);
+    if (usage != NULL) usage_add(usage, &j.ru);
+
+    // if it got stopped by Ctrl-Z, keep it as a stopped job
+    if (stopped) {
+        j.cmdline = strndup(cmd, cmdlen);
+        add_stopped_job(&j);
+    } else {
+        cgroup_remove(j.cgroup);
+    }
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Built-ins on timers: timeout, at, every
+// ────────────────────────────────────────────────────────────────────────────
+
+// parse_duration: "10", "2.5s", "500ms", "5m", "2h" or "1d", like timeout(1) (plus
+// "ms"), into nanoseconds. I return -1 if it is not one.
+static int parse_duration(const char *s, long long *ns) {
+    char  *end;
+    double v    = strtod(s, &end);
+    double unit = 1e9;
+    if (end == s || !(v >= 0)) return -1;
+    if (strcmp(end, "ms") == 0)     unit = 1e6;
+    else if (strcmp(end, "m") == 0) unit = 60e9;
+    else if (strcmp(end, "h") == 0) unit = 3600e9;
+    else if (strcmp(end, "d") == 0) unit = 86400e9;
+    else if (*end != '\0' && strcmp(end, "s") != 0) return -1;
+    if (v * unit > 9e18) return -1;
+    *ns = (long long)(v * unit);
+    return 0;
+}
+
+// parse_clock_time: "HH:MM" or "HH:MM:SS" as the time from now until that time of day,
+// today or, if it has passed, tomorrow. I return -1 if it is not one.
+static int parse_clock_time(const char *s, long long *ns) {
+    long  f[3] = { 0, 0, 0 };
+    int   nf   = 0;
+    char *p    = (char *)s;
+    while (nf < 3 && *p >= '0' && *p <= '9') {
+        f[nf++] = strtol(p, &p, 10);
+        if (*p != ':' || nf == 3) break;
+        p++;
+    }
+    if (*p != '\0' || nf < 2 || f[0] > 23 || f[1] > 59 || f[2] > 59) return -1;
+
+    time_t    t = time(NULL);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    long wait_s = f[0] * 3600 + f[1] * 60 + f[2] - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec);
+    if (wait_s <= 0) wait_s += 86400;
+    *ns = wait_s * 1000000000LL;
+    return 0;
+}
+
+// timeout_prefix: "timeout [-s SIG] [-k GRACE] DURATION command..." in front of a
+// pipeline. I take those words off *argv and return the deadline: after ns the job
+// gets sig, and GRACE later SIGKILL if it is still there. A DURATION of 0 means no
+// deadline. I return -1 on a bad option or a missing command (status 125, like
+// timeout(1); a job that times out exits 124).
+static int timeout_prefix(char ***argv, long long *after, long long *grace, int *sig) {
+    char **a = *argv + 1;
+    for (; a[0] != NULL && a[0][0] == '-' && a[1] != NULL; a += 2) {
+        if (strcmp(a[0], "-s") == 0 && (*sig = signal_by_name(a[1])) > 0) continue;
+        if (strcmp(a[0], "-k") == 0 && parse_duration(a[1], grace) == 0) continue;
+        fprintf(stderr, "icsh: timeout: %s %s: invalid option\n", a[0], a[1]);
+        return -1;
+    }
+    if (a[0] == NULL || a[1] == NULL || parse_duration(a[0], after) < 0) {
+        fprintf(stderr, "icsh: timeout: usage: timeout [-s SIG] [-k DURATION] DURATION command...\n");
+        return -1;
+    }
+    *argv = a + 1;
+    return 0;
+}
+
+void runCmd(const char *line, size_t len);
+
+// sched_launch: an "at" or "every" command is due. A forked copy of me runs it as a
+// background job in job_list[], with /dev/null as its stdin, so it shows up in jobs,
+// can be killed, and is reported when it is done, but without a "[id] pid" line. It
+// starts on time even while I wait for a foreground job.
+static void sched_launch(const char *cmd) {
+    int       log_fd = -1;
+    joblog_t *log    = joblog_open(&log_fd);
+    tty_sync();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("failed to fork");
+        if (log_fd >= 0) close(log_fd);
+        joblog_release(log);
+        return;
+    }
+    if (pid == 0) {
+        join_pgid(0, job_control ? 0 : -1);
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0 && null_fd != STDIN_FILENO) {
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
+        }
+        if (log_fd >= 0) {
+            dup2(log_fd, STDOUT_FILENO);
+            dup2(log_fd, STDERR_FILENO);
+            close(log_fd);
+        }
+        // I may have been in the middle of anything; the copy only runs cmd
+        job_control = 0;
+        in_subshell = 1;
+        out_capture = NULL;
+        subst_fd    = -1;
+        fg_job      = NULL;
+        deadlines_forget();
+        joblogs_forget();
+        trace_forget();
+        runCmd(cmd, strlen(cmd));
+        tty_sync();
+        trace_drain();
+        _exit(last_status);
+    }
+    join_pgid(pid, job_control ? pid : -1);
+
+    job_t j;
+    memset(&j, 0, sizeof(j));
+    j.pgid     = job_control ? pid : 0;
+    j.start_ns = now_ns();
+    j.pids[0]  = pid;
+    j.npids    = 1;
+    j.nlive    = 1;
+    j.last_pid = pid;
+    j.cmdline  = strdup(cmd);
+    j.log      = log;
+    if (log_fd >= 0) close(log_fd);
+    add_job_entry(&j, JOB_RUNNING);
+}
+
+// deadline_fire: d is due. A scheduled command is launched (an "every" goes back in the
+// heap, one period on, skipping runs I was too late for). A timeout signals its job
+// wherever the job is now, the foreground job or an entry in job_list[] (a job that
+// stopped and got a new ID keeps its deadline), continues it if it is stopped, and
+// comes back once more for SIGKILL if it had a grace period.
+static void deadline_fire(deadline_t *d) {
+    if (d->kind == DL_RUN) {
+        sched_launch(d->cmd);
+        if (d->every == 0) {
+            free(d->cmd);
+            return;
+        }
+        long long now = now_ns();
+        while (d->when <= now) d->when += d->every;
+        deadline_add(d);
+        return;
+    }
+
+    job_t *j = (fg_job != NULL && fg_job->deadline == d->id) ? fg_job : NULL;
+    for (int i = job_head; i != -1 && j == NULL; i = job_list[i].next) {
+        if (job_list[i].deadline == d->id) j = &job_list[i];
+    }
+    if (j == NULL) return;
+    j->timed_out = 1;
+    signal_job(j, d->sig);
+    if (j->state == JOB_STOPPED) signal_job(j, SIGCONT);
+    if (d->grace > 0) {
+        d->when  = now_ns() + d->grace;
+        d->sig   = SIGKILL;
+        d->grace = 0;
+        deadline_add(d);
+    }
+}
+
+// by_due: qsort order for the "at" listing, soonest first.
+static int by_due(const void *a, const void *b) {
+    long long x = (*(deadline_t *const *)a)->when, y = (*(deadline_t *const *)b)->when;
+    return (x > y) - (x < y);
+}
+
+// Built-in "at WHEN command..." runs the command once at WHEN, a duration from now
+// (see parse_duration()) or a time of day HH:MM[:SS]; "every INTERVAL command..."
+// runs it every INTERVAL, the first time one INTERVAL from now. The words after
+// WHEN are joined with spaces and parsed only when the command runs, so quote
+// anything (a redirection, a ";") that is not meant for "at" itself. "at" alone
+// lists what is pending, soonest first, and "at -d ID" cancels an entry.
+static void builtin_at(char **argv) {
+    int every = (strcmp(argv[0], "every") == 0);
+    if (!every && argv[1] == NULL) {
+        deadline_t **due = malloc((ndeadlines + 1) * sizeof(*due));
+        int          n   = 0;
+        for (int i = 0; i < ndeadlines && due != NULL; i++) {
+            if (deadlines[i].kind == DL_RUN) due[n++] = &deadlines[i];
+        }
+        if (n > 0) qsort(due, n, sizeof(*due), by_due);
+        long long now = now_ns();
+        for (int i = 0; i < n; i++) {
+            out_printf("%u  in %.1fs", due[i]->id, (due[i]->when - now) / 1e9);
+            if (due[i]->every) out_printf("  every %gs", due[i]->every / 1e9);
+            out_printf("  %s\n", due[i]->cmd);
+        }
+        free(due);
+        last_status = 0;
+        return;
+    }
+    if (!every && strcmp(argv[1], "-d") == 0) {
+        last_status = 0;
+        for (char **a = argv + 2; *a != NULL; a++) {
+            unsigned id = (unsigned)strtoul(*a, NULL, 10);
+            int      i  = 0;
+            while (i < ndeadlines && !(deadlines[i].id == id && deadlines[i].kind == DL_RUN)) i++;
+            if (i == ndeadlines) {
+                fprintf(stderr, "icsh: at: %s: no such entry\n", *a);
+                last_status = 1;
+                continue;
+            }
+            deadline_drop(DL_RUN, id);
+        }
+        return;
+    }
+
+    long long wait_ns;
+    int       ok = (argv[1] != NULL && argv[2] != NULL);
+    if (ok && !every && strchr(argv[1], ':') != NULL) ok = (parse_clock_time(argv[1], &wait_ns) == 0);
+    else if (ok) ok = (parse_duration(argv[1][0] == '+' ? argv[1] + 1 : argv[1], &wait_ns) == 0);
+    if (!ok || (every && wait_ns == 0)) {
+        fprintf(stderr, every ? "icsh: every: usage: every INTERVAL command...\n"
+                              : "icsh: at: usage: at [WHEN command... | -d ID...]\n");
+        last_status = 2;
+        return;
+    }
+
+    size_t len = 0;
+    for (char **a = argv + 2; *a != NULL; a++) len += strlen(*a) + 1;
+    static unsigned next_entry = 1;
+    deadline_t d = { .when = now_ns() + wait_ns, .every = every ? wait_ns : 0,
+                     .id = next_entry++, .kind = DL_RUN, .cmd = malloc(len) };
+    if (d.cmd == NULL) {
+        fprintf(stderr, "icsh: %s: out of memory\n", argv[0]);
+        last_status = 1;
+        return;
+    }
+    char *p = d.cmd;
+    for (char **a = argv + 2; *a != NULL; a++) {
+        size_t n = strlen(*a);
+        memcpy(p, *a, n);
+        p += n;
+        *p++ = ' ';
+    }
+    p[-1] = '\0';
+    last_status = deadline_add(&d) ? 0 : 1;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Coprocesses: long-lived workers behind a pair of pipes
+// ────────────────────────────────────────────────────────────────────────────
+
+// A script that calls the same tool thousands of times pays fork+exec+dynamic linking
+// every time. A coprocess is started once and then fed requests over a pipe:
+//
+//   coproc NAME cmd args...      start cmd as worker NAME, talking in lines: every
+//                                request is one line and the reply is one line back
+//   coproc -f NAME cmd args...   start NAME with framed replies: the request is still
+//                                one line (a script line never holds a "\n"), the
+//                                reply is "<status> <length>\n" plus that many bytes.
+//                                "icsh --worker" speaks this, so script lines can run
+//                                in a warm copy of me
+//   coproc -c NAME text...       send the words (joined by spaces) as one request and
+//                                print the reply; a framed reply sets $? too
+//   coproc -k NAME               close the worker's stdin and let it exit
+//   coproc                       list the workers
+//
+// Each worker is also an entry in job_list[], so jobs, fg and kill-by-job work on it;
+// its on_done hook drops the coprocess when the process goes away.
+typedef struct coproc {
+    char          *name;
+    pid_t          pid;
+    int            job_id;
+    int            to_fd;      // write end of the worker's stdin
+    int            from_fd;    // read end of the worker's stdout
+    int            framed;
+    char          *rbuf;       // bytes read from the worker but not consumed yet
+    size_t         rlen;
+    size_t         rcap;
+    int            busy;       // coproc -c is waiting for its reply
+    int            dead;       // it exited meanwhile; freed once that call returns
+    struct coproc *next;
+} coproc_t;
+
+static coproc_t *coprocs = NULL;
+
+static coproc_t *find_coproc(const char *name) {
+    for (coproc_t *c = coprocs; c != NULL; c = c->next) {
+        if (strcmp(c->name, name) == 0) return c;
+    }
+    return NULL;
+}
+
+static void coproc_free(coproc_t *c) {
+    for (coproc_t **pp = &coprocs; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == c) {
+            *pp = c->next;
+            break;
+        }
+    }
+    if (c->to_fd >= 0) close(c->to_fd);
+    close(c->from_fd);
+    free(c->rbuf);
+    free(c->name);
+    free(c);
+}
+
+// on_done hook of a worker's job entry: it exited, so I report it and forget it. This
+// runs from the event loop, which may be inside coproc_call() for this very worker;
+// then I only take it off the list, and coproc_call() frees it when it is done with it.
+static void coproc_done(job_t *j, int status) {
+    coproc_t *c = j->on_done_arg;
+    report_job_status(j, status);
+    if (!c->busy) {
+        coproc_free(c);
+        return;
+    }
+    for (coproc_t **pp = &coprocs; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == c) {
+            *pp = c->next;
+            break;
+        }
+    }
+    c->dead = 1;
+}
+
+static void coproc_start(char **args, int framed) {
+    if (args[0] == NULL || args[1] == NULL) {
+        fprintf(stderr, "coproc: usage: coproc [-f] NAME command [args...]\n");
+        last_status = 2;
+        return;
+    }
+    if (find_coproc(args[0]) != NULL) {
+        fprintf(stderr, "coproc: %s is already running\n", args[0]);
+        last_status = 1;
+        return;
+    }
+    int to[2], from[2];
+    if (pipe2(to, O_CLOEXEC) < 0) {
+        perror("pipe");
+        last_status = 1;
+        return;
+    }
+    if (pipe2(from, O_CLOEXEC) < 0) {
+        perror("pipe");
+        close(to[0]);
+        close(to[1]);
+        last_status = 1;
+        return;
+    }
+    tty_sync();
+    pid_t pid = launch_external(args + 1, NULL, NULL, 0, to[0], from[1], job_control ? 0 : -1);
+    close(to[0]);
+    close(from[1]);
+    if (pid < 0) {
+        close(to[1]);
+        close(from[0]);
+        last_status = 1;
+        return;
+    }
+
+    coproc_t *c = calloc(1, sizeof(*c));
+    if (c == NULL || (c->name = strdup(args[0])) == NULL) {
+        perror("coproc");
+        kill(pid, SIGTERM);
+        close(to[1]);
+        close(from[0]);
+        free(c);
+        last_status = 1;
+        return;
+    }
+    c->pid     = pid;
+    c->to_fd   = to[1];
+    c->from_fd = from[0];
+    c->framed  = framed;
+
+    // the job's cmdline is "coproc NAME cmd args..."
+    size_t need = strlen("coproc ") + 1;
+    for (char **a = args; *a != NULL; a++) need += strlen(*a) + 1;
+    char *cmdline = malloc(need);
+    if (cmdline == NULL) {
+        perror("coproc");
+        kill(pid, SIGTERM);
+        coproc_free(c);
+        last_status = 1;
+        return;
+    }
+    strcpy(cmdline, "coproc");
+    for (char **a = args; *a != NULL; a++) {
+        strcat(cmdline, " ");
+        strcat(cmdline, *a);
+    }
+
+    job_t j;
+    memset(&j, 0, sizeof(j));
+    j.pgid        = job_control ? pid : 0;
+    j.start_ns    = now_ns();
+    j.pids[0]     = pid;
+    j.npids       = 1;
+    j.nlive       = 1;
+    j.last_pid    = pid;
+    j.cmdline     = cmdline;
+    j.on_done     = coproc_done;
+    j.on_done_arg = c;
+    job_t *added = add_job_entry(&j, JOB_RUNNING);
+    if (added == NULL) {
+        // not tracked means I cannot reap it properly; better not to keep it
+        kill(pid, SIGTERM);
+        coproc_free(c);
+        last_status = 1;
+        return;
+    }
+    c->job_id = added->id;
+    c->next   = coprocs;
+    coprocs   = c;
+    tty_printf(&tty_out, "[%d] %d\n", added->id, pid);
+    last_status = 0;
+}
+
+// coproc_fill: I wait (in my event loop, so Ctrl-C works) until the worker has sent
+// more bytes and append them to rbuf. I return 0 at EOF or when interrupted.
+static int coproc_fill(coproc_t *c) {
+    if (c->rlen == c->rcap) {
+        size_t cap   = c->rcap ? c->rcap * 2 : 4096;
+        char  *grown = realloc(c->rbuf, cap);
+        if (grown == NULL) return 0;
+        c->rbuf = grown;
+        c->rcap = cap;
+    }
+    in_wait          = 1;
+    wait_interrupted = 0;
+    while (!wait_for_events(c->from_fd, -1)) {
+        if (wait_interrupted) {
+            in_wait = 0;
+            return 0;
+        }
+    }
+    in_wait = 0;
+    ssize_t n;
+    do {
+        n = read(c->from_fd, c->rbuf + c->rlen, c->rcap - c->rlen);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return 0;
+    c->rlen += n;
+    return 1;
+}
+
+// I drop the first n bytes of rbuf (a reply I have handled).
+static void coproc_consume(coproc_t *c, size_t n) {
+    memmove(c->rbuf, c->rbuf + n, c->rlen - n);
+    c->rlen -= n;
+}
+
+// coproc_print: a reply goes to my stdout in full, however many writes that takes.
+static void coproc_print(const char *buf, size_t n) {
+    for (size_t off = 0; off < n; ) {
+        ssize_t w = write(STDOUT_FILENO, buf + off, n - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            perror("coproc");
+            return;
+        }
+        off += w;
+    }
+}
+
+// coproc_request: send one request to c and print the reply (see coproc_call()).
+static void coproc_request(coproc_t *c, char **args) {
+    if (c->to_fd < 0) {
+        fprintf(stderr, "coproc: %s: input already closed\n", c->name);
+        last_status = 1;
+        return;
+    }
+
+    // the request: the words joined by spaces, then "\n", in one write
+    size_t need = 1;
+    for (char **a = args + 1; *a != NULL; a++) need += strlen(*a) + 1;
+    char  *req = malloc(need);
+    size_t len = 0;
+    if (req == NULL) {
+        perror("coproc");
+        last_status = 1;
+        return;
+    }
+    for (char **a = args + 1; *a != NULL; a++) {
+        if (len > 0) req[len++] = ' ';
+        memcpy(req + len, *a, strlen(*a));
+        len += strlen(*a);
+    }
+    req[len++] = '\n';
+    for (size_t off = 0; off < len; ) {
+        ssize_t n = write(c->to_fd, req + off, len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "coproc: %s: %s\n", c->name, strerror(errno));
+            free(req);
+            last_status = 1;
+            return;
+        }
+        off += n;
+    }
+    free(req);
+
+    tty_sync();
+    if (!c->framed) {
+        // one line back
+        char *nl;
+        while ((nl = memchr(c->rbuf, '\n', c->rlen)) == NULL) {
+            if (!coproc_fill(c)) goto closed;
+        }
+        size_t n = nl - c->rbuf + 1;
+        coproc_print(c->rbuf, n);
+        coproc_consume(c, n);
+        last_status = 0;
+        return;
+    }
+
+    // "<status> <length>\n" and then the output
+    char *nl;
+    while ((nl = memchr(c->rbuf, '\n', c->rlen)) == NULL) {
+        if (!coproc_fill(c)) goto closed;
+    }
+    int    status;
+    size_t body;
+    if (sscanf(c->rbuf, "%d %zu", &status, &body) != 2) {
+        fprintf(stderr, "coproc: %s: bad reply header\n", c->name);
+        last_status = 1;
+        return;
+    }
+    coproc_consume(c, nl - c->rbuf + 1);
+    while (c->rlen < body) {
+        if (!coproc_fill(c)) goto closed;
+    }
+    coproc_print(c->rbuf, body);
+    coproc_consume(c, body);
+    last_status = status;
+    return;
+
+closed:
+    fprintf(stderr, "coproc: %s: no reply\n", c->name);
+    last_status = 1;
+}
+
+static void coproc_call(char **args) {
+    coproc_t *c = (args[0] != NULL) ? find_coproc(args[0]) : NULL;
+    if (c == NULL) {
+        fprintf(stderr, "coproc: no such coprocess %s\n", args[0] ? args[0] : "");
+        last_status = 1;
+        return;
+    }
+    // the worker may exit while I wait for its reply; c stays mine until I return
+    c->busy = 1;
+    coproc_request(c, args);
+    c->busy = 0;
+    if (c->dead) coproc_free(c);
+}
+
+// Built-in "coproc" (see the top of this section).
+static void builtin_coproc(char **args) {
+    if (args[0] == NULL) {
+        for (coproc_t *c = coprocs; c != NULL; c = c->next) {
+            out_printf("[%d] %d %s%s\n", c->job_id, c->pid, c->name, c->framed ? " (framed)" : "");
+        }
+        last_status = 0;
+    }
+    else if (strcmp(args[0], "-f") == 0) {
+        coproc_start(args + 1, 1);
+    }
+    else if (strcmp(args[0], "-c") == 0) {
+        coproc_call(args + 1);
+    }
+    else if (strcmp(args[0], "-k") == 0) {
+        coproc_t *c = (args[1] != NULL) ? find_coproc(args[1]) : NULL;
+        if (c == NULL) {
+            fprintf(stderr, "coproc: no such coprocess %s\n", args[1] ? args[1] : "");
+            last_status = 1;
+            return;
+        }
+        // EOF on its stdin; reap_children() cleans up when it exits
+        if (c->to_fd >= 0) close(c->to_fd);
+        c->to_fd    = -1;
+        last_status = 0;
+    }
+    else {
+        coproc_start(args, 0);
+    }
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Parser: re-entrant lexer, arena-allocated AST, and a parse cache
+// ────────────────────────────────────────────────────────────────────────────
+
+// A word keeps its raw text (quotes and all) and flags saying what expansion it needs,
+// so the cached AST stays valid however $? changes between runs.
+#define WORD_QUOTED 1   // has quotes or backslashes to remove
+#define WORD_DOLLAR 2   // has a '$' or '`' outside single quotes
+#define WORD_GLOB   4   // has an unquoted '*', '?' or '['
+#define WORD_SPLIT  8   // has a "$(...)" or "`...`" outside double quotes
+
+typedef struct {
+    const char *text;   // raw text, '\0'-terminated, in the AST's arena
+    size_t      len;
+    int         flags;
+} word_t;
+
+typedef enum {
+    REDIR_IN,        // <
+    REDIR_OUT,       // >
+    REDIR_APPEND,    // >>
+    REDIR_DUP_IN,    // <&
+    REDIR_DUP_OUT,   // >&
+    REDIR_HEREDOC,   // <<
+    REDIR_HERESTR,   // <<<
+} redir_kind_t;
+
+typedef struct redir {
+    redir_kind_t  kind;
+    int           fd;        // the fd it redirects: 0 or 1 unless written as "N>"
+    word_t        target;    // file, fd number, here-document delimiter or here-string
+    int           heredoc;   // REDIR_HEREDOC: which of the line's here-documents it is
+    struct redir *next;
+    struct redir *hd_next;   // REDIR_HEREDOC: the line's next here-document
+} redir_t;
+
+// NODE_IF and everything after it are compound commands: they run in the shell and
+// may carry redirections for their whole body.
+typedef enum {
+    NODE_CMD, NODE_PIPE, NODE_AND, NODE_OR, NODE_SEQ, NODE_BG,
+    NODE_IF, NODE_WHILE, NODE_FOR, NODE_GROUP, NODE_FUNC, NODE_SUBSHELL
+} node_kind_t;
+
+// One AST node. src/src_len is the source text it came from, which is what jobs shows.
+typedef struct node {
+    node_kind_t  kind;
+    const char  *src;
+    size_t       src_len;
+    redir_t     *redirs;   // compound commands: redirections around the whole thing
+    union {
+        struct { word_t *words; int nwords; redir_t *redirs; } cmd;   // NODE_CMD
+        struct { struct node **cmds; int ncmds; } pipe;               // NODE_PIPE
+        struct { struct node *left, *right; } bin;                    // NODE_AND/OR/SEQ
+        struct { struct node *body; } bg;                             // NODE_BG/GROUP/
+                                                                      // SUBSHELL
+        struct { struct node *cond, *then, *els; } cond;              // NODE_IF ("elif"
+                                                                      // is an els NODE_IF)
+        struct { struct node *cond, *body; int until; } loop;         // NODE_WHILE
+        struct { word_t var; word_t *words; int nwords; int has_in;   // NODE_FOR
+                 struct node *body; } loop_for;
+        struct { const char *name; struct node *body; } func;         // NODE_FUNC
+    };
+} node_t;
+
+typedef enum {
+    TOK_WORD, TOK_PIPE, TOK_AND_IF, TOK_OR_IF, TOK_AMP, TOK_SEMI, TOK_NEWLINE,
+    TOK_LESS, TOK_GREAT, TOK_DGREAT, TOK_DLESS, TOK_TLESS, TOK_LESSAND, TOK_GREATAND,
+    TOK_IO_NUMBER, TOK_LPAREN, TOK_RPAREN, TOK_EOF, TOK_ERROR
+} tok_kind_t;
+
+typedef struct {
+    tok_kind_t  kind;
+    const char *start;   // points into the source
+    size_t      len;
+    int         flags;   // WORD_* for TOK_WORD
+} token_t;
+
+// All lexer/parser state lives in this struct (no strtok-style statics), so parsing
+// can nest, e.g. when a later feature parses text while running a command.
+typedef struct {
+    const char *src;
+    size_t      len;
+    size_t      pos;
+    token_t     tok;     // one token of lookahead
+    arena_t    *arena;
+    const char *error;   // first syntax error, or NULL
+    char        msg[64];     // the text of a "syntax error near ..." error
+    redir_t    *heredocs;    // here-documents in the order their bodies follow the line
+    redir_t   **hd_tail;
+    int         nheredocs;
+    int         depth;       // compound commands I am inside of
+    int         incomplete;  // the error is only that the text ended inside one
+    int         nested_heredoc;   // a here-document inside a compound command
+} parser_t;
+
+static int is_op_char(char c) {
+    return c == '|' || c == '&' || c == ';' || c == '<' || c == '>' || c == '\n' ||
+           c == '(' || c == ')';
+}
+
+// subst_end: s[i] is just past the "$(" of a command substitution. I return the index
+// of its closing ')', or len if there is none. Quotes, backslashes, backquotes and
+// nested "$(" inside it are skipped over, so a ')' in any of them does not count.
+static size_t backq_end(const char *s, size_t len, size_t i);
+
+static size_t subst_end(const char *s, size_t len, size_t i) {
+    int depth = 1;
+    while (i < len) {
+        char c = s[i];
+        if (c == '\\') {
+            i += 2;
+            continue;
+        }
+        if (c == '\'') {
+            const char *end = memchr(s + i + 1, '\'', len - i - 1);
+            if (end == NULL) return len;
+            i = end - s;
+        }
+        else if (c == '"') {
+            for (i++; i < len && s[i] != '"'; i++) {
+                if (s[i] == '\\') i++;
+                else if (s[i] == '$' && i + 1 < len && s[i + 1] == '(') i = subst_end(s, len, i + 2);
+                else if (s[i] == '`') i = backq_end(s, len, i + 1);
+            }
+        }
+        else if (c == '`') {
+            i = backq_end(s, len, i + 1);
+        }
+        else if (c == '$' && i + 1 < len && s[i + 1] == '(') {
+            i = subst_end(s, len, i + 2);
+        }
+        else if (c == '(') {
+            depth++;
+        }
+        else if (c == ')' && --depth == 0) {
+            return i;
+        }
+        if (i >= len) return len;
+        i++;
+    }
+    return len;
+}
+
+// backq_end: s[i] is just past an opening '`'. I return the index of the closing one,
+// or len. Inside, a backslash escapes the next character.
+static size_t backq_end(const char *s, size_t len, size_t i) {
+    while (i < len && s[i] != '`') {
+        i += (s[i] == '\\') ? 2 : 1;
+    }
+    return (i < len) ? i : len;
+}
+
+// lex_subst: s[i] starts "$(" or '`'. I return the index of its last character, or
+// len after recording the error if it is not closed.
+static size_t lex_subst(parser_t *p, size_t i) {
+    int    paren = (p->src[i] == '$');
+    size_t end   = paren ? subst_end(p->src, p->len, i + 2) : backq_end(p->src, p->len, i + 1);
+    if (end >= p->len) {
+        p->tok.kind = TOK_ERROR;
+        p->error    = paren ? "unexpected end of line while looking for matching ')'"
+                            : "unexpected end of line while looking for matching '`'";
+    }
+    return end;
+}
+
+// lex_next: I scan one token starting at p->pos. A word runs until an unquoted blank
+// or operator character; quotes and backslashes are kept in the text and only flagged.
+static void lex_next(parser_t *p) {
+    const char *s = p->src;
+    size_t      i = p->pos;
+
+    for (;;) {
+        while (i < p->len && (s[i] == ' ' || s[i] == '\t' || s[i] == '\r')) i++;
+        if (i < p->len && s[i] == '#') {
+            // a comment runs to the end of the line
+            while (i < p->len && s[i] != '\n') i++;
+            continue;
+        }
+        break;
+    }
+
+    token_t *t = &p->tok;
+    t->start = s + i;
+    t->flags = 0;
+    if (i >= p->len) {
+        t->kind = TOK_EOF;
+        t->len  = 0;
+        p->pos  = i;
+        return;
+    }
+
+    char c  = s[i];
+    char c2 = (i + 1 < p->len) ? s[i + 1] : '\0';
+    if (is_op_char(c)) {
+        t->len = 1;
+        switch (c) {
+            case '|':  if (c2 == '|') { t->kind = TOK_OR_IF; t->len = 2; } else t->kind = TOK_PIPE; break;
+            case '&':  if (c2 == '&') { t->kind = TOK_AND_IF; t->len = 2; } else t->kind = TOK_AMP; break;
+            case ';':  t->kind = TOK_SEMI;    break;
+            case '(':  t->kind = TOK_LPAREN;  break;
+            case ')':  t->kind = TOK_RPAREN;  break;
+            case '<':
+                if (c2 == '<') {
+                    int three = (i + 2 < p->len && s[i + 2] == '<');
+                    t->kind = three ? TOK_TLESS : TOK_DLESS;
+                    t->len  = three ? 3 : 2;
+                }
+                else if (c2 == '&') { t->kind = TOK_LESSAND; t->len = 2; }
+                else t->kind = TOK_LESS;
+                break;
+            case '>':
+                if (c2 == '>')      { t->kind = TOK_DGREAT;   t->len = 2; }
+                else if (c2 == '&') { t->kind = TOK_GREATAND; t->len = 2; }
+                else t->kind = TOK_GREAT;
+                break;
+            default:   t->kind = TOK_NEWLINE; break;
+        }
+        p->pos = i + t->len;
+        return;
+    }
+
+    size_t start  = i;
+    size_t dollar = (size_t)-1;   // where the last unquoted '$' was
+    while (i < p->len && s[i] != ' ' && s[i] != '\t' && s[i] != '\r' && !is_op_char(s[i])) {
+        if (s[i] == '\\') {
+            t->flags |= WORD_QUOTED;
+            i += (i + 1 < p->len) ? 2 : 1;
+        }
+        else if (s[i] == '\'') {
+            t->flags |= WORD_QUOTED;
+            const char *end = memchr(s + i + 1, '\'', p->len - i - 1);
+            if (end == NULL) {
+                t->kind  = TOK_ERROR;
+                p->error = "unexpected end of line while looking for matching '''";
+                p->pos   = p->len;
+                return;
+            }
+            i = end - s + 1;
+        }
+        else if (s[i] == '"') {
+            t->flags |= WORD_QUOTED;
+            i++;
+            while (i < p->len && s[i] != '"') {
+                if (s[i] == '\\' && i + 1 < p->len) i++;
+                else if (s[i] == '`' || (s[i] == '$' && i + 1 < p->len && s[i + 1] == '(')) {
+                    t->flags |= WORD_DOLLAR;
+                    if ((i = lex_subst(p, i)) >= p->len) {
+                        p->pos = p->len;
+                        return;
+                    }
+                }
+                else if (s[i] == '$') t->flags |= WORD_DOLLAR;
+                i++;
+            }
+            if (i >= p->len) {
+                t->kind  = TOK_ERROR;
+                p->error = "unexpected end of line while looking for matching '\"'";
+                p->pos   = p->len;
+                return;
+            }
+            i++;
+        }
+        else if (s[i] == '`' || (s[i] == '$' && i + 1 < p->len && s[i + 1] == '(')) {
+            t->flags |= WORD_DOLLAR | WORD_SPLIT;
+            if ((i = lex_subst(p, i)) >= p->len) {
+                p->pos = p->len;
+                return;
+            }
+            i++;
+        }
+        else {
+            if (s[i] == '$') {
+                t->flags |= WORD_DOLLAR;
+                dollar    = i;
+            }
+            else if (s[i] == '?' && i == dollar + 1) ;   // "$?" is no pattern
+            else if (s[i] == '*' || s[i] == '?' || s[i] == '[') t->flags |= WORD_GLOB;
+            i++;
+        }
+    }
+    t->kind = TOK_WORD;
+    t->len  = i - start;
+    p->pos  = i;
+
+    // a short run of digits right before '<' or '>' names the fd, as in "2>&1"
+    if (t->flags == 0 && t->len <= 4 && i < p->len && (s[i] == '<' || s[i] == '>')) {
+        size_t k = start;
+        while (k < i && s[k] >= '0' && s[k] <= '9') k++;
+        if (k == i) t->kind = TOK_IO_NUMBER;
+    }
+}
+
+static int is_redir_op(tok_kind_t k) {
+    return k == TOK_LESS || k == TOK_GREAT || k == TOK_DGREAT || k == TOK_DLESS ||
+           k == TOK_TLESS || k == TOK_LESSAND || k == TOK_GREATAND;
+}
+
+// I record the first syntax error, naming the token where it happened. Running out of
+// text inside a compound command is marked incomplete: the reader can add the next
+// line and try again.
+static node_t *parse_error(parser_t *p) {
+    if (p->error == NULL) {
+        p->incomplete = (p->tok.kind == TOK_EOF && p->depth > 0);
+        if (p->incomplete) {
+            snprintf(p->msg, sizeof(p->msg), "syntax error: unexpected end of file");
+        } else if (p->tok.kind == TOK_EOF || p->tok.kind == TOK_NEWLINE) {
+            snprintf(p->msg, sizeof(p->msg), "syntax error near 'newline'");
+        } else {
+            snprintf(p->msg, sizeof(p->msg), "syntax error near '%.*s'",
+                     (int)p->tok.len, p->tok.start);
+        }
+        p->error = p->msg;
+    }
+    return NULL;
+}
+
+static node_t *new_node(parser_t *p, node_kind_t kind, const char *src) {
+    node_t *n = arena_alloc(p->arena, sizeof(node_t));
+    memset(n, 0, sizeof(*n));
+    n->kind = kind;
+    n->src  = src;
+    return n;
+}
+
+// I close a node's source span at the start of the current lookahead token.
+static void end_span(node_t *n, const char *end) {
+    while (end > n->src && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    n->src_len = end - n->src;
+}
+
+static word_t make_word(parser_t *p) {
+    word_t w;
+    w.text  = arena_strndup(p->arena, p->tok.start, p->tok.len);
+    w.len   = p->tok.len;
+    w.flags = p->tok.flags;
+    return w;
+}
+
+// redirection := [N] ('<' | '>' | '>>' | '<&' | '>&' | '<<' | '<<<') word
+// I append one to *tail. I return 0, or -1 on a syntax error.
+static int parse_redirect(parser_t *p, redir_t ***tail, int *nredirs) {
+    int fd = -1;
+    if (p->tok.kind == TOK_IO_NUMBER) {
+        fd = atoi(p->tok.start);
+        lex_next(p);
+    }
+    redir_kind_t kind;
+    switch (p->tok.kind) {
+        case TOK_LESS:     kind = REDIR_IN;      break;
+        case TOK_GREAT:    kind = REDIR_OUT;     break;
+        case TOK_DGREAT:   kind = REDIR_APPEND;  break;
+        case TOK_LESSAND:  kind = REDIR_DUP_IN;  break;
+        case TOK_GREATAND: kind = REDIR_DUP_OUT; break;
+        case TOK_DLESS:    kind = REDIR_HEREDOC; break;
+        case TOK_TLESS:    kind = REDIR_HERESTR; break;
+        default:           parse_error(p); return -1;
+    }
+    if (kind == REDIR_HEREDOC && p->depth > 0) {
+        // the body would have to come right after this line, but I only see the
+        // compound command once it is complete; parse_text() refuses it then, so the
+        // whole command is skipped rather than run line by line
+        p->nested_heredoc = 1;
+    }
+    if (fd < 0) {
+        int reads = (kind == REDIR_IN || kind == REDIR_DUP_IN ||
+                     kind == REDIR_HEREDOC || kind == REDIR_HERESTR);
+        fd = reads ? STDIN_FILENO : STDOUT_FILENO;
+    }
+    lex_next(p);
+    if (p->tok.kind != TOK_WORD) {
+        parse_error(p);
+        return -1;
+    }
+    if (++*nredirs > MAX_REDIRS) {
+        p->error = "too many redirections";
+        return -1;
+    }
+    redir_t *r = arena_alloc(p->arena, sizeof(redir_t));
+    memset(r, 0, sizeof(*r));
+    r->kind   = kind;
+    r->fd     = fd;
+    r->target = make_word(p);
+    if (kind == REDIR_HEREDOC) {
+        r->heredoc  = p->nheredocs++;
+        *p->hd_tail = r;
+        p->hd_tail  = &r->hd_next;
+    }
+    **tail = r;
+    *tail  = &r->next;
+    lex_next(p);
+    return 0;
+}
+
+// Reserved words only count as the first word of a command, written plainly.
+static int at_word(parser_t *p, const char *kw) {
+    size_t n = strlen(kw);
+    return p->tok.kind == TOK_WORD && p->tok.flags == 0 && p->tok.len == n &&
+           memcmp(p->tok.start, kw, n) == 0;
+}
+
+// the words (and the ')') that end a list inside a compound command
+static int at_closer(parser_t *p) {
+    return p->tok.kind == TOK_RPAREN || at_word(p, "then") || at_word(p, "elif") || at_word(p, "else") || at_word(p, "fi") ||
+           at_word(p, "do") || at_word(p, "done") || at_word(p, "}");
+}
+
+static int expect_word(parser_t *p, const char *kw) {
+    if (!at_word(p, kw)) {
+        parse_error(p);
+        return 0;
+    }
+    lex_next(p);
+    return 1;
+}
+
+static node_t *parse_list(parser_t *p);
+
+// A list inside a compound command may not be empty.
+static node_t *parse_body(parser_t *p) {
+    node_t *b = parse_list(p);
+    if (b == NULL && p->error == NULL) parse_error(p);
+    return b;
+}
+
+// if := 'if' list 'then' list ('elif' list 'then' list)* ['else' list] 'fi'
+static node_t *parse_if(parser_t *p, node_t *n) {
+    for (;;) {
+        lex_next(p);   // "if" or "elif"
+        if ((n->cond.cond = parse_body(p)) == NULL || !expect_word(p, "then") ||
+            (n->cond.then = parse_body(p)) == NULL) {
+            return NULL;
+        }
+        if (!at_word(p, "elif")) break;
+        node_t *elif = new_node(p, NODE_IF, p->tok.start);
+        n->cond.els  = elif;
+        n            = elif;
+    }
+    if (at_word(p, "else")) {
+        lex_next(p);
+        if ((n->cond.els = parse_body(p)) == NULL) return NULL;
+    }
+    return expect_word(p, "fi") ? n : NULL;
+}
+
+// while := ('while' | 'until') list 'do' list 'done'
+static node_t *parse_while(parser_t *p, node_t *n) {
+    n->loop.until = at_word(p, "until");
+    lex_next(p);
+    if ((n->loop.cond = parse_body(p)) == NULL || !expect_word(p, "do") ||
+        (n->loop.body = parse_body(p)) == NULL || !expect_word(p, "done")) {
+        return NULL;
+    }
+    return n;
+}
+
+// for := 'for' NAME [newline* 'in' word*] (';' | newline) newline* 'do' list 'done'
+// Without "in" the loop runs over the positional parameters.
+static node_t *parse_for(parser_t *p, node_t *n) {
+    lex_next(p);
+    if (p->tok.kind != TOK_WORD || p->tok.flags != 0 || !valid_var_name(p->tok.start, p->tok.len)) {
+        return parse_error(p);
+    }
+    n->loop_for.var = make_word(p);
+    lex_next(p);
+    while (p->tok.kind == TOK_NEWLINE) lex_next(p);
+    if (at_word(p, "in")) {
+        n->loop_for.has_in = 1;
+        lex_next(p);
+        int cap = 0;
+        while (p->tok.kind == TOK_WORD) {
+            if (n->loop_for.nwords == cap) {
+                int     ncap  = cap ? cap * 2 : 8;
+                word_t *grown = arena_alloc(p->arena, ncap * sizeof(word_t));
+                if (cap) memcpy(grown, n->loop_for.words, cap * sizeof(word_t));
+                n->loop_for.words = grown;
+                cap               = ncap;
+            }
+            n->loop_for.words[n->loop_for.nwords++] = make_word(p);
+            lex_next(p);
+        }
+        if (p->tok.kind != TOK_SEMI && p->tok.kind != TOK_NEWLINE) return parse_error(p);
+        lex_next(p);
+    } else if (p->tok.kind == TOK_SEMI) {
+        lex_next(p);
+    }
+    while (p->tok.kind == TOK_NEWLINE) lex_next(p);
+    if (!expect_word(p, "do") || (n->loop_for.body = parse_body(p)) == NULL ||
+        !expect_word(p, "done")) {
+        return NULL;
+    }
+    return n;
+}
+
+// compound := (if | while | for | '{' list '}' | '(' list ')' | NAME '(' ')' newline* compound)
+//             redirection*
+// The function form is recognised by the '(' right after its name.
+static node_t *parse_compound(parser_t *p) {
+    node_t *n = NULL;
+    p->depth++;
+    if (at_word(p, "if")) {
+        n = new_node(p, NODE_IF, p->tok.start);
+        if (parse_if(p, n) == NULL) return NULL;
+    }
+    else if (at_word(p, "while") || at_word(p, "until")) {
+        n = new_node(p, NODE_WHILE, p->tok.start);
+        if (parse_while(p, n) == NULL) return NULL;
+    }
+    else if (at_word(p, "for")) {
+        n = new_node(p, NODE_FOR, p->tok.start);
+        if (parse_for(p, n) == NULL) return NULL;
+    }
+    else if (at_word(p, "{")) {
+        n = new_node(p, NODE_GROUP, p->tok.start);
+        lex_next(p);
+        if ((n->bg.body = parse_body(p)) == NULL || !expect_word(p, "}")) return NULL;
+    }
+    else if (p->tok.kind == TOK_LPAREN) {
+        n = new_node(p, NODE_SUBSHELL, p->tok.start);
+        lex_next(p);
+        if ((n->bg.body = parse_body(p)) == NULL) return NULL;
+        if (p->tok.kind != TOK_RPAREN) return parse_error(p);
+        lex_next(p);
+    }
+    else {
+        n = new_node(p, NODE_FUNC, p->tok.start);
+        if (p->tok.flags != 0 || memchr(p->tok.start, '=', p->tok.len) != NULL) {
+            return parse_error(p);
+        }
+        n->func.name = arena_strndup(p->arena, p->tok.start, p->tok.len);
+        lex_next(p);
+        lex_next(p);   // '('
+        if (p->tok.kind != TOK_RPAREN) return parse_error(p);
+        lex_next(p);
+        while (p->tok.kind == TOK_NEWLINE) lex_next(p);
+        if (!at_word(p, "if") && !at_word(p, "while") && !at_word(p, "until") &&
+            !at_word(p, "for") && !at_word(p, "{") && p->tok.kind != TOK_LPAREN) {
+            return parse_error(p);
+        }
+        p->depth--;
+        n->func.body = parse_compound(p);
+        if (n->func.body == NULL) return NULL;
+        end_span(n, p->tok.start);
+        return n;
+    }
+    p->depth--;
+
+    int       nredirs = 0;
+    redir_t **tail    = &n->redirs;
+    while (p->tok.kind == TOK_IO_NUMBER || is_redir_op(p->tok.kind)) {
+        if (parse_redirect(p, &tail, &nredirs) < 0) return NULL;
+    }
+    end_span(n, p->tok.start);
+    return n;
+}
+
+// Is the lookahead the start of a compound command?
+static int at_compound(parser_t *p) {
+    if (p->tok.kind == TOK_LPAREN || at_word(p, "if") || at_word(p, "while") || at_word(p, "until") ||
+        at_word(p, "for") || at_word(p, "{")) {
+        return 1;
+    }
+    // "name()" or "name ()"
+    if (p->tok.kind != TOK_WORD) return 0;
+    size_t i = p->pos;
+    while (i < p->len && (p->src[i] == ' ' || p->src[i] == '\t')) i++;
+    return i < p->len && p->src[i] == '(';
+}
+
+// command := compound | (word | redirection)+
+static node_t *parse_command(parser_t *p) {
+    if (at_compound(p)) {
+        return parse_compound(p);
+    }
+    node_t   *n       = new_node(p, NODE_CMD, p->tok.start);
+    word_t   *words   = NULL;
+    int       nwords  = 0, cap = 0;
+    int       nredirs = 0;
+    redir_t **tail    = &n->cmd.redirs;
+
+    for (;;) {
+        if (p->tok.kind == TOK_WORD) {
+            if (nwords == cap) {
+                // grow in the arena; the old array is just left behind
+                int     ncap   = cap ? cap * 2 : 8;
+                word_t *grown  = arena_alloc(p->arena, ncap * sizeof(word_t));
+                if (nwords) memcpy(grown, words, nwords * sizeof(word_t));
+                words = grown;
+                cap   = ncap;
+            }
+            words[nwords++] = make_word(p);
+            lex_next(p);
+        }
+        else if (p->tok.kind == TOK_IO_NUMBER || is_redir_op(p->tok.kind)) {
+            if (parse_redirect(p, &tail, &nredirs) < 0) return NULL;
+        }
+        else {
+            break;
+        }
+    }
+    if (nwords == 0 && n->cmd.redirs == NULL) {
+        return parse_error(p);
+    }
+    n->cmd.words  = words;
+    n->cmd.nwords = nwords;
+    end_span(n, p->tok.start);
+    return n;
+}
+
+// pipeline := command ('|' newline* command)*
+static node_t *parse_pipeline(parser_t *p) {
+    const char *start = p->tok.start;
+    node_t *first = parse_command(p);
+    if (first == NULL) return NULL;
+    if (p->tok.kind != TOK_PIPE) return first;
+    if (first->kind >= NODE_IF) {
+        p->error = "a compound command cannot be part of a pipeline";
+        return NULL;
+    }
+
+    node_t *cmds[MAX_STAGES];
+    int     n = 0;
+    cmds[n++] = first;
+    while (p->tok.kind == TOK_PIPE) {
+        lex_next(p);
+        while (p->tok.kind == TOK_NEWLINE) lex_next(p);
+        if (n == MAX_STAGES) {
+            p->error = "too many commands in pipeline";
+            return NULL;
+        }
+        node_t *c = parse_command(p);
+        if (c == NULL) return NULL;
+        if (c->kind >= NODE_IF) {
+            p->error = "a compound command cannot be part of a pipeline";
+            return NULL;
+        }
+        cmds[n++] = c;
+    }
+    node_t *pn = new_node(p, NODE_PIPE, start);
+    pn->pipe.cmds  = arena_alloc(p->arena, n * sizeof(node_t *));
+    pn->pipe.ncmds = n;
+    memcpy(pn->pipe.cmds, cmds, n * sizeof(node_t *));
+    end_span(pn, p->tok.start);
+    return pn;
+}
+
+// and_or := pipeline (('&&' | '||') newline* pipeline)*
+static node_t *parse_and_or(parser_t *p) {
+    const char *start = p->tok.start;
+    node_t *left = parse_pipeline(p);
+    while (left != NULL && (p->tok.kind == TOK_AND_IF || p->tok.kind == TOK_OR_IF)) {
+        node_kind_t kind = (p->tok.kind == TOK_AND_IF) ? NODE_AND : NODE_OR;
+        lex_next(p);
+        while (p->tok.kind == TOK_NEWLINE) lex_next(p);
+        node_t *right = parse_pipeline(p);
+        if (right == NULL) return NULL;
+        node_t *n = new_node(p, kind, start);
+        n->bin.left  = left;
+        n->bin.right = right;
+        end_span(n, p->tok.start);
+        left = n;
+    }
+    return left;
+}
+
+// list := and_or ((';' | '&' | newline) and_or?)*
+// A trailing '&' wraps its and_or in a NODE_BG. I return NULL for an empty list.
+// Inside a compound command the list ends at the word that closes it ("then", "fi",
+// "done", "}", ")" ...), which the caller checks.
+static node_t *parse_list(parser_t *p) {
+    node_t *list = NULL;
+    for (;;) {
+        while (p->tok.kind == TOK_NEWLINE || p->tok.kind == TOK_SEMI) {
+            if (p->tok.kind == TOK_SEMI && list == NULL) return parse_error(p);
+            lex_next(p);
+        }
+        if (p->tok.kind == TOK_EOF || p->error != NULL) break;
+        if (at_closer(p)) {
+            if (p->depth == 0) return parse_error(p);
+            break;
+        }
+        if (p->tok.kind != TOK_WORD && p->tok.kind != TOK_IO_NUMBER && p->tok.kind != TOK_LPAREN &&
+            !is_redir_op(p->tok.kind)) {
+            return parse_error(p);
+        }
+
+        node_t *item = parse_and_or(p);
+        if (item == NULL) return NULL;
+        if (p->tok.kind == TOK_AMP) {
+            node_t *bg = new_node(p, NODE_BG, item->src);
+            bg->src_len = item->src_len;
+            bg->bg.body = item;
+            item = bg;
+            lex_next(p);
+        }
+        else if (p->tok.kind != TOK_SEMI && p->tok.kind != TOK_NEWLINE && p->tok.kind != TOK_EOF &&
+                 !at_closer(p)) {
+            return parse_error(p);
+        }
+
+        if (list == NULL) {
+            list = item;
+        } else {
+            node_t *seq = new_node(p, NODE_SEQ, list->src);
+            seq->bin.left  = list;
+            seq->bin.right = item;
+            list = seq;
+        }
+    }
+    return p->error ? NULL : list;
+}
+
+// parse_text: I parse src (which must live as long as the arena) into an AST.
+// *error is set on a syntax error; an empty line gives NULL with no error.
+// *heredocs lists the line's here-documents, whose bodies follow the line.
+// *incomplete (if not NULL) says the error is only that src ends inside a compound command.
+static node_t *parse_text(const char *src, size_t len, arena_t *arena, const char **error,
+                          redir_t **heredocs, int *incomplete) {
+    parser_t p;
+    memset(&p, 0, sizeof(p));
+    p.src     = src;
+    p.len     = len;
+    p.arena   = arena;
+    p.hd_tail = &p.heredocs;
+    lex_next(&p);
+    node_t *root = parse_list(&p);
+    if (p.error == NULL && p.nested_heredoc) {
+        p.error = "here-documents are not supported inside compound commands";
+    }
+    // a message built in p.msg goes with the AST's arena, since p dies here
+    *error    = (p.error == p.msg) ? arena_strndup(arena, p.msg, strlen(p.msg)) : p.error;
+    *heredocs = p.heredocs;
+    if (incomplete != NULL) *incomplete = p.incomplete;
+    return p.error ? NULL : root;
+}
+
+// Parse cache: a direct-mapped table from line text to its AST. Loops in a script and
+// "!!" replays hit the cache and skip lexing completely. An entry that is running right
+// now is busy and never evicted; a line that collides with a busy entry is parsed into
+// a one-off entry instead.
+#define AST_CACHE_SLOTS 1024
+
+typedef struct {
+    unsigned    hash;
+    char       *line;     // my own copy of the text, in arena
+    size_t      len;
+    node_t     *root;
+    redir_t    *heredocs;   // the line's here-documents, in order
+    arena_t     arena;
+    int         valid;
+    int         busy;
+    int         oneoff;   // malloc'd outside the table; freed by ast_release()
+} ast_entry_t;
+
+static ast_entry_t ast_cache[AST_CACHE_SLOTS];
+
+// While the line reader asks whether text is a complete command (ast_want_more), text
+// that ends inside a compound command is not an error to print: ast_acquire() fails
+// quietly with ast_incomplete set, and the reader adds the next line.
+static int ast_want_more  = 0;
+static int ast_incomplete = 0;
+
+static unsigned line_hash(const char *s, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+// I parse (line, len) into e, which must be empty. I return 0, or -1 after printing
+// the syntax error.
+static int ast_fill(ast_entry_t *e, unsigned h, const char *line, size_t len) {
+    const char *error;
+    int         incomplete;
+    e->hash  = h;
+    e->len   = len;
+    e->line  = arena_strndup(&e->arena, line, len);
+    e->root  = parse_text(e->line, len, &e->arena, &error, &e->heredocs, &incomplete);
+    ast_incomplete = 0;
+    if (error != NULL) {
+        if (incomplete && ast_want_more) ast_incomplete = 1;
+        else fprintf(stderr, "icsh: %s\n", error);
+        arena_free(&e->arena);
+        return -1;
+    }
+    e->valid = 1;
+    return 0;
+}
+
+// ast_acquire: I return the parsed AST for the line (from the cache if I can), marked
+// busy until ast_release(). NULL means a syntax error, already reported.
+static ast_entry_t *ast_acquire(const char *line, size_t len) {
+    unsigned     h = line_hash(line, len);
+    ast_entry_t *e = &ast_cache[h % AST_CACHE_SLOTS];
+
+    if (e->valid && e->hash == h && e->len == len && memcmp(e->line, line, len) == 0) {
+        e->busy++;
+        return e;
+    }
+    if (e->busy) {
+        e = calloc(1, sizeof(*e));
+        if (e == NULL) return NULL;
+        e->oneoff = 1;
+    } else if (e->valid) {
+        arena_free(&e->arena);
+        e->valid = 0;
+    }
+    if (ast_fill(e, h, line, len) < 0) {
+        if (e->oneoff) free(e);
+        return NULL;
+    }
+    e->busy++;
+    return e;
+}
+
+static void ast_release(ast_entry_t *e) {
+    e->busy--;
+    if (e->oneoff && e->busy == 0) {
+        arena_free(&e->arena);
+        free(e);
+    }
+}
+
+// Here-document bodies of the line being run, copied back to back into heredoc_text
+// by read_heredocs(). A REDIR_HEREDOC finds its body by its index in the line.
+typedef struct {
+    size_t off;
+    size_t len;
+} heredoc_body_t;
+
+static char           *heredoc_text    = NULL;
+static size_t          heredoc_len     = 0;
+static size_t          heredoc_cap     = 0;
+static heredoc_body_t *heredoc_bodies  = NULL;
+static int             heredoc_nbodies = 0;
+static int             heredoc_nalloc  = 0;
+
+static void heredoc_append(const char *s, size_t n) {
+    if (heredoc_len + n > heredoc_cap) {
+        size_t cap = heredoc_cap ? heredoc_cap : 4096;
+        while (cap < heredoc_len + n) cap *= 2;
+        char *grown = realloc(heredoc_text, cap);
+        if (grown == NULL) return;
+        heredoc_text = grown;
+        heredoc_cap  = cap;
+    }
+    memcpy(heredoc_text + heredoc_len, s, n);
+    heredoc_len += n;
+}
+
+// I close the body that started at off in heredoc_text.
+static void heredoc_end_body(size_t off) {
+    if (heredoc_nbodies == heredoc_nalloc) {
+        int             n     = heredoc_nalloc ? heredoc_nalloc * 2 : 4;
+        heredoc_body_t *grown = realloc(heredoc_bodies, n * sizeof(heredoc_body_t));
+        if (grown == NULL) return;
+        heredoc_bodies = grown;
+        heredoc_nalloc = n;
+    }
+    heredoc_bodies[heredoc_nbodies].off = off;
+    heredoc_bodies[heredoc_nbodies].len = heredoc_len - off;
+    heredoc_nbodies++;
+}
+
+// The expansion engine writes into a buffer in the scratch arena that doubles when
+// it runs out; the outgrown copies stay behind in the arena until the command ends.
+// With glob set, whatever exp_put writes is quoted text, so glob characters in it get
+// a backslash; the caller writes unquoted characters with exp_raw. With split set, the
+// output of an unquoted command substitution is cut into fields at blanks and
+// newlines: a '\0' goes between two fields, so they can be used in place later.
+typedef struct {
+    char    *buf;
+    size_t   len;
+    size_t   cap;
+    arena_t *arena;
+    int      glob;
+    int      split;
+} expbuf_t;
+
+static void exp_raw(expbuf_t *b, const char *s, size_t n) {
+    if (b->len + n + 1 > b->cap) {
+        size_t cap = b->cap * 2;
+        while (cap < b->len + n + 1) cap *= 2;
+        char *grown = arena_alloc(b->arena, cap);
+        memcpy(grown, b->buf, b->len);
+        b->buf = grown;
+        b->cap = cap;
+    }
+    memcpy(b->buf + b->len, s, n);
+    b->len += n;
+}
+
+static void exp_put(expbuf_t *b, const char *s, size_t n) {
+    if (!b->glob) {
+        exp_raw(b, s, n);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\') exp_raw(b, "\\", 1);
+        exp_raw(b, s + i, 1);
+    }
+}
+
+// exp_dollar: s[i] is a '$'. I append what it expands to and return the index of its
+// last character: "$?", "$$", "$NAME" and "${NAME}" (unset is empty), and the
+// positional "$0".."$9", "${N}", "$#", "$@" and "$*". A '$' that starts none of those
+// is just a '$'.
+static void exp_positional(expbuf_t *b, long k) {
+    const char *v = (k == 0) ? pos_zero : (k <= pos_count) ? pos_args[k - 1] : "";
+    exp_put(b, v, strlen(v));
+}
+
+static size_t exp_dollar(expbuf_t *b, const char *s, size_t len, size_t i) {
+    char num[24];
+    char c = (i + 1 < len) ? s[i + 1] : '\0';
+    if (c == '?' || c == '$' || c == '#') {
+        int v = (c == '?') ? last_status : (c == '$') ? (int)shell_pid : pos_count;
+        int n = snprintf(num, sizeof(num), "%d", v);
+        exp_put(b, num, n);
+        return i + 1;
+    }
+    if (c >= '0' && c <= '9') {
+        exp_positional(b, c - '0');
+        return i + 1;
+    }
+    if (c == '@' || c == '*') {
+        // inside a larger word both are the arguments joined by spaces
+        for (int k = 0; k < pos_count; k++) {
+            if (k > 0) exp_put(b, " ", 1);
+            exp_put(b, pos_args[k], strlen(pos_args[k]));
+        }
+        return i + 1;
+    }
+    size_t start = i + 1, end;
+    int    braced = (start < len && s[start] == '{');
+    if (braced) {
+        start++;
+        const char *close = memchr(s + start, '}', len - start);
+        end = close ? (size_t)(close - s) : start;
+        size_t digits = start;
+        while (digits < end && s[digits] >= '0' && s[digits] <= '9') digits++;
+        if (close != NULL && digits == end && end > start) {
+            exp_positional(b, strtol(s + start, NULL, 10));   // "${10}"
+            return end;
+        }
+        if (close == NULL || !valid_var_name(s + start, end - start)) {
+            exp_put(b, "$", 1);
+            return i;
+        }
+    } else {
+        end = start;
+        while (end < len && name_char(s[end], end == start)) end++;
+        if (end == start) {
+            exp_put(b, "$", 1);
+            return i;
+        }
+    }
+    var_t *v = var_find(s + start, end - start);
+    if (v != NULL) {
+        const char *val = v->kv + v->name_len + 1;
+        exp_put(b, val, strlen(val));
+    }
+    return braced ? end : end - 1;
+}
+
+static size_t subst_end(const char *s, size_t len, size_t i);
+static size_t backq_end(const char *s, size_t len, size_t i);
+static char  *cmd_subst(const char *text, size_t len, arena_t *scratch, size_t *outlen);
+
+// exp_fields: unquoted substitution output in a word that gets split. A run of
+// blanks and newlines ends the field being built, if it has anything in it.
+static void exp_fields(expbuf_t *b, const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == ' ' || s[i] == '\t' || s[i] == '\n') {
+            if (b->len > 0 && b->buf[b->len - 1] != '\0') exp_raw(b, "", 1);
+        } else {
+            exp_raw(b, s + i, 1);
+        }
+    }
+}
+
+// exp_subst: s[i] starts "$(" or '`'. I run the command, append its output and return
+// the index of the substitution's last character. Inside backquotes "\\", "\`" and
+// "\$" (and "\"" within double quotes) lose their backslash before the text is run.
+static size_t exp_subst(expbuf_t *b, const char *s, size_t len, size_t i, int dq) {
+    const char *text;
+    size_t      tlen, end;
+    if (s[i] == '$') {
+        end  = subst_end(s, len, i + 2);
+        text = s + i + 2;
+        tlen = end - i - 2;
+    } else {
+        end = backq_end(s, len, i + 1);
+        char *u = arena_alloc(b->arena, end - i);
+        tlen    = 0;
+        for (size_t k = i + 1; k < end; k++) {
+            char next = (k + 1 < end) ? s[k + 1] : '\0';
+            if (s[k] == '\\' && (next == '\\' || next == '`' || next == '$' || (dq && next == '"'))) k++;
+            u[tlen++] = s[k];
+        }
+        text = u;
+    }
+    size_t n;
+    char  *out = cmd_subst(text, tlen, b->arena, &n);
+    if (b->split && !dq) exp_fields(b, out, n);
+    else                 exp_put(b, out, n);
+    return end;
+}
+
+// expand_into: the expansion engine behind expand_text() and expand_split().
+static void expand_into(expbuf_t *b, const char *s, size_t len, int quotes) {
+    int dq = 0;   // inside double quotes
+
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        if (c == '\'' && quotes && !dq) {
+            const char *end = memchr(s + i + 1, '\'', len - i - 1);
+            exp_put(b, s + i + 1, end - (s + i + 1));
+            i = end - s;
+        }
+        else if (c == '"' && quotes) {
+            dq = !dq;
+        }
+        else if (c == '\\' && i + 1 < len) {
+            char next = s[i + 1];
+            int  drop = quotes ? (!dq || next == '"' || next == '\\' || next == '$' || next == '`')
+                               : (next == '\\' || next == '$' || next == '`');
+            exp_put(b, drop ? &next : &c, 1);
+            if (drop) i++;
+        }
+        else if (c == '`' || (c == '$' && i + 1 < len && s[i + 1] == '(')) {
+            i = exp_subst(b, s, len, i, dq || !quotes);
+        }
+        else if (c == '$') {
+            i = exp_dollar(b, s, len, i);
+        }
+        else if (quotes && !dq) {
+            exp_raw(b, &c, 1);
+        }
+        else {
+            exp_put(b, &c, 1);
+        }
+    }
+    b->buf[b->len] = '\0';
+}
+
+// expand_text: I copy (s, len) into the scratch arena with every "$..." and command
+// substitution expanded. With quotes set (a word) I also remove quotes: nothing
+// expands inside '...', and "..." changes nothing else, because I do not split here:
+// the result is one word. Without quotes (a here-document body) quote characters
+// stay, and only "\$", "\`" and "\\" lose their backslash. quotes == 2 makes a glob
+// pattern: as for a word, but quoted text and expansions come out backslash-escaped,
+// so only the glob characters written plainly in the word stay special.
+static char *expand_text(const char *s, size_t len, int quotes, arena_t *scratch, size_t *outlen) {
+    expbuf_t b = { NULL, 0, len + 16, scratch, quotes == 2, 0 };
+    b.buf = arena_alloc(scratch, b.cap);
+    expand_into(&b, s, len, quotes);
+    if (outlen != NULL) *outlen = b.len;
+    return b.buf;
+}
+
+// expand_word: quote removal plus "$" expansion. Words that need neither are used as
+// they are. The result lives in the scratch arena of the command being run.
+static char *expand_word(const word_t *w, arena_t *scratch) {
+    if ((w->flags & (WORD_QUOTED | WORD_DOLLAR)) == 0) {
+        return (char *)w->text;
+    }
+    return expand_text(w->text, w->len, 1, scratch, NULL);
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Globbing: compiled patterns over a cache of sorted directory listings
+// ────────────────────────────────────────────────────────────────────────────
+
+// A growable array of strings in a scratch arena. Outgrown copies stay behind in the
+// arena, as for expbuf_t; doubling keeps them to less than the final size.
+typedef struct {
+    char   **v;
+    size_t   n;
+    size_t   cap;
+    arena_t *arena;
+} strvec_t;
+
+static void sv_init(strvec_t *sv, size_t cap, arena_t *arena) {
+    sv->n     = 0;
+    sv->cap   = cap ? cap : 8;
+    sv->arena = arena;
+    sv->v     = arena_alloc(arena, (sv->cap + 1) * sizeof(char *));
+    sv->v[0]  = NULL;
+}
+
+static void sv_push(strvec_t *sv, char *s) {
+    if (sv->n == sv->cap) {
+        char **grown = arena_alloc(sv->arena, (sv->cap * 2 + 1) * sizeof(char *));
+        memcpy(grown, sv->v, sv->n * sizeof(char *));
+        sv->v    = grown;
+        sv->cap *= 2;
+    }
+    sv->v[sv->n++] = s;
+    sv->v[sv->n]   = NULL;
+}
+
+// I keep the listing of every directory I glob in, sorted, so the next glob there
+// needs one stat() instead of a readdir() pass. An entry is keyed on the directory's
+// device and inode (so it survives a change of directory) and is good while its
+// mtime is unchanged. A listing read less than DCACHE_RACY_NS after the directory
+// last changed is not trusted: a file created in the same clock tick would not move
+// the mtime. ICSH_GLOB_CACHE=0 turns the cache off, for the benchmark.
+#define DCACHE_BUCKETS 64
+#define DCACHE_MAX     64
+#define DCACHE_RACY_NS 50000000LL
+
+typedef struct dcache {
+    dev_t          dev;
+    ino_t          ino;
+    long long      mtime_ns;
+    long long      read_ns;
+    char         **names;    // sorted
+    unsigned char *types;    // d_type of names[i]
+    unsigned char *exec;     // Tab completion: 1 if names[i] can run, 2 if not, 0 unknown
+    size_t         n;
+    char          *blob;     // the names, each after its d_type byte
+    unsigned long  used;     // last use, for eviction
+    struct dcache *next;
+} dcache_t;
+
+static dcache_t     *dcache[DCACHE_BUCKETS];
+static int           dcache_count;
+static unsigned long dcache_clock;
+
+static void dcache_free(dcache_t *d) {
+    free(d->names);
+    free(d->types);
+    free(d->exec);
+    free(d->blob);
+    free(d);
+}
+
+static void dcache_unlink(dcache_t *d) {
+    dcache_t **pp = &dcache[(d->ino ^ d->dev) % DCACHE_BUCKETS];
+    while (*pp != d) pp = &(*pp)->next;
+    *pp = d->next;
+    dcache_count--;
+}
+
+static void dcache_evict_lru(void) {
+    dcache_t *old = NULL;
+    for (int b = 0; b < DCACHE_BUCKETS; b++) {
+        for (dcache_t *d = dcache[b]; d != NULL; d = d->next) {
+            if (old == NULL || d->used < old->used) old = d;
+        }
+    }
+    if (old != NULL) {
+        dcache_unlink(old);
+        dcache_free(old);
+    }
+}
+
+static int dcache_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// dcache_read: one readdir() pass over path into a fresh entry, or NULL. The blob
+// holds each name as its d_type byte followed by the '\0'-terminated name.
+static dcache_t *dcache_read(const char *path, const struct stat *sb) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    DIR *dir = opendir(path);
+    if (dir == NULL) return NULL;
+
+    size_t *offs = NULL, n = 0, ncap = 0;
+    size_t  blen = 0, bcap = 4096;
+    char   *blob = malloc(bcap);
+    int     ok   = (blob != NULL);
+    struct dirent *de;
+    while (ok && (de = readdir(dir)) != NULL) {
+        const char *nm = de->d_name;
+        if (nm[0] == '.' && (nm[1] == '\0' || (nm[1] == '.' && nm[2] == '\0'))) continue;
+        size_t l = strlen(nm) + 2;
+        if (blen + l > bcap) {
+            while (blen + l > bcap) bcap *= 2;
+            char *grown = realloc(blob, bcap);
+            if (grown == NULL) { ok = 0; break; }
+            blob = grown;
+        }
+        if (n == ncap) {
+            ncap = ncap ? ncap * 2 : 256;
+            size_t *grown = realloc(offs, ncap * sizeof(size_t));
+            if (grown == NULL) { ok = 0; break; }
+            offs = grown;
+        }
+        blob[blen] = de->d_type;
+        memcpy(blob + blen + 1, nm, l - 1);
+        offs[n++] = blen + 1;
+        blen += l;
+    }
+    closedir(dir);
+
+    dcache_t *d = ok ? calloc(1, sizeof(*d)) : NULL;
+    if (d != NULL) {
+        d->names = malloc((n + 1) * sizeof(char *));
+        d->types = malloc(n + 1);
+    }
+    if (d == NULL || d->names == NULL || d->types == NULL) {
+        if (d != NULL) dcache_free(d);
+        free(blob);
+        free(offs);
+        return NULL;
+    }
+    // the blob moves while it grows, so names become pointers only now
+    for (size_t i = 0; i < n; i++) d->names[i] = blob + offs[i];
+    free(offs);
+    qsort(d->names, n, sizeof(char *), dcache_cmp);
+    for (size_t i = 0; i < n; i++) d->types[i] = d->names[i][-1];
+
+    d->dev      = sb->st_dev;
+    d->ino      = sb->st_ino;
+    d->mtime_ns = sb->st_mtim.tv_sec * 1000000000LL + sb->st_mtim.tv_nsec;
+    d->read_ns  = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    d->blob     = blob;
+    d->n        = n;
+    return d;
+}
+
+// dcache_get: the sorted listing of path ("" is the current directory), or NULL if
+// it is not a directory I can read. The entry stays valid until the next call.
+static dcache_t *dcache_get(const char *path) {
+    static dcache_t *uncached;
+    struct stat      sb;
+    if (*path == '\0') path = ".";
+    if (stat(path, &sb) < 0 || !S_ISDIR(sb.st_mode)) return NULL;
+
+    const char *off = var_get("ICSH_GLOB_CACHE");
+    if (off != NULL && strcmp(off, "0") == 0) {
+        if (uncached != NULL) dcache_free(uncached);
+        uncached = dcache_read(path, &sb);
+        return uncached;
+    }
+
+    long long  mtime = sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+    dcache_t **head  = &dcache[(sb.st_ino ^ sb.st_dev) % DCACHE_BUCKETS];
+    for (dcache_t *d = *head; d != NULL; d = d->next) {
+        if (d->ino != sb.st_ino || d->dev != sb.st_dev) continue;
+        if (d->mtime_ns == mtime && mtime + DCACHE_RACY_NS < d->read_ns) {
+            d->used = ++dcache_clock;
+            return d;
+        }
+        dcache_unlink(d);
+        dcache_free(d);
+        break;
+    }
+
+    dcache_t *d = dcache_read(path, &sb);
+    if (d == NULL) return NULL;
+    if (dcache_count >= DCACHE_MAX) dcache_evict_lru();
+    d->used = ++dcache_clock;
+    d->next = *head;
+    *head   = d;
+    dcache_count++;
+    return d;
+}
+
+// A pattern component compiles to a list of ops: a literal byte, '?', '*', or a
+// bracket expression as a 256-bit set.
+enum { GOP_CHAR, GOP_ANY, GOP_STAR, GOP_SET };
+
+typedef struct {
+    unsigned char kind;
+    unsigned char c;
+    unsigned     *set;   // GOP_SET: 8 words of 32 bits
+} gop_t;
+
+typedef struct {
+    gop_t *ops;
+    int    nops;
+    int    minlen;   // every op but '*' eats one byte
+    int    dot;      // the pattern starts with a literal '.', so it may match dotfiles
+    char  *prefix;   // the literal bytes before the first other op
+    char  *suffix;   // the literal bytes after the last '*'
+    size_t plen, slen;
+} gpat_t;
+
+// glob_compile: one component (no '/'), with backslash escapes, into pt.
+static void glob_compile(gpat_t *pt, const char *s, size_t len, arena_t *scratch) {
+    pt->ops    = arena_alloc(scratch, (len + 1) * sizeof(gop_t));
+    pt->nops   = 0;
+    pt->minlen = 0;
+    for (size_t i = 0; i < len; i++) {
+        gop_t *op = &pt->ops[pt->nops];
+        op->kind  = GOP_CHAR;
+        if (s[i] == '*') {
+            // "**" is the same as "*"
+            if (pt->nops > 0 && op[-1].kind == GOP_STAR) continue;
+            op->kind = GOP_STAR;
+        }
+        else if (s[i] == '?') {
+            op->kind = GOP_ANY;
+        }
+        else if (s[i] == '[') {
+            // find the closing ']' first: without one, '[' is just a character
+            size_t j   = i + 1;
+            int    neg = (j < len && (s[j] == '!' || s[j] == '^'));
+            if (neg) j++;
+            size_t first = j;
+            while (j < len && (s[j] != ']' || j == first)) j += (s[j] == '\\' && j + 1 < len) ? 2 : 1;
+            if (j >= len) {
+                op->c = '[';
+            } else {
+                op->kind = GOP_SET;
+                op->set  = arena_alloc(scratch, 8 * sizeof(unsigned));
+                memset(op->set, 0, 8 * sizeof(unsigned));
+                for (size_t k = first; k < j; k++) {
+                    unsigned char lo = s[k];
+                    if (lo == '\\' && k + 1 < j) lo = s[++k];
+                    unsigned char hi = lo;
+                    if (k + 2 < j && s[k + 1] == '-') {
+                        k += 2;
+                        hi = s[k];
+                        if (hi == '\\' && k + 1 < j) hi = s[++k];
+                    }
+                    for (unsigned c = lo; c <= hi; c++) op->set[c >> 5] |= 1u << (c & 31);
+                }
+                if (neg) for (int w = 0; w < 8; w++) op->set[w] = ~op->set[w];
+                i = j;
+            }
+        }
+        else {
+            if (s[i] == '\\' && i + 1 < len) i++;
+            op->c = s[i];
+        }
+        if (op->kind != GOP_STAR) pt->minlen++;
+        pt->nops++;
+    }
+    pt->dot = (pt->nops > 0 && pt->ops[0].kind == GOP_CHAR && pt->ops[0].c == '.');
+
+    // Literal ends let me skip most names without running the matcher: the listing
+    // is sorted, so the names with a given prefix are one binary search away, and a
+    // suffix is one memcmp() against the end of the name.
+    int p = 0, q = pt->nops, star = 0;
+    while (p < pt->nops && pt->ops[p].kind == GOP_CHAR) p++;
+    for (int k = 0; k < pt->nops; k++) star |= (pt->ops[k].kind == GOP_STAR);
+    while (star && q > p && pt->ops[q - 1].kind == GOP_CHAR) q--;
+    pt->plen   = p;
+    pt->slen   = star ? (size_t)(pt->nops - q) : 0;
+    pt->prefix = arena_alloc(scratch, pt->plen + pt->slen + 2);
+    pt->suffix = pt->prefix + pt->plen + 1;
+    for (int k = 0; k < p; k++) pt->prefix[k] = pt->ops[k].c;
+    for (int k = q; k < pt->nops && star; k++) pt->suffix[k - q] = pt->ops[k].c;
+    pt->prefix[pt->plen] = '\0';
+    pt->suffix[pt->slen] = '\0';
+}
+
+// glob_match: does name match pt? One '*' at a time is remembered for backtracking,
+// which is enough: a later '*' can only ever need to restart from its own position.
+static int glob_match(const gpat_t *pt, const char *name) {
+    if (name[0] == '.' && !pt->dot) return 0;
+    const gop_t *p = pt->ops, *end = pt->ops + pt->nops, *star = NULL;
+    const char  *s = name, *retry = NULL;
+    while (*s) {
+        if (p < end && p->kind == GOP_STAR) {
+            star  = ++p;
+            retry = s;
+            continue;
+        }
+        if (p < end) {
+            unsigned char c  = *s;
+            int           ok = (p->kind == GOP_ANY) ||
+                               (p->kind == GOP_CHAR && p->c == c) ||
+                               (p->kind == GOP_SET && (p->set[c >> 5] >> (c & 31) & 1));
+            if (ok) {
+                p++;
+                s++;
+                continue;
+            }
+        }
+        if (star == NULL) return 0;
+        p = star;
+        s = ++retry;
+    }
+    while (p < end && p->kind == GOP_STAR) p++;
+    return p == end;
+}
+
+// glob_has_meta: does the component (s, len) have a glob character not escaped?
+static int glob_has_meta(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\\') i++;
+        else if (s[i] == '*' || s[i] == '?' || s[i] == '[') return 1;
+    }
+    return 0;
+}
+
+static char *glob_join(const char *dir, const char *name, size_t nlen, arena_t *scratch) {
+    size_t dlen = strlen(dir);
+    int    sep  = (dlen > 0 && dir[dlen - 1] != '/');
+    char  *path = arena_alloc(scratch, dlen + sep + nlen + 1);
+    memcpy(path, dir, dlen);
+    if (sep) path[dlen] = '/';
+    memcpy(path + dlen + sep, name, nlen);
+    path[dlen + sep + nlen] = '\0';
+    return path;
+}
+
+static int glob_is_dir(const char *dir, const char *name, unsigned char type, arena_t *scratch) {
+    if (type == DT_DIR) return 1;
+    if (type != DT_UNKNOWN && type != DT_LNK) return 0;
+    struct stat sb;
+    return stat(glob_join(dir, name, strlen(name), scratch), &sb) == 0 && S_ISDIR(sb.st_mode);
+}
+
+static int glob_path_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// glob_expand: I add every path matching pattern to out, sorted, and return how many
+// there were. The pattern is split at '/'. A component without glob characters is
+// appended as it is; one with them is matched against the cached listing of every
+// directory reached so far. Paths are built in the scratch arena.
+static size_t glob_expand(const char *pattern, strvec_t *out, arena_t *scratch) {
+    strvec_t cur, next;
+    sv_init(&cur, 1, scratch);
+    sv_push(&cur, *pattern == '/' ? "/" : "");
+    while (*pattern == '/') pattern++;
+
+    // a literal directory in the middle needs no check: listing it fails if it is
+    // not one. Only a literal last component is checked, with lstat() at the end.
+    int listed = 0, check = 0;
+    while (cur.n > 0) {
+        const char *slash = strchr(pattern, '/');
+        size_t      clen  = slash ? (size_t)(slash - pattern) : strlen(pattern);
+        int         last  = (slash == NULL);
+
+        if (!glob_has_meta(pattern, clen)) {
+            // unescape and append; whether it exists is checked at the end
+            char  *lit = arena_alloc(scratch, clen + 1);
+            size_t n   = 0;
+            for (size_t i = 0; i < clen; i++) {
+                if (pattern[i] == '\\' && i + 1 < clen) i++;
+                lit[n++] = pattern[i];
+            }
+            for (size_t k = 0; k < cur.n; k++) cur.v[k] = glob_join(cur.v[k], lit, n, scratch);
+            check = 1;
+        } else {
+            gpat_t pt;
+            glob_compile(&pt, pattern, clen, scratch);
+            sv_init(&next, 0, scratch);
+            for (size_t k = 0; k < cur.n; k++) {
+                dcache_t *d = dcache_get(cur.v[k]);
+                if (d == NULL) continue;
+                listed++;
+                // the first name not below the prefix
+                size_t lo = 0, hi = d->n;
+                while (lo < hi) {
+                    size_t mid = (lo + hi) / 2;
+                    if (strncmp(d->names[mid], pt.prefix, pt.plen) < 0) lo = mid + 1; else hi = mid;
+                }
+                for (size_t i = lo; i < d->n; i++) {
+                    const char *nm = d->names[i];
+                    if (strncmp(nm, pt.prefix, pt.plen) != 0) break;
+                    size_t l = strlen(nm);
+                    if (l < (size_t)pt.minlen) continue;
+                    if (memcmp(nm + l - pt.slen, pt.suffix, pt.slen) != 0) continue;
+                    if (!glob_match(&pt, nm)) continue;
+                    if (!last && !glob_is_dir(cur.v[k], nm, d->types[i], scratch)) continue;
+                    sv_push(&next, glob_join(cur.v[k], nm, strlen(nm), scratch));
+                }
+            }
+            cur   = next;
+            check = 0;
+        }
+        if (last) break;
+        pattern = slash + 1;
+    }
+
+    size_t before = out->n;
+    for (size_t k = 0; k < cur.n; k++) {
+        struct stat sb;
+        if (check && lstat(cur.v[k], &sb) < 0) continue;
+        sv_push(out, cur.v[k]);
+    }
+    // one listing comes out sorted already; paths from several, or with more
+    // components after the listed one, need a sort
+    if (listed > 1 || check) {
+        qsort(out->v + before, out->n - before, sizeof(char *), glob_path_cmp);
+    }
+    return out->n - before;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Executor: running an AST
+// ────────────────────────────────────────────────────────────────────────────
+
+// An assignment word is NAME= followed by anything, with the name written plainly.
+static int is_assignment(const word_t *w) {
+    const char *eq = memchr(w->text, '=', w->len);
+    return eq != NULL && valid_var_name(w->text, eq - w->text);
+}
+
+// stage_envp: env_vec with a command's own "NAME=value" words on top, for
+// "NAME=value cmd". Only such commands pay for a copy, in the scratch arena.
+static char **stage_envp(char **assigns, int n, arena_t *scratch) {
+    char **envp = arena_alloc(scratch, (env_count + n + 1) * sizeof(char *));
+    int    m    = env_count;
+    memcpy(envp, env_vec, env_count * sizeof(char *));
+    for (int i = 0; i < n; i++) {
+        size_t nlen = strchr(assigns[i], '=') - assigns[i] + 1;
+        int    k    = 0;
+        while (k < m && strncmp(envp[k], assigns[i], nlen) != 0) k++;
+        envp[k] = assigns[i];
+        if (k == m) m++;
+    }
+    envp[m] = NULL;
+    return envp;
+}
+
+// expand_split: a word with an unquoted command substitution can become any number of
+// words. The whole word is expanded once, with '\0' between fields, and each field is
+// pushed where it lies, so nothing is copied twice however many fields there are.
+// Empty fields are dropped; a word with quotes in it that comes out empty stays as "".
+static void expand_split(const word_t *w, strvec_t *out, arena_t *scratch) {
+    expbuf_t b = { NULL, 0, w->len + 16, scratch, 0, 1 };
+    b.buf = arena_alloc(scratch, b.cap);
+    expand_into(&b, w->text, w->len, 1);
+
+    size_t before = out->n;
+    for (size_t i = 0; i < b.len; ) {
+        size_t n = strlen(b.buf + i);
+        if (n > 0) sv_push(out, b.buf + i);
+        i += n + 1;
+    }
+    if (out->n == before && (w->flags & WORD_QUOTED)) sv_push(out, "");
+}
+
+// expand_words: I expand n words onto out. Everything goes into the scratch arena of
+// the command being run, so there is no size limit. A word with unquoted glob
+// characters becomes the sorted paths it matches, "$@" (bare or in double quotes)
+// becomes one word per positional parameter, and the output of an unquoted command
+// substitution is split into words.
+static void expand_words(const word_t *words, int n, strvec_t *out, arena_t *scratch) {
+    for (int i = 0; i < n; i++) {
+        const word_t *w = &words[i];
+        if ((w->len == 2 && memcmp(w->text, "$@", 2) == 0) ||
+            (w->len == 4 && memcmp(w->text, "\"$@\"", 4) == 0)) {
+            for (int k = 0; k < pos_count; k++) sv_push(out, pos_args[k]);
+            continue;
+        }
+        if (w->flags & WORD_GLOB) {
+            char *pattern = expand_text(w->text, w->len, 2, scratch, NULL);
+            if (glob_expand(pattern, out, scratch) > 0) continue;
+            // no match: the word stays as it is written. I take the escapes back out
+            // of the pattern rather than expand again, which would run a command
+            // substitution in the word twice.
+            char *d = pattern;
+            for (const char *c = pattern; *c; c++) {
+                if (*c == '\\' && c[1] != '\0') c++;
+                *d++ = *c;
+            }
+            *d = '\0';
+            sv_push(out, pattern);
+            continue;
+        }
+        if (w->flags & WORD_SPLIT) {
+            expand_split(w, out, scratch);
+            continue;
+        }
+        char *arg = expand_word(w, scratch);
+        // an unquoted expansion that comes out empty is no word at all, as in sh
+        if (*arg == '\0' && (w->flags & WORD_DOLLAR) && !(w->flags & WORD_QUOTED)) continue;
+        sv_push(out, arg);
+    }
+}
+
+// build_redirs: I turn a list of parsed redirections into specs for redir_plan().
+// I return -1 (after saying why) if a redirection makes no sense.
+static int build_redirs(redir_t *list, redir_spec_t **out, int *nout, arena_t *scratch) {
+    int n = 0;
+    for (redir_t *r = list; r != NULL; r = r->next) n++;
+    *out  = arena_alloc(scratch, (n + 1) * sizeof(redir_spec_t));
+    *nout = n;
+
+    redir_spec_t *rs = *out;
+    for (redir_t *r = list; r != NULL; r = r->next, rs++) {
+        memset(rs, 0, sizeof(*rs));
+        rs->fd = r->fd;
+        if (r->kind == REDIR_HEREDOC) {
+            // the delimiter is not expanded; the body was read after the line, and
+            // unless the delimiter was quoted, "$..." in it is expanded
+            rs->kind = RS_DATA;
+            if (r->heredoc < heredoc_nbodies) {
+                rs->data = heredoc_text + heredoc_bodies[r->heredoc].off;
+                rs->len  = heredoc_bodies[r->heredoc].len;
+                if (!(r->target.flags & WORD_QUOTED) &&
+                    (memchr(rs->data, '$', rs->len) || memchr(rs->data, '`', rs->len) ||
+                     memchr(rs->data, '\\', rs->len))) {
+                    rs->data = expand_text(rs->data, rs->len, 0, scratch, &rs->len);
+                }
+            }
+            continue;
+        }
+
+        char *target = expand_word(&r->target, scratch);
+        switch (r->kind) {
+            case REDIR_IN:     rs->kind = RS_READ;   rs->path = target; break;
+            case REDIR_OUT:    rs->kind = RS_WRITE;  rs->path = target; break;
+            case REDIR_APPEND: rs->kind = RS_APPEND; rs->path = target; break;
+            case REDIR_HERESTR: {
+                // a here-string is the word plus a newline
+                size_t n  = strlen(target);
+                char  *d  = arena_alloc(scratch, n + 1);
+                memcpy(d, target, n);
+                d[n]      = '\n';
+                rs->kind  = RS_DATA;
+                rs->data  = d;
+                rs->len   = n + 1;
+                break;
+            }
+            default: {
+                // <&M and >&M: M is an fd number, or "-" to close
+                char *end;
+                long  src = strtol(target, &end, 10);
+                if (strcmp(target, "-") == 0) {
+                    rs->kind = RS_CLOSE;
+                } else if (*target != '\0' && *end == '\0' && src >= 0 && src < 10000) {
+                    rs->kind = RS_DUP;
+                    rs->src  = (int)src;
+                } else {
+                    fprintf(stderr, "icsh: %s: bad file descriptor\n", target);
+                    return -1;
+                }
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+// build_stage: I expand one NODE_CMD into argv plus its redirections.
+// I return -1 (after saying why) if a redirection makes no sense.
+static int build_stage(node_t *c, stage_t *st, arena_t *scratch) {
+    int i = 0;
+
+    // "NAME=value" words in front of the command are assignments
+    st->assigns  = arena_alloc(scratch, (c->cmd.nwords + 1) * sizeof(char *));
+    st->nassigns = 0;
+    st->envp     = NULL;
+    for (; i < c->cmd.nwords && is_assignment(&c->cmd.words[i]); i++) {
+        st->assigns[st->nassigns++] = expand_word(&c->cmd.words[i], scratch);
+    }
+
+    // a glob can turn one word into any number, so argv grows as it needs to
+    strvec_t argv;
+    sv_init(&argv, c->cmd.nwords - i, scratch);
+    expand_words(c->cmd.words + i, c->cmd.nwords - i, &argv, scratch);
+    st->argv = argv.v;
+
+    return build_redirs(c->cmd.redirs, &st->redirs, &st->nredirs, scratch);
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Control flow: functions, and break/continue/return
+// ────────────────────────────────────────────────────────────────────────────
+
+// break, continue and return unwind through exec_node(): every list and compound
+// command stops running commands while one is pending. pending_break and
+// pending_continue count the loop levels still to leave; each loop takes one.
+static int loop_depth       = 0;
+static int func_depth       = 0;
+static int pending_break    = 0;
+static int pending_continue = 0;
+static int pending_return   = 0;
+static int run_aborted      = 0;   // Ctrl-C inside a loop: drop the rest of the line
+
+static int unwinding(void) {
+    return pending_break || pending_continue || pending_return || run_aborted;
+}
+
+// builtin_break: "break [n]" and "continue [n]".
+static void builtin_break(const char *cmd, const char *arg) {
+    int n = arg ? atoi(arg) : 1;
+    if (n < 1) {
+        fprintf(stderr, "icsh: %s: %s: loop count out of range\n", cmd, arg);
+        last_status = 1;
+        return;
+    }
+    last_status = 0;
+    if (loop_depth == 0) {
+        fprintf(stderr, "icsh: %s: only meaningful in a loop\n", cmd);
+        return;
+    }
+    if (n > loop_depth) n = loop_depth;
+    if (cmd[0] == 'b') pending_break = n;
+    else               pending_continue = n;
+}
+
+// builtin_return: "return [n]"; without n the status is that of the last command.
+static void builtin_return(const char *arg) {
+    if (func_depth == 0) {
+        fprintf(stderr, "icsh: return: can only return from a function\n");
+        last_status = 1;
+        return;
+    }
+    if (arg != NULL) last_status = atoi(arg) & 0xFF;
+    pending_return = 1;
+}
+
+// Shell functions live in a small chained hash table. A body is a piece of the AST of
+// the command that defined it, so a definition holds that parse-cache entry busy
+// (never evicted) for as long as it exists. running_entry is the entry whose AST is
+// running right now, which is the one a definition has to hold.
+#define FUNC_BUCKETS   64
+#define FUNC_MAX_DEPTH 1000
+
+typedef struct func {
+    char        *name;
+    node_t      *body;
+    ast_entry_t *entry;
+    struct func *next;
+} func_t;
+
+static func_t      *func_table[FUNC_BUCKETS];
+static int          func_count    = 0;
+static ast_entry_t *running_entry = NULL;
+
+static func_t *func_find(const char *name) {
+    if (func_count == 0) return NULL;   // the common case costs nothing per command
+    for (func_t *f = func_table[line_hash(name, strlen(name)) % FUNC_BUCKETS]; f; f = f->next) {
+        if (strcmp(f->name, name) == 0) return f;
+    }
+    return NULL;
+}
+
+static void func_define(const char *name, node_t *body) {
+    func_t *f = func_find(name);
+    if (f == NULL) {
+        f = calloc(1, sizeof(*f));
+        if (f == NULL || (f->name = strdup(name)) == NULL) {
+            free(f);
+            fprintf(stderr, "icsh: %s: out of memory\n", name);
+            last_status = 1;
+            return;
+        }
+        unsigned b    = line_hash(name, strlen(name)) % FUNC_BUCKETS;
+        f->next       = func_table[b];
+        func_table[b] = f;
+        func_count++;
+    } else {
+        ast_release(f->entry);
+    }
+    f->body  = body;
+    f->entry = running_entry;
+    f->entry->busy++;
+    last_status = 0;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Built-ins: a registry of commands that run inside the shell
+// ────────────────────────────────────────────────────────────────────────────
+
+// bi_in and bi_out are the fds a running built-in reads from and writes to. Built-ins
+// print into out_buf (see out_printf()), which run_builtin() hands to bi_out.
+static int bi_in  = STDIN_FILENO;
+static int bi_out = STDOUT_FILENO;
+
+static void bi_echo(char **argv) {
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (i > 1) out_put(" ", 1);
+        out_put(argv[i], strlen(argv[i]));
+    }
+    out_put("\n", 1);
+    last_status = 0;
+}
+
+static void bi_exit(char **argv) {
+    int code = argv[1] ? atoi(argv[1]) & 0xFF : 0;
+    if (in_subshell) {
+        // only the copy of me running "( ... )" or "$(...)" ends, quietly
+        tty_sync();
+        trace_drain();
+        _exit(code);
+    }
+    out_put("bye\n", 4);
+    out_flush(bi_out);
+    exit(code);
+}
+
+static void bi_true(char **argv) {
+    (void)argv;
+    last_status = 0;
+}
+
+static void bi_false(char **argv) {
+    (void)argv;
+    last_status = 1;
+}
+
+static void bi_pwd(char **argv) {
+    (void)argv;
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        fprintf(stderr, "icsh: pwd: %s\n", strerror(errno));
+        last_status = 1;
+        return;
+    }
+    out_printf("%s\n", cwd);
+    free(cwd);
+    last_status = 0;
+}
+
+// "cd [dir]": no dir is $HOME, and "-" is $OLDPWD (printed, as in sh). PWD and OLDPWD
+// follow along.
+static void bi_cd(char **argv) {
+    const char *dir   = argv[1];
+    int         print = 0;
+    if (dir == NULL || strcmp(dir, "-") == 0) {
+        const char *name = dir ? "OLDPWD" : "HOME";
+        print = (dir != NULL);
+        dir   = var_get(name);
+        if (dir == NULL) {
+            fprintf(stderr, "icsh: cd: %s not set\n", name);
+            last_status = 1;
+            return;
+        }
+    }
+    // var_get() points into the variable store, which the var_set()s below may change
+    char *old = getcwd(NULL, 0);
+    if (chdir(dir) < 0) {
+        fprintf(stderr, "icsh: cd: %s: %s\n", dir, strerror(errno));
+        free(old);
+        last_status = 1;
+        return;
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (old != NULL) var_set("OLDPWD", 6, old, strlen(old));
+    if (cwd != NULL) {
+        var_set("PWD", 3, cwd, strlen(cwd));
+        if (print) out_printf("%s\n", cwd);
+    }
+    free(old);
+    free(cwd);
+    last_status = 0;
+}
+
+// test / [: a recursive-descent evaluator over argv.
+//   or      := and ('-o' and)*
+//   and     := not ('-a' not)*
+//   not     := '!' not | primary
+//   primary := '(' or ')' | unary-op word | word binary-op word | word
+// A binary operator in the middle wins over everything else, so "! = x" compares.
+// Errors make the status 2.
+typedef struct {
+    char **argv;
+    int    argc;
+    int    pos;
+    int    error;
+} test_t;
+
+static int test_or(test_t *t);
+
+static int test_binop(const char *s) {
+    static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le",
+                                 "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+    for (int i = 0; ops[i]; i++) if (strcmp(s, ops[i]) == 0) return 1;
+    return 0;
+}
+
+static int test_unop(const char *s) {
+    return s[0] == '-' && s[1] != '\0' && s[2] == '\0' && strchr("bcdefghknprsStuwxzLO", s[1]);
+}
+
+static long long test_int(test_t *t, const char *s) {
+    char     *end;
+    long long v = strtoll(s, &end, 10);
+    while (*end == ' ' || *end == '\t') end++;
+    if (*s == '\0' || *end != '\0') {
+        fprintf(stderr, "icsh: test: %s: integer expression expected\n", s);
+        t->error = 1;
+    }
+    return v;
+}
+
+static int test_unary(test_t *t, char op, const char *arg) {
+    struct stat sb;
+    if (op == 'n') return arg[0] != '\0';
+    if (op == 'z') return arg[0] == '\0';
+    if (op == 't') return isatty((int)test_int(t, arg));
+    if (op == 'h' || op == 'L') return lstat(arg, &sb) == 0 && S_ISLNK(sb.st_mode);
+    if (op == 'r') return access(arg, R_OK) == 0;
+    if (op == 'w') return access(arg, W_OK) == 0;
+    if (op == 'x') return access(arg, X_OK) == 0;
+    if (stat(arg, &sb) < 0) return 0;
+    switch (op) {
+        case 'e': return 1;
+        case 'f': return S_ISREG(sb.st_mode);
+        case 'd': return S_ISDIR(sb.st_mode);
+        case 'b': return S_ISBLK(sb.st_mode);
+        case 'c': return S_ISCHR(sb.st_mode);
+        case 'p': return S_ISFIFO(sb.st_mode);
+        case 'S': return S_ISSOCK(sb.st_mode);
+        case 's': return sb.st_size > 0;
+        case 'g': return (sb.st_mode & S_ISGID) != 0;
+        case 'u': return (sb.st_mode & S_ISUID) != 0;
+        case 'k': return (sb.st_mode & S_ISVTX) != 0;
+        case 'O': return sb.st_uid == geteuid();
+        default:  return 0;
+    }
+}
+
+static int test_binary(test_t *t, const char *a, const char *op, const char *b) {
+    if (op[0] != '-') {
+        int c = strcmp(a, b);
+        if (op[0] == '=') return c == 0;
+        if (op[0] == '!') return c != 0;
+        return op[0] == '<' ? c < 0 : c > 0;
+    }
+    if (op[1] == 'n' || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f')) {
+        // -nt, -ot, -ef on files
+        struct stat sa, sb;
+        int ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+        if (op[1] == 'e') return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        if (op[2] == 't' && op[1] == 'n' && strcmp(op, "-ne") != 0) {
+            return ha && (!hb || sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ||
+                          (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec));
+        }
+        if (op[1] == 'o') {
+            return hb && (!ha || sa.st_mtim.tv_sec < sb.st_mtim.tv_sec ||
+                          (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec < sb.st_mtim.tv_nsec));
+        }
+    }
+    long long x = test_int(t, a), y = test_int(t, b);
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;
+}
+
+static int test_primary(test_t *t) {
+    if (t->pos >= t->argc) {
+        fprintf(stderr, "icsh: test: argument expected\n");
+        t->error = 1;
+        return 0;
+    }
+    char **a = t->argv + t->pos;
+    int    left = t->argc - t->pos;
+    if (left >= 3 && test_binop(a[1])) {
+        t->pos += 3;
+        return test_binary(t, a[0], a[1], a[2]);
+    }
+    if (left >= 2 && test_unop(a[0])) {
+        t->pos += 2;
+        return test_unary(t, a[0][1], a[1]);
+    }
+    if (strcmp(a[0], "(") == 0 && left >= 2) {
+        t->pos++;
+        int v = test_or(t);
+        if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")") != 0) {
+            fprintf(stderr, "icsh: test: ')' expected\n");
+            t->error = 1;
+            return 0;
+        }
+        t->pos++;
+        return v;
+    }
+    t->pos++;
+    return a[0][0] != '\0';
+}
+
+static int test_not(test_t *t) {
+    int left = t->argc - t->pos;
+    if (left >= 2 && strcmp(t->argv[t->pos], "!") == 0 &&
+        !(left >= 3 && test_binop(t->argv[t->pos + 1]))) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static int test_and(test_t *t) {
+    int v = test_not(t);
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-a") == 0) {
+        t->pos++;
+        v = test_not(t) && v;
+    }
+    return v;
+}
+
+static int test_or(test_t *t) {
+    int v = test_and(t);
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-o") == 0) {
+        t->pos++;
+        v = test_and(t) || v;
+    }
+    return v;
+}
+
+static void bi_test(char **argv) {
+    test_t t = { argv + 1, 0, 0, 0 };
+    while (t.argv[t.argc] != NULL) t.argc++;
+    if (argv[0][0] == '[') {
+        if (t.argc == 0 || strcmp(t.argv[t.argc - 1], "]") != 0) {
+            fprintf(stderr, "icsh: [: missing ']'\n");
+            last_status = 2;
+            return;
+        }
+        t.argc--;
+    }
+    if (t.argc == 0) {
+        last_status = 1;
+        return;
+    }
+    int v = test_or(&t);
+    if (!t.error && t.pos < t.argc) {
+        fprintf(stderr, "icsh: test: %s: unexpected argument\n", t.argv[t.pos]);
+        t.error = 1;
+    }
+    last_status = t.error ? 2 : !v;
+}
+
+// printf_escape: the backslash escape at s (just past the '\'); I append what it
+// stands for and return how many characters it used. In %b arguments "\0NNN" is
+// octal too, and "\c" (*stop set) ends all output.
+static int printf_escape(const char *s, int in_b, int *stop) {
+    static const char from[] = "\\abfnrtv\"'";
+    static const char to[]   = "\\\a\b\f\n\r\t\v\"'";
+    const char *k = *s ? strchr(from, *s) : NULL;
+    if (k != NULL) {
+        out_put(&to[k - from], 1);
+        return 1;
+    }
+    if (*s == 'c' && in_b) {
+        *stop = 1;
+        return 1;
+    }
+    if (*s >= '0' && *s <= '7') {
+        int n = 0, v = 0, max = (in_b && *s == '0') ? 4 : 3;
+        while (n < max && s[n] >= '0' && s[n] <= '7') v = v * 8 + (s[n++] - '0');
+        char c = (char)v;
+        out_put(&c, 1);
+        return n;
+    }
+    out_put("\\", 1);
+    return 0;
+}
+
+static long long printf_int(const char *s) {
+    if (s[0] == '\'' || s[0] == '"') return (unsigned char)s[1];   // 'a is the code of a
+    char     *end;
+    long long v = strtoll(s, &end, 0);
+    if (*s == '\0' || *end != '\0') {
+        fprintf(stderr, "icsh: printf: %s: invalid number\n", s);
+        last_status = 1;
+    }
+    return v;
+}
+
+// printf_once: one pass over the format, taking arguments from *args as it goes.
+// I return 1 if "\c" stopped the output.
+static int printf_once(const char *f, char ***args) {
+    int stop = 0;
+    while (*f && !stop) {
+        if (*f == '\\') {
+            f += 1 + printf_escape(f + 1, 0, &stop);
+            continue;
+        }
+        if (*f != '%') {
+            const char *next = f + strcspn(f, "\\%");
+            out_put(f, next - f);
+            f = next;
+            continue;
+        }
+        if (f[1] == '%') {
+            out_put("%", 1);
+            f += 2;
+            continue;
+        }
+        // rebuild the conversion for snprintf: flags, width, precision, then the type.
+        // The type takes up to 4 more bytes ("lld" and the NUL), so everything before
+        // it must fit in room; a longer conversion is an error.
+        char        spec[64];
+        const int   room     = sizeof(spec) - 4;
+        int         n        = 0;
+        int         too_long = 0;
+        const char *start    = f;
+        spec[n++] = *f++;
+        for (; *f && strchr("-+ #0", *f); f++) {
+            if (n < room) spec[n++] = *f; else too_long = 1;
+        }
+        for (int part = 0; part < 2; part++) {
+            if (part == 1) {
+                if (*f != '.') break;
+                if (n < room) spec[n++] = *f; else too_long = 1;
+                f++;
+            }
+            if (*f == '*') {
+                int w = snprintf(spec + n, room - n, "%d",
+                                 (int)(**args ? printf_int(*(*args)++) : 0));
+                if (w >= room - n) too_long = 1; else n += w;
+                f++;
+            } else {
+                for (; *f >= '0' && *f <= '9'; f++) {
+                    if (n < room) spec[n++] = *f; else too_long = 1;
+                }
+            }
+        }
+        if (too_long) {
+            fprintf(stderr, "icsh: printf: %.*s: conversion too long\n", (int)(f - start + (*f != '\0')),
+                    start);
+            last_status = 1;
+            return 1;
+        }
+        char        conv = *f ? *f++ : 's';
+        const char *arg  = **args ? *(*args)++ : NULL;
+        switch (conv) {
+            case 'd': case 'i':
+                strcpy(spec + n, "lld");
+                out_printf(spec, arg ? printf_int(arg) : 0LL);
+                break;
+            case 'o': case 'u': case 'x': case 'X':
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conv;
+                spec[n]   = '\0';
+                out_printf(spec, (unsigned long long)(arg ? printf_int(arg) : 0));
+                break;
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+                spec[n++] = conv;
+                spec[n]   = '\0';
+                out_printf(spec, arg ? strtod(arg, NULL) : 0.0);
+                break;
+            case 'c':
+                if (arg != NULL && *arg) out_put(arg, 1);
+                break;
+            case 'b': {
+                // the argument's escapes are expanded, then it is printed like %s
+                size_t start = out_len;
+                for (const char *a = arg ? arg : ""; *a && !stop; ) {
+                    if (*a == '\\') a += 1 + printf_escape(a + 1, 1, &stop);
+                    else out_put(a++, 1);
+                }
+                size_t len = out_len - start;
+                char  *tmp = malloc(len + 1);
+                if (tmp == NULL) break;
+                memcpy(tmp, out_buf + start, len);
+                tmp[len] = '\0';
+                out_len  = start;
+                strcpy(spec + n, "s");
+                out_printf(spec, tmp);
+                free(tmp);
+                break;
+            }
+            default:
+                strcpy(spec + n, "s");
+                out_printf(spec, arg ? arg : "");
+                break;
+        }
+    }
+    return stop;
+}
+
+// "printf format [args]": the format is used again while arguments are left, as in sh.
+static void bi_printf(char **argv) {
+    if (argv[1] == NULL) {
+        fprintf(stderr, "icsh: printf: usage: printf format [arguments]\n");
+        last_status = 2;
+        return;
+    }
+    char **args = argv + 2;
+    last_status = 0;
+    for (;;) {
+        char **before = args;
+        if (printf_once(argv[1], &args) || *args == NULL || args == before) break;
+    }
+}
+
+// "read [-r] [name...]": one line from bi_in, split at blanks; the last name gets the
+// rest of the line, and with no names it all goes to REPLY. Without -r a backslash
+// quotes the next character and a backslash-newline joins lines. If bi_in is my own
+// stdin, lines my reader buffered come first (input_take()). A regular file is read a
+// block at a time and the offset put back after the line; anything else (a pipe, a
+// terminal) a byte at a time, so nothing past the line is taken from it.
+static int input_is(int fd, const struct stat *st);
+static int input_take(char *c);
+
+static char  *rd_buf = NULL;   // the line, and for each byte whether it was quoted
+static char  *rd_esc = NULL;
+static size_t rd_cap = 0;
+
+static int rd_push(size_t *len, char c, char esc) {
+    if (*len + 1 >= rd_cap) {
+        size_t cap = rd_cap ? rd_cap * 2 : 256;
+        char  *b   = realloc(rd_buf, cap);
+        char  *e   = b ? realloc(rd_esc, cap) : NULL;
+        if (b) rd_buf = b;
+        if (e == NULL) return -1;
+        rd_esc = e;
+        rd_cap = cap;
+    }
+    rd_buf[*len] = c;
+    rd_esc[*len] = esc;
+    (*len)++;
+    return 0;
+}
+
+static void bi_read(char **argv) {
+    int raw = 0, i = 1;
+    if (argv[i] != NULL && strcmp(argv[i], "-r") == 0) {
+        raw = 1;
+        i++;
+    }
+    char **names = argv + i;
+    for (char **n = names; *n != NULL; n++) {
+        if (!valid_var_name(*n, strlen(*n))) {
+            fprintf(stderr, "icsh: read: '%s': not a valid identifier\n", *n);
+            last_status = 2;
+            return;
+        }
+    }
+
+    struct stat sb;
+    int    known    = (fstat(bi_in, &sb) == 0);
+    int    seekable = (known && S_ISREG(sb.st_mode));
+    int    buffered = (known && input_is(bi_in, &sb));
+    if (!seekable) tty_sync();   // this may block, and a question printed before it must show
+    char   chunk[4096];
+    size_t have = 0, used = 0, len = 0;
+    int    got_nl = 0, quote_next = 0;
+    for (;;) {
+        char c;
+        if (buffered && input_take(&c)) {
+            // already read by my line reader
+        } else {
+            if (used == have) {
+                ssize_t r = read(bi_in, chunk, seekable ? sizeof(chunk) : 1);
+                if (r < 0 && errno == EINTR) continue;
+                if (r <= 0) break;
+                have = r;
+                used = 0;
+            }
+            c = chunk[used++];
+        }
+        if (quote_next) {
+            quote_next = 0;
+            if (c != '\n' && rd_push(&len, c, 1) < 0) break;
+            continue;
+        }
+        if (c == '\n') {
+            got_nl = 1;
+            break;
+        }
+        if (c == '\\' && !raw) {
+            quote_next = 1;
+            continue;
+        }
+        if (rd_push(&len, c, 0) < 0) break;
+    }
+    if (seekable && used < have) lseek(bi_in, -(off_t)(have - used), SEEK_CUR);
+    rd_push(&len, '\0', 0);
+    len--;
+
+    if (names[0] == NULL) {
+        var_set("REPLY", 5, rd_buf, len);
+    } else {
+        size_t p = 0;
+        for (char **n = names; *n != NULL; n++) {
+            while (p < len && !rd_esc[p] && (rd_buf[p] == ' ' || rd_buf[p] == '\t')) p++;
+            size_t start = p, end;
+            if (n[1] != NULL) {
+                while (p < len && (rd_esc[p] || (rd_buf[p] != ' ' && rd_buf[p] != '\t'))) p++;
+                end = p;
+            } else {
+                // the last name takes the rest, less trailing blanks
+                end = len;
+                while (end > start && !rd_esc[end - 1] &&
+                       (rd_buf[end - 1] == ' ' || rd_buf[end - 1] == '\t')) end--;
+            }
+            var_set(*n, strlen(*n), rd_buf + start, end - start);
+        }
+    }
+    last_status = got_nl ? 0 : 1;
+}
+
+static void bi_jobs(char **argv)    { builtin_jobs(argv + 1); last_status = 0; }
+static void bi_fg(char **argv)      { builtin_fg(argv[1]); }
+static void bi_bg(char **argv)      { builtin_bg(argv[1]); }
+static void bi_hash(char **argv)    { builtin_hash(argv + 1); }
+static void bi_wait(char **argv)    { builtin_wait(argv[1]); }
+static void bi_history(char **argv) { builtin_history(argv + 1); }
+static void bi_coproc(char **argv)  { builtin_coproc(argv + 1); }
+static void bi_export(char **argv)  { builtin_export(argv + 1); }
+static void bi_unset(char **argv)   { builtin_unset(argv + 1); }
+static void bi_break(char **argv)   { builtin_break(argv[0], argv[1]); }
+static void bi_ulimit(char **argv)  { builtin_ulimit(argv + 1); }
+static void bi_renice(char **argv)  { builtin_renice(argv + 1); }
+static void bi_kill(char **argv)    { builtin_kill(argv + 1); }
+static void bi_return(char **argv)  { builtin_return(argv[1]); }
+static void bi_at(char **argv)      { builtin_at(argv); }
+static void bi_joblog(char **argv)  { builtin_joblog(argv + 1); }
+
+// The registry. BI_STDIO built-ins print through stdio, or block while jobs print,
+// so their redirections are applied to my own fds around them. BI_SHELL built-ins
+// change the shell itself; "icsh -j" runs those in the shell rather than in a worker.
+#define BI_STDIO 1
+#define BI_SHELL 2
+
+typedef struct builtin {
+    const char *name;
+    void      (*run)(char **argv);
+    int         flags;
+} builtin_t;
+
+static const builtin_t builtins[] = {
+    { "echo",     bi_echo,    0 },
+    { "exit",     bi_exit,    BI_SHELL },
+    { "true",     bi_true,    0 },
+    { ":",        bi_true,    0 },
+    { "false",    bi_false,   0 },
+    { "test",     bi_test,    0 },
+    { "[",        bi_test,    0 },
+    { "printf",   bi_printf,  0 },
+    { "read",     bi_read,    BI_SHELL },
+    { "cd",       bi_cd,      BI_SHELL },
+    { "pwd",      bi_pwd,     0 },
+    { "jobs",     bi_jobs,    0 },
+    { "fg",       bi_fg,      BI_STDIO | BI_SHELL },
+    { "bg",       bi_bg,      BI_SHELL },
+    { "hash",     bi_hash,    BI_SHELL },
+    { "wait",     bi_wait,    BI_STDIO },
+    { "history",  bi_history, 0 },
+    { "coproc",   bi_coproc,  BI_STDIO | BI_SHELL },
+    { "export",   bi_export,  BI_SHELL },
+    { "unset",    bi_unset,   BI_SHELL },
+    { "break",    bi_break,   0 },
+    { "continue", bi_break,   0 },
+    { "return",   bi_return,  0 },
+    { "ulimit",   bi_ulimit,  BI_SHELL },
+    { "renice",   bi_renice,  0 },
+    { "kill",     bi_kill,    0 },
+    { "at",       bi_at,      BI_SHELL },
+    { "every",    bi_at,      BI_SHELL },
+    { "joblog",   bi_joblog,  BI_STDIO | BI_SHELL },
+};
+
+#define NBUILTINS     (int)(sizeof(builtins) / sizeof(builtins[0]))
+#define BUILTIN_SLOTS 64   // open addressing, a power of two well above NBUILTINS
+
+// builtin_find: every command name goes through here, so it is one hash and (almost
+// always) one strcmp(). The table is filled on first use.
+static const builtin_t *builtin_find(const char *name) {
+    static signed char slots[BUILTIN_SLOTS];
+    static int         ready = 0;
+    if (!ready) {
+        memset(slots, -1, sizeof(slots));
+        for (int i = 0; i < NBUILTINS; i++) {
+            unsigned h = line_hash(builtins[i].name, strlen(builtins[i].name));
+            while (slots[h % BUILTIN_SLOTS] >= 0) h++;
+            slots[h % BUILTIN_SLOTS] = i;
+        }
+        ready = 1;
+    }
+    for (unsigned h = line_hash(name, strlen(name)); slots[h % BUILTIN_SLOTS] >= 0; h++) {
+        const builtin_t *b = &builtins[slots[h % BUILTIN_SLOTS]];
+        if (strcmp(b->name, name) == 0) return b;
+    }
+    return NULL;
+}
+
+// run_builtin: if st is a built-in I run it here in the shell and return 1; otherwise I
+// return 0. Redirections go through the same plan as for launched commands. When they
+// only concern stdin and stdout (nearly always), I touch none of my fds: the built-in
+// reads from redir_target_of(0) and its buffered output goes to redir_target_of(1)
+// in one piece. Otherwise, and for BI_STDIO built-ins, I apply the plan to my own fds
+// and restore them afterwards.
+static int run_builtin(stage_t *st) {
+    const builtin_t *b = builtin_find(st->argv[0]);
+    if (b == NULL) {
+        return 0;
+    }
+
+    redir_plan_t plan;
+    if (redir_plan(&plan, st->redirs, st->nredirs, -1, -1) < 0) {
+        last_status = 1;
+        return 1;
+    }
+    int direct = !(b->flags & BI_STDIO);
+    for (int i = 0; i < st->nredirs && direct; i++) {
+        direct = (st->redirs[i].fd == STDIN_FILENO || st->redirs[i].fd == STDOUT_FILENO);
+    }
+
+    fd_save_t saves[MAX_PLAN_STEPS];
+    int       nsaves = 0;
+    if (direct) {
+        bi_in  = redir_target_of(&plan, STDIN_FILENO);
+        bi_out = redir_target_of(&plan, STDOUT_FILENO);
+    } else if (plan.nsteps > 0) {
+        nsaves = redir_apply(&plan, saves);
+    }
+
+    long long t0 = trace_now();
+    b->run(st->argv);
+    trace_event(TR_BUILTIN, t0, 0, b->name, strlen(b->name));
+    if (out_flush(bi_out) < 0 && last_status == 0) {
+        last_status = 1;   // e.g. "echo hi >&-"
+    }
+
+    if (!direct && plan.nsteps > 0) redir_restore(saves, nsaves);
+    redir_done(&plan);
+    bi_in  = STDIN_FILENO;
+    bi_out = STDOUT_FILENO;
+    return 1;
+}
+
+// report_time: the "time" prefix's report on stderr. usage holds the children of the
+// foreground job; I add what I spent myself since before, so built-ins count too.
+static void report_time(long long t0, const struct rusage *before, struct rusage *usage) {
+    struct rusage self;
+    getrusage(RUSAGE_SELF, &self);
+    timersub(&self.ru_utime, &before->ru_utime, &self.ru_utime);
+    timersub(&self.ru_stime, &before->ru_stime, &self.ru_stime);
+    self.ru_maxrss  = 0;   // my own peak says nothing about this command
+    self.ru_nvcsw  -= before->ru_nvcsw;
+    self.ru_nivcsw -= before->ru_nivcsw;
+    usage_add(usage, &self);
+
+    char line[160];
+    format_usage(line, sizeof(line), now_ns() - t0, usage);
+    tty_sync();
+    fprintf(stderr, "%s\n", line);
+}
+
+static void call_function(func_t *f, stage_t *st, arena_t *scratch);
+
+// subst_out is the write end of a command substitution's pipe, for the next pipeline
+// I launch; subst_status is the status of the last substitution run while expanding
+// the current command (see cmd_subst()).
+static int subst_out    = -1;
+static int subst_status = -1;
+
+// stage_prepend_dup: "fd>&src" in front of st's own redirections, which can still
+// send fd somewhere else.
+static void stage_prepend_dup(stage_t *st, int fd, int src, arena_t *scratch) {
+    redir_spec_t *rs = arena_alloc(scratch, (st->nredirs + 1) * sizeof(*rs));
+    memset(rs, 0, sizeof(*rs));
+    rs->kind = RS_DUP;
+    rs->fd   = fd;
+    rs->src  = src;
+    memcpy(rs + 1, st->redirs, st->nredirs * sizeof(*rs));
+    st->redirs = rs;
+    st->nredirs++;
+}
+
+// exec_pipeline: a NODE_CMD or NODE_PIPE. A lone function or built-in runs in the
+// shell; anything else becomes a pipeline of processes (one stage for a plain external command).
+// A leading "time" word times the whole pipeline; in the background it is ignored,
+// since jobs -l shows what a background job cost. A leading "timeout ..." (after
+// "time", if both) gives the launched job a deadline; see timeout_prefix().
+static void exec_pipeline(node_t *n, int background, arena_t *scratch) {
+    stage_t stages[MAX_STAGES];
+    int     count   = 0;
+    int     capture = subst_out;   // taken before expanding, which may nest another
+    func_t *f;
+    subst_out    = -1;
+    subst_status = -1;
+    if (n->kind == NODE_CMD) {
+        if (build_stage(n, &stages[count++], scratch) < 0) {
+            last_status = 1;
+            return;
+        }
+    } else {
+        for (int i = 0; i < n->pipe.ncmds; i++) {
+            if (build_stage(n->pipe.cmds[i], &stages[count++], scratch) < 0) {
+                last_status = 1;
+                return;
+            }
+        }
+    }
+
+    int           timed = 0;
+    long long     t0    = 0;
+    struct rusage before, usage;
+    if (stages[0].argv[0] != NULL && strcmp(stages[0].argv[0], "time") == 0) {
+        stages[0].argv++;
+        timed = !background;
+        t0    = now_ns();
+        memset(&usage, 0, sizeof(usage));
+        getrusage(RUSAGE_SELF, &before);
+    }
+    long long after = 0, grace = 0;
+    int       sig   = SIGTERM;
+    if (stages[0].argv[0] != NULL && strcmp(stages[0].argv[0], "timeout") == 0 &&
+        timeout_prefix(&stages[0].argv, &after, &grace, &sig) < 0) {
+        last_status = 125;
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (stages[i].nassigns > 0 && stages[i].argv[0] != NULL) {
+            stages[i].envp = stage_envp(stages[i].assigns, stages[i].nassigns, scratch);
+        }
+    }
+    if (capture >= 0) {
+        // a command substitution's pipe is the last stage's stdout, ahead of the
+        // stage's own redirections, so "$(cmd 2>&1)" and "$(cmd >file)" still work
+        stage_prepend_dup(&stages[count - 1], STDOUT_FILENO, capture, scratch);
+    }
+
+    if (count == 1 && stages[0].argv[0] == NULL) {
+        // only assignments and redirections: the assignments set shell variables
+        // (an exported one reaches env_vec right away)
+        if (!background) {
+            for (int i = 0; i < stages[0].nassigns; i++) var_assign(stages[0].assigns[i]);
+        }
+        // the status is that of the last command substitution, if there was one
+        if (stages[0].nassigns > 0) last_status = (subst_status >= 0) ? subst_status : 0;
+    }
+    else if (count == 1 && (f = func_find(stages[0].argv[0])) != NULL) {
+        call_function(f, &stages[0], scratch);
+    }
+    else if (count == 1 && run_builtin(&stages[0])) {
+        // done in the shell
+    }
+    else {
+        // a background job's output goes to its log if ICSH_JOBLOG is on: stderr of
+        // every stage and stdout of the last, again ahead of their own redirections
+        int log_fd = -1;
+        launch_log = background ? joblog_open(&log_fd) : NULL;
+        if (launch_log != NULL) {
+            for (int i = 0; i < count; i++) {
+                stage_prepend_dup(&stages[i], STDERR_FILENO, log_fd, scratch);
+            }
+            stage_prepend_dup(&stages[count - 1], STDOUT_FILENO, log_fd, scratch);
+        }
+        launch_timeout.after = after;
+        launch_timeout.grace = grace;
+        launch_timeout.sig   = sig;
+        run_pipeline(stages, count, background, n->src, n->src_len, timed ? &usage : NULL,
+                     scratch);
+        launch_timeout.after = 0;
+        if (log_fd >= 0) close(log_fd);
+        joblog_release(launch_log);   // the job holds it now, if there is one
+        launch_log = NULL;
+    }
+    if (timed) {
+        report_time(t0, &before, &usage);
+    }
+}
+
+static void exec_node(node_t *n, arena_t *scratch);
+
+// subshell_body: what a forked copy of me runs for n. A "( list )" without
+// redirections of its own needs no second fork inside the copy.
+static node_t *subshell_body(node_t *n) {
+    return (n->kind == NODE_SUBSHELL && n->redirs == NULL) ? n->bg.body : n;
+}
+
+// run_background_list: "a && b &" cannot be a single pipeline, so I fork a copy of
+// myself to run the list and track that child as the job.
+static void run_background_list(node_t *n, arena_t *scratch) {
+    int       log_fd = -1;
+    joblog_t *log    = joblog_open(&log_fd);
+    tty_sync();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("failed to fork");
+        if (log_fd >= 0) close(log_fd);
+        joblog_release(log);
+        last_status = 1;
+        return;
+    }
+    if (pid == 0) {
+        join_pgid(0, job_control ? 0 : -1);
+        if (log_fd >= 0) {
+            dup2(log_fd, STDOUT_FILENO);
+            dup2(log_fd, STDERR_FILENO);
+            close(log_fd);
+        }
+        // the copy never owns the terminal and has no jobs of its own to report
+        job_control = 0;
+        in_subshell = 1;
+        deadlines_forget();
+        joblogs_forget();
+        trace_forget();
+        exec_node(subshell_body(n->bg.body), scratch);
+        tty_sync();
+        trace_drain();
+        _exit(last_status);
+    }
+    join_pgid(pid, job_control ? pid : -1);
+
+    job_t j;
+    memset(&j, 0, sizeof(j));
+    j.pgid     = job_control ? pid : 0;
+    j.start_ns = now_ns();
+    j.pids[0]  = pid;
+    j.npids    = 1;
+    j.nlive    = 1;
+    j.last_pid = pid;
+    j.cmdline  = strndup(n->src, n->src_len);
+    j.log      = log;
+    if (log_fd >= 0) close(log_fd);
+    add_job(&j);
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Command substitution and subshells
+// ────────────────────────────────────────────────────────────────────────────
+
+// fork_subshell: I fork a copy of myself to run body (src is the text jobs shows),
+// with its stdout on out_fd unless that is -1, and wait for it in the foreground.
+// With job control the copy gets its own process group and the terminal, so Ctrl-C
+// and Ctrl-Z reach everything it runs. If it stops, it becomes a stopped job.
+static void fork_subshell(const char *src, size_t src_len, node_t *body, int out_fd,
+                          arena_t *scratch) {
+    tty_sync();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("failed to fork");
+        last_status = 1;
+        return;
+    }
+    if (pid == 0) {
+        join_pgid(0, job_control ? 0 : -1);
+        if (job_control) tcsetpgrp(tty_fd, getpid());   // SIGTTOU is still ignored
+        if (out_fd >= 0) dup2(out_fd, STDOUT_FILENO);
+        // as for a background list, the copy has no terminal or jobs to manage
+        job_control = 0;
+        in_subshell = 1;
+        out_capture = NULL;
+        subst_fd    = -1;
+        deadlines_forget();
+        joblogs_forget();
+        trace_forget();
+        exec_node(body, scratch);
+        tty_sync();
+        trace_drain();
+        _exit(last_status);
+    }
+    join_pgid(pid, job_control ? pid : -1);
+
+    job_t j;
+    memset(&j, 0, sizeof(j));
+    j.pgid     = job_control ? pid : 0;
+    j.start_ns = now_ns();
+    j.pids[0]  = pid;
+    j.npids    = 1;
+    j.nlive    = 1;
+    j.last_pid = pid;
+    give_terminal_to(j.pgid);
+    int stopped = wait_for_job(&j);
+    take_terminal_back(&j, stopped);
+    if (stopped) {
+        j.cmdline = strndup(src, src_len);
+        add_stopped_job(&j);
+    }
+}
+
+// "$(...)" and "`...`" run in the cheapest of three ways that keeps me unchanged:
+//  - a list of built-ins that only print (echo, printf, test, pwd ...) runs right
+//    here, and run_builtin() hands its output to out_capture: no fork, no pipe;
+//  - a single pipeline of external commands is launched as usual, with a pipe as its
+//    last stage's stdout (subst_out), which I drain while I wait for it;
+//  - anything else (cd, assignments, loops, functions ...) could change my state, so
+//    a forked copy of me runs it with its stdout on the pipe.
+// The output grows in a tty_queue_t either way; nothing goes through a file.
+
+// subst_in_shell: is n a list of built-ins that can run in the shell? Their
+// redirections may only move stdin and stdout, which run_builtin() does without
+// touching my fds.
+static int subst_in_shell(const node_t *n) {
+    if (n->kind == NODE_AND || n->kind == NODE_OR || n->kind == NODE_SEQ) {
+        return subst_in_shell(n->bin.left) && subst_in_shell(n->bin.right);
+    }
+    if (n->kind != NODE_CMD || n->cmd.nwords == 0 || n->cmd.words[0].flags != 0 ||
+        is_assignment(&n->cmd.words[0]) || func_find(n->cmd.words[0].text) != NULL) {
+        return 0;
+    }
+    const builtin_t *b = builtin_find(n->cmd.words[0].text);
+    if (b == NULL || b->flags != 0 || b->run == bi_break || b->run == bi_return) return 0;
+    for (redir_t *r = n->cmd.redirs; r != NULL; r = r->next) {
+        if (r->fd > STDOUT_FILENO) return 0;
+    }
+    return 1;
+}
+
+// subst_external: is n one pipeline of nothing but external commands?
+static int subst_external(node_t *n) {
+    if (n->kind != NODE_CMD && n->kind != NODE_PIPE) return 0;
+    node_t **cmds  = (n->kind == NODE_PIPE) ? n->pipe.cmds : &n;
+    int      ncmds = (n->kind == NODE_PIPE) ? n->pipe.ncmds : 1;
+    for (int i = 0; i < ncmds; i++) {
+        const word_t *w = cmds[i]->cmd.words;
+        if (cmds[i]->cmd.nwords == 0 || w->flags != 0 || is_assignment(w) ||
+            builtin_find(w->text) != NULL || func_find(w->text) != NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// subst_capture: I run e's command with its stdout on a pipe, either launched
+// directly or in a copy of me, and collect everything written to the pipe into q.
+static void subst_capture(ast_entry_t *e, int direct, tty_queue_t *q, arena_t *scratch) {
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0) {
+        perror("pipe");
+        last_status = 1;
+        return;
+    }
+    int          outer_fd = subst_fd;
+    tty_queue_t *outer_q  = subst_q;
+    subst_fd   = p[0];
+    subst_q    = q;
+    fg_stopped = 0;
+    if (direct) {
+        subst_out = p[1];
+        exec_node(e->root, scratch);
+        subst_out = -1;
+    } else {
+        fork_subshell(e->line, e->len, subshell_body(e->root), p[1], scratch);
+    }
+    close(p[1]);
+    subst_fd = -1;
+
+    // the rest, up to EOF. A stopped job still holds the pipe, so then I only take
+    // what is there; a Ctrl-C ends the wait if something else still holds it.
+    int stopped = fg_stopped;
+    for (;;) {
+        if (wait_for_events(p[0], stopped ? 0 : -1)) {
+            if (subst_read(p[0], q) <= 0) break;
+        } else if (stopped || sigint_seen) {
+            break;
+        }
+    }
+    close(p[0]);
+    subst_fd = outer_fd;
+    subst_q  = outer_q;
+}
+
+// cmd_subst: I run text and return its output, in scratch, without trailing newlines
+// (and without NUL bytes, which no argument can hold). The text is parsed through the
+// parse cache, so a substitution inside a loop is parsed once.
+static char *cmd_subst(const char *text, size_t len, arena_t *scratch, size_t *outlen) {
+    tty_queue_t  q = { NULL, 0, 0 };
+    ast_entry_t *e = ast_acquire(text, len);
+    if (e == NULL) {
+        last_status = 2;   // syntax error, already reported
+    } else if (e->heredocs != NULL) {
+        fprintf(stderr, "icsh: here-documents are not supported in command substitution\n");
+        last_status = 2;
+    } else if (e->root == NULL) {
+        last_status = 0;
+    } else {
+        arena_t      inner = { NULL };
+        ast_entry_t *outer = running_entry;
+        running_entry = e;
+        if (subst_in_shell(e->root)) {
+            tty_queue_t *saved = out_capture;
+            out_capture = &q;
+            exec_node(e->root, &inner);
+            out_capture = saved;
+        } else {
+            subst_capture(e, subst_external(e->root), &q, &inner);
+        }
+        running_entry = outer;
+        arena_free(&inner);
+    }
+    if (e != NULL) ast_release(e);
+    subst_status = last_status;
+
+    while (q.len > 0 && q.buf[q.len - 1] == '\n') q.len--;
+    char  *out = arena_alloc(scratch, q.len + 1);
+    size_t n   = 0;
+    for (size_t i = 0; i < q.len; i++) {
+        if (q.buf[i] != '\0') out[n++] = q.buf[i];
+    }
+    out[n]  = '\0';
+    *outlen = n;
+    free(q.buf);
+    return out;
+}
+
+// shell_redirect: redirections for something that runs in the shell itself (a
+// compound command or a function) are applied to my own fds, as for a built-in.
+// I return how many fds I saved, or -1 (status 1) if a redirection failed.
+static int shell_redirect(redir_spec_t *rs, int nrs, redir_plan_t *plan, fd_save_t *saves) {
+    if (redir_plan(plan, rs, nrs, -1, -1) < 0) {
+        last_status = 1;
+        return -1;
+    }
+    return (plan->nsteps > 0) ? redir_apply(plan, saves) : 0;
+}
+
+static void shell_unredirect(redir_plan_t *plan, fd_save_t *saves, int nsaves) {
+    if (plan->nsteps > 0) redir_restore(saves, nsaves);
+    redir_done(plan);
+}
+
+// call_function: the arguments become $1... while the body runs. The body's
+// parse-cache entry is held for the call, so redefining the function from inside
+// itself cannot free the AST I am walking.
+static void call_function(func_t *f, stage_t *st, arena_t *scratch) {
+    if (func_depth >= FUNC_MAX_DEPTH) {
+        fprintf(stderr, "icsh: %s: maximum function nesting level exceeded\n", f->name);
+        last_status = 1;
+        return;
+    }
+    redir_plan_t plan;
+    fd_save_t    saves[MAX_PLAN_STEPS];
+    int          nsaves = shell_redirect(st->redirs, st->nredirs, &plan, saves);
+    if (nsaves < 0) return;
+
+    char        **saved_args  = pos_args;
+    int           saved_count = pos_count;
+    int           saved_loops = loop_depth;
+    ast_entry_t  *saved_entry = running_entry;
+    ast_entry_t  *entry       = f->entry;
+
+    pos_args  = st->argv + 1;
+    pos_count = 0;
+    while (pos_args[pos_count] != NULL) pos_count++;
+    running_entry = entry;
+    entry->busy++;
+    func_depth++;
+    loop_depth = 0;   // break and continue do not reach the caller's loops
+
+    last_status = 0;
+    exec_node(f->body, scratch);
+
+    func_depth--;
+    loop_depth       = saved_loops;
+    pending_return   = 0;
+    pending_break    = 0;
+    pending_continue = 0;
+    ast_release(entry);
+    running_entry = saved_entry;
+    pos_args      = saved_args;
+    pos_count     = saved_count;
+    shell_unredirect(&plan, saves, nsaves);
+}
+
+// loop_interrupted: checked before every iteration. A body of built-ins never waits
+// for a child, so every 256 iterations I look at my signal events myself; a Ctrl-C
+// there, or a command the Ctrl-C killed, ends every loop of the command line.
+static int loop_interrupted(unsigned long iter) {
+    if ((iter & 255) == 255) wait_for_events(-1, 0);
+    if (sigint_seen || last_status == 128 + SIGINT) run_aborted = 1;
+    return run_aborted;
+}
+
+// loop_done: after a body ran, does its loop stop? break takes one level, and
+// continue ends this loop only if it is meant for one further out.
+static int loop_done(void) {
+    if (pending_break > 0) {
+        pending_break--;
+        return 1;
+    }
+    if (pending_continue > 0) {
+        return --pending_continue > 0;
+    }
+    return pending_return || run_aborted;
+}
+
+// exec_compound: if, while/until, for, { } and ( ). Every iteration of a loop resets the
+// scratch arena to where it was before the loop, so a long loop runs in constant
+// memory. The status is that of the last body command run, or 0 if none ran.
+static void exec_compound(node_t *n, arena_t *scratch) {
+    redir_plan_t plan;
+    fd_save_t    saves[MAX_PLAN_STEPS];
+    int          nsaves = 0;
+    if (n->redirs != NULL) {
+        redir_spec_t *rs;
+        int           nrs;
+        if (build_redirs(n->redirs, &rs, &nrs, scratch) < 0) {
+            last_status = 1;
+            return;
+        }
+        if ((nsaves = shell_redirect(rs, nrs, &plan, saves)) < 0) return;
+    }
+
+    switch (n->kind) {
+        case NODE_IF:
+            exec_node(n->cond.cond, scratch);
+            if (unwinding()) break;
+            if (last_status == 0)       exec_node(n->cond.then, scratch);
+            else if (n->cond.els)       exec_node(n->cond.els, scratch);
+            else                        last_status = 0;
+            break;
+
+        case NODE_WHILE: {
+            arena_mark_t  mark   = arena_mark(scratch);
+            int           status = 0;
+            loop_depth++;
+            for (unsigned long iter = 0; !loop_interrupted(iter); iter++) {
+                exec_node(n->loop.cond, scratch);
+                if (unwinding()) {
+                    if (loop_done()) break;
+                    continue;
+                }
+                if ((last_status == 0) == n->loop.until) break;
+                exec_node(n->loop.body, scratch);
+                status = last_status;
+                arena_reset(scratch, mark);
+                if (loop_done()) break;
+            }
+            loop_depth--;
+            arena_reset(scratch, mark);
+            last_status = status;
+            break;
+        }
+
+        case NODE_FOR: {
+            char   **items  = pos_args;
+            size_t   nitems = pos_count;
+            if (n->loop_for.has_in) {
+                strvec_t words;
+                sv_init(&words, n->loop_for.nwords, scratch);
+                expand_words(n->loop_for.words, n->loop_for.nwords, &words, scratch);
+                items  = words.v;
+                nitems = words.n;
+            }
+            const word_t *var    = &n->loop_for.var;
+            arena_mark_t  mark   = arena_mark(scratch);
+            int           status = 0;
+            loop_depth++;
+            for (size_t k = 0; k < nitems && !loop_interrupted(k); k++) {
+                var_set(var->text, var->len, items[k], strlen(items[k]));
+                exec_node(n->loop_for.body, scratch);
+                status = last_status;
+                arena_reset(scratch, mark);
+                if (loop_done()) break;
+            }
+            loop_depth--;
+            last_status = status;
+            break;
+        }
+
+        case NODE_SUBSHELL:
+            fork_subshell(n->src, n->src_len, n->bg.body, -1, scratch);
+            break;
+
+        default:   // NODE_GROUP
+            exec_node(n->bg.body, scratch);
+            break;
+    }
+
+    if (n->redirs != NULL) shell_unredirect(&plan, saves, nsaves);
+}
+
+// exec_node: I walk the AST. && and || look at last_status, like in other shells.
+// A pending break, continue or return stops a list where it is.
+static void exec_node(node_t *n, arena_t *scratch) {
+    switch (n->kind) {
+        case NODE_CMD:
+        case NODE_PIPE:
+            exec_pipeline(n, 0, scratch);
+            break;
+        case NODE_AND:
+            exec_node(n->bin.left, scratch);
+            if (last_status == 0 && !unwinding()) exec_node(n->bin.right, scratch);
+            break;
+        case NODE_OR:
+            exec_node(n->bin.left, scratch);
+            if (last_status != 0 && !unwinding()) exec_node(n->bin.right, scratch);
+            break;
+        case NODE_SEQ:
+            exec_node(n->bin.left, scratch);
+            if (!unwinding()) exec_node(n->bin.right, scratch);
+            break;
+        case NODE_BG:
+            if (n->bg.body->kind == NODE_CMD || n->bg.body->kind == NODE_PIPE) {
+                exec_pipeline(n->bg.body, 1, scratch);
+            } else {
+                run_background_list(n, scratch);
+            }
+            break;
+        case NODE_FUNC:
+            func_define(n->func.name, n->func.body);
+            break;
+        default:
+            exec_compound(n, scratch);
+            break;
+    }
+}
+
+// runCmd: I get the line's AST from the parse cache (parsing it only the first time I
+// see it) and run it. Words are expanded into a scratch arena that lives for this one
+// command. The line is a (pointer, length) view straight from the reader.
+void runCmd(const char *line, size_t len) {
+    long long    t0 = trace_now();
+    ast_entry_t *e  = ast_acquire(line, len);
+    trace_event(TR_PARSE, t0, 0, line, len);
+    if (e == NULL) {
+        // syntax error, already reported
+        last_status = 2;
+        return;
+    }
+    if (e->root != NULL) {
+        arena_t      scratch = { NULL };
+        ast_entry_t *outer   = running_entry;
+        running_entry = e;
+        sigint_seen   = 0;
+        run_aborted   = 0;
+        exec_node(e->root, &scratch);
+        running_entry = outer;
+        arena_free(&scratch);
+    }
+    ast_release(e);
+    trace_event(TR_CMD, t0, 0, line, len);
+}
+
+// I always call this to print my prompt "icsh $ ": whatever output and job notices
+// are queued go out with it, in one writev().
+static void prompt() {
+    tty_cycle("icsh $ ");
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Line reader: (pointer, length) views with no line-length limit
+// ────────────────────────────────────────────────────────────────────────────
+
+// A script that is a regular file is mmap'd whole, so every line is a view into the
+// mapping and nothing is copied; lines stay valid until the script ends. Anything else
+// (a pipe, or the terminal) goes through a large read buffer that grows for long
+// lines; there a view is valid only until the next reader_next() call.
+#define READER_CHUNK (64 * 1024)
+
+typedef struct {
+    int     fd;
+    char   *map;          // whole file when mapped, else NULL
+    size_t  map_len;
+    char   *buf;          // read buffer when not mapped
+    size_t  cap;          // size of buf
+    size_t  len;          // valid bytes in buf (or map_len)
+    size_t  pos;          // first byte not yet handed out
+    int     eof;
+    int     interactive;  // wait in my event loop before each read()
+    int     edit;         // a terminal: lines come from the line editor
+} line_reader_t;
+
+// reader_open: I try to mmap fd; if it is not a regular file (or empty) I fall back to
+// the read buffer. I return 0, or -1 if I could not allocate.
+static int reader_open(line_reader_t *r, int fd, int interactive) {
+    memset(r, 0, sizeof(*r));
+    r->fd          = fd;
+    r->interactive = interactive;
+
+    struct stat st;
+    if (!interactive && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            r->map     = m;
+            r->map_len = st.st_size;
+            r->len     = st.st_size;
+            r->eof     = 1;
+            return 0;
+        }
+    }
+    r->cap = READER_CHUNK;
+    r->buf = malloc(r->cap);
+    return r->buf ? 0 : -1;
+}
+
+static void reader_close(line_reader_t *r) {
+    if (r->map != NULL) munmap(r->map, r->map_len);
+    free(r->buf);
+}
+
+// While interactiveMode() runs, its reader of my stdin may already hold lines past the
+// one I am running. "read" on that same input must get those first: input_take() hands
+// them out a byte at a time, and only then does "read" go on to the fd itself. I know
+// the input by its inode, and a regular file also by its offset (kept in input_fd, a
+// copy of the reader's fd), so "read < script" on the file I run still reads it anew.
+static line_reader_t *input_reader = NULL;
+static int            input_fd     = -1;
+static dev_t          input_dev;
+static ino_t          input_ino;
+
+static void input_attach(line_reader_t *r) {
+    struct stat st;
+    if (fstat(r->fd, &st) < 0) return;
+    input_reader = r;
+    input_fd     = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+    input_dev    = st.st_dev;
+    input_ino    = st.st_ino;
+}
+
+// input_is: is fd (st describes it) my stdin, the input my reader buffers?
+static int input_is(int fd, const struct stat *st) {
+    if (input_reader == NULL || st->st_dev != input_dev || st->st_ino != input_ino) return 0;
+    return !S_ISREG(st->st_mode) || lseek(fd, 0, SEEK_CUR) == lseek(input_fd, 0, SEEK_CUR);
+}
+
+// input_take: if my reader has bytes I have not run, I take the next one into *c and
+// return 1.
+static int input_take(char *c) {
+    line_reader_t *r = input_reader;
+    if (r == NULL || r->pos >= r->len) return 0;
+    *c = r->buf[r->pos++];
+    return 1;
+}
+
+// ────────────────────────────────────────────────────────────────────────────
+// Line editor: raw-mode editing, history keys and Tab completion
+// ────────────────────────────────────────────────────────────────────────────
+
+// On a terminal I read my own input with the terminal in raw mode and edit the line
+// myself: Left/Right, Home/End, Alt-b/Alt-f (Ctrl-Left/Right), ^A ^E ^B ^F, Backspace,
+// Delete, ^D ^K ^U ^W ^L, Up/Down (^P/^N) through the history, and Tab to complete a
+// command name or a path. The finished line goes into the reader's buffer with its
+// "\n", so the rest of the reader does not know the difference. Keys typed ahead must
+// reach the next command as if the terminal had been cooked all along:
+//   - input already waiting when the prompt comes up was typed on the cooked
+//     terminal (echoed, with ^D and erase applied), so I leave the terminal cooked
+//     and read that line without the editor (see edit_raw());
+//   - what arrives after Enter while the terminal is raw has not been echoed or
+//     processed, so I take it out, make the terminal cooked, and type it back in
+//     with TIOCSTI, which runs it through the line discipline like real typing.
+//     Where the kernel refuses TIOCSTI, the rest goes to my next prompt instead.
+// While keys are already waiting (a paste, or typing ahead) I draw
+// nothing; once they are used up, edit_refresh() compares the screen with the line
+// and writes only the difference (a cursor move, the changed tail, a clear if the
+// line got shorter) in one write. ICSH_EDIT=0 or TERM=dumb leaves input cooked.
+enum {
+    K_LEFT = 256, K_RIGHT, K_UP, K_DOWN, K_HOME, K_END, K_DELETE, K_WORD_LEFT, K_WORD_RIGHT
+};
+
+static struct {
+    char       *buf;         // the line (no '\0')
+    size_t      len, pos, cap;
+    char       *shown;       // what the screen shows after the prompt, and where the cursor is
+    size_t      shown_len, shown_pos, shown_cap;
+    const char *prompt;
+    size_t      plen;        // the prompt's width
+    size_t      cols;        // the terminal's width
+    size_t      hist_n;      // the history entry on show, 0 for the line being typed
+    char       *saved;       // that line, while a history entry is on show
+    size_t      saved_len;
+    int         raw;         // the terminal is in raw mode
+    char       *ahead;       // typed after Enter, which TIOCSTI would not take back
+    size_t      ahead_len, ahead_pos;
+} ed;
+
+static tty_queue_t ed_out;   // what edit_refresh() draws, written in one go
+
+// edit_width: the columns n bytes of s take; a UTF-8 continuation byte takes none.
+static size_t edit_width(const char *s, size_t n) {
+    size_t w = 0;
+    for (size_t i = 0; i < n; i++) w += ((s[i] & 0xC0) != 0x80);
+    return w;
+}
+
+// edit_move: the cursor from column from to column to, both counted from the start of
+// the prompt across wrapped rows.
+static void edit_move(size_t from, size_t to) {
+    long dr = (long)(to / ed.cols) - (long)(from / ed.cols);
+    long dc = (long)(to % ed.cols) - (long)(from % ed.cols);
+    if (dr < 0) tty_printf(&ed_out, "\x1b[%ldA", -dr);
+    if (dr > 0) tty_printf(&ed_out, "\x1b[%ldB", dr);
+    if (dc < 0) tty_printf(&ed_out, "\x1b[%ldD", -dc);
+    if (dc > 0) tty_printf(&ed_out, "\x1b[%ldC", dc);
+}
+
+static void edit_flush(void) {
+    if (ed_out.len == 0) return;
+    struct iovec iov = { ed_out.buf, ed_out.len };
+    tty_writev(&iov, 1);
+    ed_out.len = 0;
+}
+
+static int edit_grow(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t c = *cap ? *cap : 256;
+    while (c < need) c *= 2;
+    char *grown = realloc(*buf, c);
+    if (grown == NULL) return -1;
+    *buf = grown;
+    *cap = c;
+    return 0;
+}
+
+static int is_cont(const char *s, size_t len, size_t i) {
+    return i < len && (s[i] & 0xC0) == 0x80;
+}
+
+// edit_refresh: I bring the screen from ed.shown to ed.buf. Only the part after the
+// longest common prefix is written.
+static void edit_refresh(void) {
+    size_t p = 0;
+    while (p < ed.len && p < ed.shown_len && ed.buf[p] == ed.shown[p]) p++;
+    while (p > 0 && (is_cont(ed.buf, ed.len, p) || is_cont(ed.shown, ed.shown_len, p))) p--;
+
+    size_t from = ed.plen + edit_width(ed.shown, ed.shown_pos);
+    size_t to   = ed.plen + edit_width(ed.buf, ed.pos);
+    if (p == ed.len && p == ed.shown_len) {
+        edit_move(from, to);
+    } else {
+        edit_move(from, ed.plen + edit_width(ed.buf, p));
+        tty_put(&ed_out, ed.buf + p, ed.len - p);
+        size_t end = ed.plen + edit_width(ed.buf, ed.len);
+        // a line that ends at the right margin leaves the cursor there; I move it on
+        if (ed.len > p && end % ed.cols == 0) tty_put(&ed_out, "\n", 1);
+        if (ed.len < ed.shown_len) tty_put(&ed_out, "\x1b[J", 3);
+        edit_move(end, to);
+    }
+    if (edit_grow(&ed.shown, &ed.shown_cap, ed.len) == 0) {
+        memcpy(ed.shown, ed.buf, ed.len);
+        ed.shown_len = ed.len;
+    }
+    ed.shown_pos = ed.pos;
+    edit_flush();
+}
+
+// edit_redraw: I wipe the prompt and line, let out what is queued (job notices, a
+// completion list), then draw prompt and line from scratch. clear is written first.
+static void edit_redraw(const char *clear) {
+    edit_move(ed.plen + edit_width(ed.shown, ed.shown_pos), 0);
+    tty_put(&ed_out, clear, strlen(clear));
+    edit_flush();
+    tty_cycle(ed.prompt);
+    ed.shown_len = ed.shown_pos = 0;
+    edit_refresh();
+}
+
+// edit_byte: the next byte typed. With nothing waiting I draw the line first and sit in
+// my event loop, where job notices go above the line and the history gets written
+// when I am idle. I return -1 at end of input, or -2 once wait_ms (if >= 0) has passed.
+static int edit_byte(int fd, int wait_ms) {
+    long long until = now_ns() + wait_ms * 1000000LL;
+    if (ed.ahead_pos < ed.ahead_len) return (unsigned char)ed.ahead[ed.ahead_pos++];
+    for (;;) {
+        int avail = 0;
+        if (ioctl(fd, FIONREAD, &avail) < 0 || avail == 0) {
+            if (tty_out.len > 0 || tty_notes.len > 0 || tty_reprompt) edit_redraw("\r\x1b[J");
+            else if (wait_ms < 0) edit_refresh();
+            int ms = wait_ms < 0 ? (hist.pend_len ? HIST_SYNC_IDLE_MS : -1)
+                                 : (int)((until - now_ns()) / 1000000);
+            if (wait_ms >= 0 && ms <= 0) return -2;
+            if (!wait_for_events(fd, ms)) {
+                history_sync();
+                continue;
+            }
+        }
+        unsigned char c;
+        ssize_t n = read(fd, &c, 1);
+        if (n < 0 && errno == EINTR) continue;
+        return n == 1 ? c : -1;
+    }
+}
+
+// edit_key: one key; escape sequences become K_*. A lone Esc or a sequence I do not
+// know gives 0.
+static int edit_key(int fd) {
+    int c = edit_byte(fd, -1);
+    if (c != 27) return c;
+    c = edit_byte(fd, 50);
+    if (c == 'b') return K_WORD_LEFT;
+    if (c == 'f') return K_WORD_RIGHT;
+    if (c != '[' && c != 'O') return c == -1 ? -1 : 0;
+
+    int arg[2] = { 0, 0 }, na = 0;
+    while ((c = edit_byte(fd, 50)) >= 0 && ((c >= '0' && c <= '9') || c == ';')) {
+        if (c == ';') na = 1;
+        else          arg[na] = arg[na] * 10 + (c - '0');
+    }
+    switch (c) {
+    case 'A': return K_UP;
+    case 'B': return K_DOWN;
+    case 'C': return arg[1] == 5 ? K_WORD_RIGHT : K_RIGHT;
+    case 'D': return arg[1] == 5 ? K_WORD_LEFT : K_LEFT;
+    case 'H': return K_HOME;
+    case 'F': return K_END;
+    case '~':
+        if (arg[0] == 1 || arg[0] == 7) return K_HOME;
+        if (arg[0] == 4 || arg[0] == 8) return K_END;
+        if (arg[0] == 3) return K_DELETE;
+        return 0;
+    default:  return c == -1 ? -1 : 0;
+    }
+}
+
+// edit_set: the line becomes s, with the cursor at its end.
+static void edit_set(const char *s, size_t n) {
+    if (edit_grow(&ed.buf, &ed.cap, n) < 0) return;
+    memmove(ed.buf, s, n);
+    ed.len = ed.pos = n;
+}
+
+static void edit_insert(const char *s, size_t n) {
+    if (edit_grow(&ed.buf, &ed.cap, ed.len + n) < 0) return;
+    memmove(ed.buf + ed.pos + n, ed.buf + ed.pos, ed.len - ed.pos);
+    memcpy(ed.buf + ed.pos, s, n);
+    ed.len += n;
+    ed.pos += n;
+}
+
+// edit_delete: bytes [from, to) go.
+static void edit_delete(size_t from, size_t to) {
+    memmove(ed.buf + from, ed.buf + to, ed.len - to);
+    ed.len -= to - from;
+    ed.pos  = from;
+}
+
+static size_t edit_prev(size_t i) {
+    while (i > 0 && is_cont(ed.buf, ed.len, --i)) {}
+    return i;
+}
+
+static size_t edit_next(size_t i) {
+    if (i < ed.len) i++;
+    while (is_cont(ed.buf, ed.len, i)) i++;
+    return i;
+}
+
+static int is_word_byte(char c) {
+    return c != ' ' && c != '\t' && c != '/';
+}
+
+static size_t edit_word_left(size_t i) {
+    while (i > 0 && !is_word_byte(ed.buf[i - 1])) i--;
+    while (i > 0 && is_word_byte(ed.buf[i - 1])) i--;
+    return i;
+}
+
+static size_t edit_word_right(size_t i) {
+    while (i < ed.len && !is_word_byte(ed.buf[i])) i++;
+    while (i < ed.len && is_word_byte(ed.buf[i])) i++;
+    return i;
+}
+
+// edit_history: Up (dir -1) or Down (+1) from the entry on show. Leaving the line being
+// typed saves it, and coming back past the newest entry brings it back. The history
+// index is only built on the first Up.
+static void edit_history(int dir) {
+    const char *p;
+    size_t      n;
+    if (ed.hist_n == 0) {
+        if (dir > 0 || (ed.hist_n = history_count()) == 0) return;
+        char *s = malloc(ed.len + 1);
+        if (s == NULL) {
+            ed.hist_n = 0;
+            return;
+        }
+        memcpy(s, ed.buf, ed.len);
+        free(ed.saved);
+        ed.saved     = s;
+        ed.saved_len = ed.len;
+    } else if (dir < 0) {
+        if (ed.hist_n == 1) return;
+        ed.hist_n--;
+    } else if (ed.hist_n == history_count()) {
+        ed.hist_n = 0;
+        edit_set(ed.saved, ed.saved_len);
+        return;
+    } else {
+        ed.hist_n++;
+    }
+    if (history_get(ed.hist_n, &p, &n)) edit_set(p, n);
+}
+
+// ── Tab completion ──
+// A command name is completed from the built-ins, my functions and the executables in
+// $PATH; anything else as a path. Directory listings come from the glob cache
+// (dcache_get()), which keeps each directory's sorted names until its mtime changes, so
+// a Tab costs one stat() per $PATH directory and a binary search in each. Whether a
+// name in a $PATH directory can be run is found out the first time it matches and is
+// kept with the listing, so even that happens only once per change of the directory.
+
+typedef struct {
+    char *name;
+    int   dir;     // a directory: it gets a '/' rather than a ' '
+} cand_t;
+
+typedef struct {
+    cand_t *v;
+    int     n, cap;
+} cands_t;
+
+static void cands_add(cands_t *c, const char *name, int dir) {
+    if (c->n == c->cap) {
+        int     cap   = c->cap ? c->cap * 2 : 64;
+        cand_t *grown = realloc(c->v, cap * sizeof(cand_t));
+        if (grown == NULL) return;
+        c->v   = grown;
+        c->cap = cap;
+    }
+    if ((c->v[c->n].name = strdup(name)) == NULL) return;
+    c->v[c->n++].dir = dir;
+}
+
+static void cands_free(cands_t *c) {
+    for (int i = 0; i < c->n; i++) free(c->v[i].name);
+    free(c->v);
+}
+
+// dcache_lower: the first of d's names that is not below prefix.
+static size_t dcache_lower(const dcache_t *d, const char *prefix) {
+    size_t lo = 0, hi = d->n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strcmp(d->names[mid], prefix) < 0) lo = mid + 1;
+        else                                   hi = mid;
+    }
+    return lo;
+}
+
+// complete_command: the names a command word starting with w can become.
+static void complete_command(cands_t *c, const char *w, size_t wlen) {
+    for (int i = 0; i < NBUILTINS; i++) {
+        if (strncmp(builtins[i].name, w, wlen) == 0) cands_add(c, builtins[i].name, 0);
+    }
+    for (int b = 0; b < FUNC_BUCKETS && func_count > 0; b++) {
+        for (func_t *f = func_table[b]; f != NULL; f = f->next) {
+            if (strncmp(f->name, w, wlen) == 0) cands_add(c, f->name, 0);
+        }
+    }
+    const char *path = var_get("PATH");
+    char        dir[PATH_MAX], file[2 * PATH_MAX];
+    for (const char *p = path ? path : ""; path != NULL; p++) {
+        const char *colon = strchrnul(p, ':');
+        int         dlen  = snprintf(dir, sizeof(dir), "%.*s", (int)(colon - p), p);
+        dcache_t   *d     = (dlen < (int)sizeof(dir)) ? dcache_get(dir) : NULL;
+        if (d != NULL && d->exec == NULL) d->exec = calloc(d->n + 1, 1);
+        for (size_t i = d ? dcache_lower(d, w) : 0; d && d->exec && i < d->n; i++) {
+            if (strncmp(d->names[i], w, wlen) != 0) break;
+            if (d->exec[i] == 0) {
+                struct stat sb;
+                snprintf(file, sizeof(file), "%s/%s", dlen ? dir : ".", d->names[i]);
+                d->exec[i] = (stat(file, &sb) == 0 && S_ISREG(sb.st_mode) &&
+                              access(file, X_OK) == 0) ? 1 : 2;
+            }
+            if (d->exec[i] == 1) cands_add(c, d->names[i], 0);
+        }
+        if (*colon == '\0') break;
+        p = colon;
+    }
+}
+
+// complete_path: the entries of w's directory that start with its last component.
+// Dotfiles only match a component that starts with '.'.
+static void complete_path(cands_t *c, const char *w) {
+    const char *slash = strrchr(w, '/');
+    const char *base  = slash ? slash + 1 : w;
+    char        dir[PATH_MAX];
+    if (slash == w)  snprintf(dir, sizeof(dir), "/");
+    else if (slash)  snprintf(dir, sizeof(dir), "%.*s", (int)(slash - w), w);
+    else             dir[0] = '\0';
+    dcache_t *d = dcache_get(dir);
+    if (d == NULL) return;
+
+    size_t blen = strlen(base);
+    for (size_t i = dcache_lower(d, base); i < d->n; i++) {
+        const char *nm = d->names[i];
+        if (strncmp(nm, base, blen) != 0) break;
+        if (nm[0] == '.' && base[0] != '.') continue;
+        int is_dir = (d->types[i] == DT_DIR);
+        if (d->types[i] == DT_LNK || d->types[i] == DT_UNKNOWN) {
+            char        file[2 * PATH_MAX];
+            struct stat sb;
+            snprintf(file, sizeof(file), "%s%s%s", dir, *dir && strcmp(dir, "/") ? "/" : "", nm);
+            is_dir = (stat(file, &sb) == 0 && S_ISDIR(sb.st_mode));
+        }
+        cands_add(c, nm, is_dir);
+    }
+}
+
+static int cand_cmp(const void *a, const void *b) {
+    return strcmp(((const cand_t *)a)->name, ((const cand_t *)b)->name);
+}
+
+// edit_insert_word: s goes in with the characters the lexer would treat specially
+// backslash-escaped, unless the word was opened with a quote.
+static void edit_insert_word(const char *s, size_t n, int quoted) {
+    for (size_t i = 0; i < n; i++) {
+        if (!quoted && strchr(" \t\\'\"`$&|;<>()*?[]#!{}", s[i]) != NULL) edit_insert("\\", 1);
+        edit_insert(s + i, 1);
+    }
+}
+
+// edit_list: the candidates in columns under the line, which is then drawn again.
+static void edit_list(cands_t *c) {
+    edit_refresh();   // keys typed ahead may not be on the screen yet
+    edit_move(ed.plen + edit_width(ed.buf, ed.pos), ed.plen + edit_width(ed.buf, ed.len));
+    tty_put(&ed_out, "\n", 1);
+    if (c->n > 256) {
+        tty_printf(&ed_out, "(%d possibilities)\n", c->n);
+    } else {
+        size_t width = 0;
+        for (int i = 0; i < c->n; i++) {
+            size_t w = edit_width(c->v[i].name, strlen(c->v[i].name)) + c->v[i].dir;
+            if (w > width) width = w;
+        }
+        width += 2;
+        int ncol = (int)(ed.cols / width) > 0 ? (int)(ed.cols / width) : 1;
+        int rows = (c->n + ncol - 1) / ncol;
+        for (int r = 0; r < rows; r++) {
+            for (int k = r; k < c->n; k += rows) {
+                size_t w = edit_width(c->v[k].name, strlen(c->v[k].name)) + c->v[k].dir;
+                tty_printf(&ed_out, "%s%s", c->v[k].name, c->v[k].dir ? "/" : "");
+                if (k + rows < c->n) tty_printf(&ed_out, "%*s", (int)(width - w), "");
+            }
+            tty_put(&ed_out, "\n", 1);
+        }
+    }
+    edit_flush();
+    tty_cycle(ed.prompt);
+    ed.shown_len = ed.shown_pos = 0;
+}
 
-// job_list[] holds all current background jobs. num_jobs is how many are active.
-// next_job_id is what I assign next time I start a new job.
-static job_t job_list[MAX_JOBS];
-static int   num_jobs = 0;
-static int   next_job_id = 1;
+// edit_complete: Tab. One match is filled in with a ' ' after it (a '/' for a
+// directory); several fill in what they have in common, and a second Tab lists them.
+static void edit_complete(int again) {
+    size_t start = ed.pos;
+    while (start > 0 && (strchr(" \t;|&<>()`", ed.buf[start - 1]) == NULL ||
+                         (start >= 2 && ed.buf[start - 2] == '\\'))) {
+        start--;
+    }
+    size_t before = start;
+    while (before > 0 && (ed.buf[before - 1] == ' ' || ed.buf[before - 1] == '\t')) before--;
+    int command = (before == 0 || strchr(";|&(`", ed.buf[before - 1]) != NULL);
 
-// just_handled_stop tells interactiveMode() not to print a duplicate prompt
-// if runCmd() already printed one when a job was stopped.
-static int just_handled_stop = 0;
+    // the word as the lexer will see it: a leading quote dropped, backslashes undone
+    int    quoted = (start < ed.pos && (ed.buf[start] == '\'' || ed.buf[start] == '"'));
+    char  *w      = malloc(ed.pos - start + 1);
+    size_t wlen   = 0;
+    if (w == NULL) return;
+    for (size_t i = start + quoted; i < ed.pos; i++) {
+        if (ed.buf[i] == '\\' && !quoted && i + 1 < ed.pos) i++;
+        w[wlen++] = ed.buf[i];
+    }
+    w[wlen] = '\0';
 
+    cands_t c = { NULL, 0, 0 };
+    if (command && strchr(w, '/') == NULL) complete_command(&c, w, wlen);
+    else                                   complete_path(&c, w);
+    const char *base = strrchr(w, '/') ? strrchr(w, '/') + 1 : w;
+    size_t      blen = strlen(base);
 
-// I scan job_list[] to find a job whose pid matches. I return its index or -1.
-static int find_job_by_pid(pid_t pid) {
-    for (int i = 0; i < num_jobs; i++) {
-        if (job_list[i].pid == pid) {
-            return i;
+    // sorted, so the same name from two places (a built-in and /bin/echo) shows once
+    qsort(c.v, c.n, sizeof(cand_t), cand_cmp);
+    int n = 0;
+    for (int i = 0; i < c.n; i++) {
+        if (n > 0 && strcmp(c.v[n - 1].name, c.v[i].name) == 0) {
+            free(c.v[i].name);
+            continue;
         }
+        c.v[n++] = c.v[i];
     }
-    return -1;
-}
+    c.n = n;
 
-// I scan job_list[] to find a job whose id matches. I return its index or -1.
-static int find_job_by_id(int jid) {
-    for (int i = 0; i < num_jobs; i++) {
-        if (job_list[i].id == jid) {
-            return i;
+    if (c.n == 0) {
+        tty_put(&ed_out, "\a", 1);
+    } else {
+        size_t common = strlen(c.v[0].name);
+        for (int i = 1; i < c.n; i++) {
+            size_t k = 0;
+            while (k < common && c.v[i].name[k] == c.v[0].name[k]) k++;
+            common = k;
+        }
+        if (c.n == 1) {
+            edit_insert_word(c.v[0].name + blen, common - blen, quoted);
+            if (c.v[0].dir)   edit_insert("/", 1);
+            else if (!quoted) edit_insert(" ", 1);
+        } else if (common > blen) {
+            edit_insert_word(c.v[0].name + blen, common - blen, quoted);
+        } else if (again) {
+            edit_list(&c);
+        } else {
+            tty_put(&ed_out, "\a", 1);
         }
     }
-    return -1;
+    cands_free(&c);
+    free(w);
 }
 
-// When a job finishes or is removed, I want to delete it from job_list.
-// I shift everything after idx down one.
-static void remove_job_by_index(int idx) {
-    if (idx < 0 || idx >= num_jobs) return;
-    for (int i = idx; i < num_jobs - 1; i++) {
-        job_list[i] = job_list[i + 1];
+// edit_raw: the terminal goes raw. interactiveMode() does this before it prints the
+// prompt, so nothing typed after the prompt appears is echoed by the terminal too.
+// If input is already waiting, it was typed on the cooked terminal, so I leave it
+// cooked for that line and return 0.
+static int edit_raw(void) {
+    if (ed.raw) return 1;
+    int avail = 0;
+    if (ed.ahead_pos == ed.ahead_len && ioctl(tty_fd, FIONREAD, &avail) == 0 && avail > 0) {
+        return 0;
     }
-    num_jobs--;
+    struct termios raw = shell_tmodes;
+    raw.c_iflag &= ~(ICRNL | INLCR | IXON | ISTRIP);
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN]  = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(tty_fd, TCSADRAIN, &raw);
+    ed.raw = 1;
+    return 1;
 }
 
-// Whenever a background job changes state (Done, Stopped, Continued),
-// I print its status over the prompt (using "\r"), then reprint "icsh $ ".
-static void report_job_status(job_t *j, int status) {
-    if (WIFEXITED(status) || WIFSIGNALED(status)) {
-        // the job terminated normally or was killed by a signal
-        printf("\r[%d]  Done        %s\n", j->id, j->cmdline);
-        printf("icsh $ ");
-        fflush(stdout);
-    }
-    else if (WIFSTOPPED(status)) {
-        // the job was stopped by SIGTSTP
-        printf("\r[%d]  Stopped     %s\n", j->id, j->cmdline);
-        printf("icsh $ ");
-        fflush(stdout);
+// edit_cooked: the line is done. The terminal gets its own modes back before the
+// newline shows, and whatever was typed after Enter while it was raw is typed into it
+// again with TIOCSTI, echoed and processed as if it came in now.
+static void edit_cooked(void) {
+    int    avail = 0;
+    char  *rest  = NULL;
+    size_t nrest = 0;
+    if (ioctl(tty_fd, FIONREAD, &avail) == 0 && avail > 0 && (rest = malloc(avail)) != NULL) {
+        ssize_t n = read(tty_fd, rest, avail);
+        nrest = n > 0 ? (size_t)n : 0;
     }
-    else if (WIFCONTINUED(status)) {
-        // the job was resumed by SIGCONT
-        printf("\r[%d]  Continued   %s\n", j->id, j->cmdline);
-        printf("icsh $ ");
-        fflush(stdout);
+    tcsetattr(tty_fd, TCSADRAIN, &shell_tmodes);
+    ed.raw = 0;
+    tty_put(&ed_out, "\n", 1);
+    edit_flush();
+
+    size_t k = 0;
+    while (k < nrest && ioctl(tty_fd, TIOCSTI, &rest[k]) == 0) k++;
+    if (k < nrest) {
+        // not allowed here: the keys stay mine, for the next prompt
+        size_t left = ed.ahead_len - ed.ahead_pos;
+        char  *a    = malloc(left + nrest - k);
+        if (a != NULL) {
+            memcpy(a, ed.ahead + ed.ahead_pos, left);
+            memcpy(a + left, rest + k, nrest - k);
+            free(ed.ahead);
+            ed.ahead     = a;
+            ed.ahead_len = left + nrest - k;
+            ed.ahead_pos = 0;
+        }
     }
+    free(rest);
 }
 
-// This is my SIGCHLD handler. Whenever any child (background or stopped) changes state,
-// I loop on waitpid(..., WNOHANG|WUNTRACED|WCONTINUED) to reap all changes.
-// If I find a job in job_list[], I update or remove it and call report_job_status().
-static void handle_sigchld(int sig) {
-    int saved_errno = errno;
-    pid_t pid;
-    int status;
-
-    // keep collecting children that changed state
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
-        int idx = find_job_by_pid(pid);
-        if (idx >= 0) {
-            job_t *j = &job_list[idx];
+// edit_line: I read one line with the editor and add it, with its "\n", to r's buffer;
+// ^D on an empty line is the end of the input.
+static void edit_line(line_reader_t *r) {
+    struct winsize ws;
+    ed.cols   = (ioctl(tty_fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) ? ws.ws_col : 80;
+    ed.prompt = tty_prompt;
+    ed.plen   = edit_width(ed.prompt, strlen(ed.prompt));
+    ed.len    = ed.pos = ed.shown_len = ed.shown_pos = 0;
+    ed.hist_n = 0;
 
-            if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                // job finished: print "Done" and remove it from the table
-                report_job_status(j, status);
-                remove_job_by_index(idx);
-            }
-            else if (WIFSTOPPED(status)) {
-                // job was stopped: mark as stopped, then print "Stopped"
-                j->state = JOB_STOPPED;
-                report_job_status(j, status);
-            }
-            else if (WIFCONTINUED(status)) {
-                // job was resumed: mark as running, then print "Continued"
-                j->state = JOB_RUNNING;
-                report_job_status(j, status);
+    int tabs = 0, done = 0;
+    while (!done) {
+        int k = edit_key(r->fd);
+        tabs = (k == '\t') ? tabs + 1 : 0;
+        switch (k) {
+        case -1:
+            done = -1;
+            break;
+        case '\r': case '\n':
+            ed.pos = ed.len;
+            edit_refresh();
+            done = 1;
+            break;
+        case 3:     // ^C: the line is dropped
+            ed.pos = ed.len;
+            edit_refresh();
+            tty_put(&ed_out, "^C\n", 3);
+            edit_flush();
+            tty_cycle(ed.prompt);
+            ed.len = ed.pos = ed.shown_len = ed.shown_pos = 0;
+            ed.hist_n = 0;
+            break;
+        case 4:     // ^D: end of input on an empty line, else Delete
+            if (ed.len == 0) done = -1;
+            else if (ed.pos < ed.len) edit_delete(ed.pos, edit_next(ed.pos));
+            break;
+        case K_DELETE:
+            if (ed.pos < ed.len) edit_delete(ed.pos, edit_next(ed.pos));
+            break;
+        case 127: case 8:
+            if (ed.pos > 0) edit_delete(edit_prev(ed.pos), ed.pos);
+            break;
+        case 1:  case K_HOME:       ed.pos = 0;                         break;
+        case 5:  case K_END:        ed.pos = ed.len;                    break;
+        case 2:  case K_LEFT:       ed.pos = edit_prev(ed.pos);         break;
+        case 6:  case K_RIGHT:      ed.pos = edit_next(ed.pos);         break;
+        case K_WORD_LEFT:           ed.pos = edit_word_left(ed.pos);    break;
+        case K_WORD_RIGHT:          ed.pos = edit_word_right(ed.pos);   break;
+        case 16: case K_UP:         edit_history(-1);                   break;
+        case 14: case K_DOWN:       edit_history(1);                    break;
+        case 11: ed.len = ed.pos;                                       break;
+        case 21: edit_delete(0, ed.pos);                                break;
+        case 23: edit_delete(edit_word_left(ed.pos), ed.pos);           break;
+        case 12: edit_redraw("\x1b[H\x1b[2J");                          break;
+        case '\t':
+            edit_complete(tabs > 1);
+            break;
+        default:
+            if (k >= ' ' && k < 256) {
+                char c = (char)k;
+                edit_insert(&c, 1);
             }
         }
-        // if pid isn’t in job_list, it was a foreground child; ignore here
     }
+    edit_cooked();
 
-    errno = saved_errno;
-}
-
-// When I launch a new background job, I add it to job_list[] and print its job ID and PID.
-// If I already have MAX_JOBS, I print an error and skip it.
-static void add_job(pid_t pid, const char *cmdline) {
-    if (num_jobs >= MAX_JOBS) {
-        fprintf(stderr, "icsh: too many background jobs (max %d)\n", MAX_JOBS);
+    if (done < 0) {
+        r->eof = 1;
         return;
     }
-    job_t *j = &job_list[num_jobs++];
-    j->id    = next_job_id++;
-    j->pid   = pid;
-    j->state = JOB_RUNNING;
-    strncpy(j->cmdline, cmdline, MAX_CMD_BUFFER - 1);
-    j->cmdline[MAX_CMD_BUFFER - 1] = '\0';
-
-    // show "[jobID] pid"
-    printf("[%d] %d\n", j->id, j->pid);
-    fflush(stdout);
-}
-
-// Built-in "jobs": I just loop through job_list[], and for each job I print its ID,
-// then "Running" or "Stopped", then the saved cmdline plus "&".
-static void builtin_jobs(void) {
-    for (int i = 0; i < num_jobs; i++) {
-        job_t *j = &job_list[i];
-        const char *st = (j->state == JOB_RUNNING ? "Running" : "Stopped");
-        printf("[%d] %s %s &\n", j->id, st, j->cmdline);
+    while (r->len + ed.len + 1 > r->cap) {
+        char *grown = realloc(r->buf, r->cap * 2);
+        if (grown == NULL) {
+            r->eof = 1;
+            return;
+        }
+        r->buf  = grown;
+        r->cap *= 2;
     }
+    memcpy(r->buf + r->len, ed.buf, ed.len);
+    r->buf[r->len + ed.len] = '\n';
+    r->len += ed.len + 1;
 }
 
-// Built-in "fg": bring a stopped or background job to the foreground.
-// If arg is NULL, I pick the most recent job. Otherwise I parse the job ID (allowing a leading '%').
-// If that job was stopped, I send SIGCONT. Then I remove it from job_list and wait for it.
-// If it stops again (WIFSTOPPED), I re-add it as a stopped job. Otherwise I store its exit code.
-static void builtin_fg(char *arg) {
-    int jid;
-    if (arg == NULL) {
-        // no argument → pick most recent job
-        if (num_jobs == 0) {
-            fprintf(stderr, "fg: no current job\n");
-            return;
-        }
-        jid = job_list[num_jobs - 1].id;
+// I refill the buffer: already handed-out bytes are dropped, and the buffer doubles
+// if the current line does not fit. In interactive mode I wait in my event loop first,
+// so job notices and Ctrl-C/Z are handled while I sit at the prompt.
+static void reader_fill(line_reader_t *r) {
+    if (r->pos > 0) {
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos  = 0;
     }
-    else {
-        if (arg[0] == '%') arg++;
-        jid = atoi(arg);
-        if (jid == 0) {
-            fprintf(stderr, "fg: invalid job ID %s\n", arg);
+    if (r->len == r->cap) {
+        char *grown = realloc(r->buf, r->cap * 2);
+        if (grown == NULL) {
+            r->eof = 1;
             return;
         }
+        r->buf  = grown;
+        r->cap *= 2;
     }
-    int idx = find_job_by_id(jid);
-    if (idx < 0) {
-        fprintf(stderr, "fg: no such job %d\n", jid);
+    if (r->edit && edit_raw()) {
+        edit_line(r);
         return;
     }
-    job_t j = job_list[idx];
-
-    // if it was stopped, resume it
-    if (j.state == JOB_STOPPED) {
-        if (kill(j.pid, SIGCONT) < 0) {
-            perror("fg: kill (SIGCONT)");
-            return;
-        }
-    }
-
-    // remove it from job_list since it's going to run in foreground
-    remove_job_by_index(idx);
-
-    // print the command before blocking (like "sleep 20")
-    printf("%s\n", j.cmdline);
-    fflush(stdout);
-
-    // wait for it in foreground (allow catching Stop or exit)
-    fg_pid = j.pid;
-    int status;
-    if (waitpid(j.pid, &status, WUNTRACED) < 0) {
-        perror("waitpid");
-    }
-
-    // if it got stopped again, re-add as a stopped job
-    if (WIFSTOPPED(status)) {
-        if (num_jobs < MAX_JOBS) {
-            job_t *newj = &job_list[num_jobs++];
-            newj->id    = next_job_id++;
-            newj->pid   = j.pid;
-            newj->state = JOB_STOPPED;
-            strncpy(newj->cmdline, j.cmdline, MAX_CMD_BUFFER - 1);
-            newj->cmdline[MAX_CMD_BUFFER - 1] = '\0';
-            printf("\r[%d]  Stopped     %s\n", newj->id, newj->cmdline);
-            printf("icsh $ ");
-            fflush(stdout);
-            just_handled_stop = 1;
-        } else {
-            fprintf(stderr, "icsh: cannot re-add job %d (table is full)\n", j.id);
+    for (;;) {
+        if (r->interactive &&
+            !wait_for_events(r->fd, hist.pend_len ? HIST_SYNC_IDLE_MS : -1)) {
+            // a job changed state while I sat at the prompt, or the user has been idle
+            // long enough that I can write out the history
+            flush_job_notices(1);
+            history_sync();
+            continue;
         }
-    }
-    else {
-        // otherwise record its exit status
-        if (WIFEXITED(status)) {
-            last_status = WEXITSTATUS(status);
+        ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            r->eof = 1;
         } else {
-            last_status = 1;
+            r->len += n;
         }
+        return;
     }
-
-    fg_pid = -1;
 }
 
-// Built-in "bg": resume a stopped job in the background.
-// If arg is NULL, pick most recent job. Otherwise parse job ID (allow leading '%').
-// If the job is already running, I print an error. Otherwise I send SIGCONT,
-// set state to JOB_RUNNING, and print "[id] cmdline &".
-static void builtin_bg(char *arg) {
-    int jid;
-    if (arg == NULL) {
-        if (num_jobs == 0) {
-            fprintf(stderr, "bg: no current job\n");
-            return;
+// reader_next: I hand out the next line (without its "\n") as a view.
+// I return 0 when the input is used up.
+static int reader_next(line_reader_t *r, const char **line, size_t *len) {
+    for (;;) {
+        const char *base = r->map ? r->map : r->buf;
+        const char *nl   = memchr(base + r->pos, '\n', r->len - r->pos);
+        if (nl != NULL || (r->eof && r->pos < r->len)) {
+            size_t end = nl ? (size_t)(nl - base) : r->len;
+            *line  = base + r->pos;
+            *len   = end - r->pos;
+            r->pos = nl ? end + 1 : end;
+            return 1;
         }
-        jid = job_list[num_jobs - 1].id;
-    }
-    else {
-        if (arg[0] == '%') arg++;
-        jid = atoi(arg);
-        if (jid == 0) {
-            fprintf(stderr, "bg: invalid job ID %s\n", arg);
-            return;
+        if (r->eof) {
+            return 0;
         }
+        reader_fill(r);
     }
-    int idx = find_job_by_id(jid);
-    if (idx < 0) {
-        fprintf(stderr, "bg: no such job %d\n", jid);
-        return;
+}
+
+// read_heredocs: the bodies of a line's "<<DELIM" here-documents are the lines after
+// it, each up to a line that is exactly DELIM (or the end of the input). I copy them
+// into heredoc_text for build_stage(). Reading on can move a buffered reader's data
+// under *line, so I switch *line to the parse cache's copy and hand back the entry,
+// held so it stays put; the caller releases it after running the line.
+// I return 0 if the line has a syntax error (already reported).
+static int read_heredocs(line_reader_t *r, const char **line, size_t *len, ast_entry_t **held) {
+    *held           = NULL;
+    heredoc_len     = 0;
+    heredoc_nbodies = 0;
+    if (*len < 2 || memmem(*line, *len, "<<", 2) == NULL) {
+        return 1;
     }
-    job_t *j = &job_list[idx];
-    if (j->state == JOB_RUNNING) {
-        fprintf(stderr, "bg: job %d already running\n", j->id);
-        return;
+    ast_entry_t *e = ast_acquire(*line, *len);
+    if (e == NULL) {
+        last_status = 2;
+        return 0;
     }
-    // resume it in background
-    if (kill(j->pid, SIGCONT) < 0) {
-        perror("bg: kill (SIGCONT)");
-        return;
+    if (e->heredocs == NULL) {
+        ast_release(e);   // only here-strings
+        return 1;
     }
-    j->state = JOB_RUNNING;
-    printf("[%d] %s &\n", j->id, j->cmdline);
-    fflush(stdout);
+    *line = e->line;
+    *held = e;
+
+    arena_t scratch = { NULL };
+    for (redir_t *h = e->heredocs; h != NULL; h = h->hd_next) {
+        const char *delim = expand_word(&h->target, &scratch);   // quote removal only
+        size_t      dlen  = strlen(delim);
+        size_t      off   = heredoc_len;
+        const char *body;
+        size_t      blen;
+        for (;;) {
+            if (r->interactive) tty_cycle("> ");
+            if (!reader_next(r, &body, &blen)) break;
+            if (blen == dlen && memcmp(body, delim, dlen) == 0) break;
+            heredoc_append(body, blen);
+            heredoc_append("\n", 1);
+        }
+        heredoc_end_body(off);
+    }
+    arena_free(&scratch);
+    return 1;
 }
 
-// ────────────────────────────────────────────────────────────────────────────
-// Milestone 5: combination of built-ins, I/O redirection, history, and external commands
-// ────────────────────────────────────────────────────────────────────────────
+// read_complete: a line that opens a compound command ("while ...; do", "f() {" ...)
+// goes on over the next lines until the command is closed. I keep reading until the
+// text parses and hand all of it back as one command, which the parse cache then
+// holds as one AST, so a loop body is parsed once however often it runs. A mapped
+// script needs no copying, since its lines are contiguous in the mapping; otherwise
+// I join them in cont_buf. Text can only become complete on a line with a closing
+// word, so I parse again only then. I return 0 if the text has a syntax error (already
+// reported), including the input ending first.
+static char  *cont_buf = NULL;
+static size_t cont_cap = 0;
 
-// SIGINT handler: if I press Ctrl-C and a child is running, I send SIGINT to the child.
-// Otherwise I just reprint the prompt.
-static void handle_sigint_int(int sig) {
-    if (fg_pid > 0) {
-        printf("\n");
-        kill(fg_pid, SIGINT);
-    } else {
-        printf("\nicsh $ ");
-        fflush(stdout);
+static int cont_append(size_t at, const char *s, size_t n) {
+    if (at + n > cont_cap) {
+        size_t cap = cont_cap ? cont_cap : 4096;
+        while (cap < at + n) cap *= 2;
+        char *grown = realloc(cont_buf, cap);
+        if (grown == NULL) return -1;
+        cont_buf = grown;
+        cont_cap = cap;
     }
+    memcpy(cont_buf + at, s, n);
+    return 0;
 }
 
-// SIGTSTP handler: if I press Ctrl-Z and a child is running, I send SIGTSTP to the child.
-// Otherwise I just reprint prompt.
-static void handle_sigtstp_int(int sig) {
-    if (fg_pid > 0) {
-        printf("\n");
-        kill(fg_pid, SIGTSTP);
-    } else {
-        printf("\nicsh $ ");
-        fflush(stdout);
-    }
+// may_close: only a line with one of these can finish an open compound command or
+// "( ... )" subshell, so only then is it worth parsing again.
+static int may_close(const char *s, size_t n) {
+    return memmem(s, n, "done", 4) || memmem(s, n, "fi", 2) || memchr(s, '}', n) ||
+           memchr(s, ')', n);
 }
 
-// handleHistory: if I type "!!", I replace buffer with last_cmd (and print it).
-// If buffer is anything else non-empty, I copy it into last_cmd.
-static int handleHistory(char buffer[], char last_cmd[]) {
-    if (strcmp(buffer, "!!") == 0) {
-        if (strlen(last_cmd) == 0) {
-            // if there was no previous command, I do nothing
-            return 0;
-        }
-        printf("%s\n", last_cmd);
-        strcpy(buffer, last_cmd);
+static int read_complete(line_reader_t *r, const char **line, size_t *len) {
+    ast_want_more = 1;
+    ast_entry_t *e = ast_acquire(*line, *len);
+    ast_want_more = 0;
+    if (e != NULL) {
+        ast_release(e);
+        return 1;
     }
-    else if (strlen(buffer) > 0) {
-        // store this line as last_cmd
-        strncpy(last_cmd, buffer, MAX_CMD_BUFFER - 1);
-        last_cmd[MAX_CMD_BUFFER - 1] = '\0';
+    if (!ast_incomplete) {
+        last_status = 2;
+        return 0;
     }
-    return 1;
-}
 
-// runCmd: this is where I parse a line, handle background (&), built-ins (jobs, fg, bg, echo, exit),
-// I/O redirection (< and >), and then fork/exec external commands.
-void runCmd(char last_cmd[], char buffer[]) {
-    // 1) Check for trailing '&' → background flag
-    int background = 0;
-    {
-        size_t len = strlen(buffer);
-        if (len > 0 && buffer[len - 1] == '&') {
-            background = 1;
-            // remove the '&' from buffer
-            buffer[len - 1] = '\0';
-            // trim spaces before the '&'
-            while (len > 1 && buffer[len - 2] == ' ') {
-                buffer[len - 2] = '\0';
-                len--;
-            }
+    // the line reader_next() just handed out of a mapped script runs on into the lines
+    // after it, so the whole command is one view. Any other line, like a history
+    // expansion (which may point at an earlier line of the same map), is put
+    // together in cont_buf.
+    const char *start  = *line;
+    size_t      n      = *len;
+    const char *tail   = r->map != NULL ? r->map + r->pos : NULL;
+    int         in_map = tail != NULL && start >= r->map &&
+                         (start + n == tail || start + n + 1 == tail);
+    if (!in_map && cont_append(0, start, n) < 0) return 0;
+    for (;;) {
+        const char *next;
+        size_t      nlen;
+        if (r->interactive) tty_cycle("> ");
+        if (!reader_next(r, &next, &nlen)) {
+            fprintf(stderr, "icsh: syntax error: unexpected end of file\n");
+            last_status = 2;
+            return 0;
         }
-    }
+        if (in_map) {
+            n = next + nlen - start;
+        } else {
+            if (cont_append(n, "\n", 1) < 0 || cont_append(n + 1, next, nlen) < 0) return 0;
+            n += 1 + nlen;
+        }
+        if (!may_close(next, nlen)) continue;
 
-    // 2) Copy the full (possibly-stripped) buffer into jobcmd[] so I remember the original
-    //    for background job printing later.
-    char jobcmd[MAX_CMD_BUFFER];
-    strncpy(jobcmd, buffer, MAX_CMD_BUFFER - 1);
-    jobcmd[MAX_CMD_BUFFER - 1] = '\0';
+        const char *text = in_map ? start : cont_buf;
+        ast_want_more = 1;
+        e = ast_acquire(text, n);
+        ast_want_more = 0;
+        if (e != NULL) {
+            ast_release(e);
+            *line = text;
+            *len  = n;
+            return 1;
+        }
+        if (!ast_incomplete) {
+            last_status = 2;
+            return 0;
+        }
+    }
+}
 
-    // 3) Tokenize buffer by spaces, looking for "<" and ">" to set infile/outfile.
-    char *tokens[MAX_ARGS];
-    char *infile = NULL;
-    char *outfile = NULL;
-    int   ntok = 0;
+// interactiveMode: I print "Starting IC shell", then loop reading lines.
+// I expand history ("!!", "!n", ...), then call runCmd() on each line.
+void interactiveMode() {
+    line_reader_t reader;
+    const char   *line;
+    size_t        len;
 
-    // first token is the command
-    char *cmd = strtok(buffer, " ");
-    if (cmd == NULL) {
-        // blank line or just "&"
+    // On a terminal I turn on job control: every pipeline gets its own process group
+    // and I hand it the terminal while it runs.
+    init_job_control();
+    if (reader_open(&reader, STDIN_FILENO, 1) < 0) {
+        perror("icsh");
         return;
     }
-    tokens[ntok++] = cmd;
+    const char *edit = getenv("ICSH_EDIT"), *term = getenv("TERM");
+    reader.edit = job_control && !(edit != NULL && strcmp(edit, "0") == 0) &&
+                  !(term != NULL && strcmp(term, "dumb") == 0);
+    if (isatty(STDIN_FILENO)) history_open();
+    input_attach(&reader);
 
-    // parse the rest of the tokens
-    char *t = strtok(NULL, " ");
-    while (t != NULL && ntok < MAX_ARGS - 1) {
-        if (strcmp(t, "<") == 0) {
-            t = strtok(NULL, " ");
-            if (t != NULL) {
-                infile = t;
-            }
+    tty_put(&tty_out, "Starting IC shell\n", 18);
+    while (1) {
+        // output and jobs that changed state while the last command ran go out with
+        // the prompt
+        if (reader.edit) edit_raw();
+        prompt();
+
+        if (!reader_next(&reader, &line, &len)) {
+            break;  // EOF (Ctrl-D), exit loop
         }
-        else if (strcmp(t, ">") == 0) {
-            t = strtok(NULL, " ");
-            if (t != NULL) {
-                outfile = t;
-            }
+
+        if (!handleHistory(&line, &len, 0)) {
+            continue;
         }
-        else {
-            tokens[ntok++] = t;
+        if (!read_complete(&reader, &line, &len)) {
+            continue;
+        }
+        ast_entry_t *held;
+        if (!read_heredocs(&reader, &line, &len, &held)) {
+            continue;
         }
-        t = strtok(NULL, " ");
+        runCmd(line, len);
+        if (held != NULL) ast_release(held);
     }
-    tokens[ntok] = NULL;
+    input_reader = NULL;
+    if (input_fd >= 0) close(input_fd);
+    reader_close(&reader);
+}
 
-    // 4) Check Milestone 6 built-ins: jobs, fg, bg
-    if (strcmp(cmd, "jobs") == 0) {
-        builtin_jobs();
-        return;
-    }
-    if (strcmp(cmd, "fg") == 0) {
-        if (tokens[1] != NULL) builtin_fg(tokens[1]);
-        else                  builtin_fg(NULL);
+// scriptMode: similar to interactive, but I read commands from a file instead of stdin.
+// A regular file is mapped, so lines (and "!!") are views into it and nothing is copied.
+void scriptMode(const char *filename) {
+    line_reader_t reader;
+    const char   *line;
+    size_t        len;
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || reader_open(&reader, fd, 0) < 0) {
+        tty_put(&tty_out, "Could not open the file.\n", 25);
+        if (fd >= 0) close(fd);
         return;
     }
-    if (strcmp(cmd, "bg") == 0) {
-        if (tokens[1] != NULL) builtin_bg(tokens[1]);
-        else                  builtin_bg(NULL);
-        return;
+    int stable = (reader.map != NULL);
+    int to_tty = isatty(STDOUT_FILENO);
+    while (reader_next(&reader, &line, &len)) {
+        if (!handleHistory(&line, &len, stable)) continue;
+        if (!read_complete(&reader, &line, &len)) continue;
+        ast_entry_t *held;
+        if (!read_heredocs(&reader, &line, &len, &held)) continue;
+        runCmd(line, len);
+        if (held != NULL) ast_release(held);
+
+        // pick up background jobs that finished meanwhile, without waiting
+        wait_for_events(-1, 0);
+        flush_job_notices(1);
+        // on a terminal each line's output shows up now; into a file or a pipe it is
+        // batched with the lines after it
+        if (to_tty) tty_sync();
     }
+    reader_close(&reader);
+    close(fd);
+}
 
-    // 5) "echo" and "exit" are built-ins too, but they run in the parent with I/O redirection handled here.
-    int is_echo = (strcmp(cmd, "echo") == 0);
-    int is_exit = (strcmp(cmd, "exit") == 0);
+// ────────────────────────────────────────────────────────────────────────────
+// Parallel script mode: icsh -j N script
+// ────────────────────────────────────────────────────────────────────────────
 
-    if (is_echo || is_exit) {
-        int saved_in  = -1;
-        int saved_out = -1;
+// Every script line is a unit. Up to N units run at the same time, each in a forked
+// copy of me whose stdout and stderr go into a pipe. I collect that output in memory
+// and print it in script order once the unit is done, so nothing interleaves. A "wait"
+// line is a barrier, and lines that change the shell itself (exit, fg, bg, hash,
+// coproc, variables, function definitions) run here in the shell once everything
+// before them has finished. "a && b" is one line and so one unit, which keeps its
+// order, and so is a whole loop. Workers are ordinary entries in job_list[], so
+// "jobs" shows what is running.
+typedef struct {
+    pid_t      pid;
+    int        out_fd;       // read end of the unit's output pipe, -1 after EOF
+    char      *out;          // everything the unit printed so far
+    size_t     out_len;
+    size_t     out_cap;
+    int        exited;
+    int        status;       // its exit status, which becomes mine when it is printed
+    long long  start_ns;
+    long long  end_ns;
+} punit_t;
 
-        // if they requested input redirection, I dup/redirect stdin
-        if (infile != NULL) {
-            saved_in = dup(STDIN_FILENO);
-            int fd = open(infile, O_RDONLY);
-            if (fd < 0) {
-                perror("open input");
-                goto restore_fds;
-            }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
-        }
-        // if they requested output redirection, I dup/redirect stdout
-        if (outfile != NULL) {
-            saved_out = dup(STDOUT_FILENO);
-            int fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd < 0) {
-                perror("open output");
-                goto restore_fds;
-            }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
+// Units started but not printed yet sit in a ring of win_size slots; unit number k is
+// in win[k % win_size].
+static struct {
+    punit_t   *win;
+    int        win_size;
+    long long  started;
+    long long  printed;
+    int        running;
+    int        max_jobs;
+    long long  serial_ns;    // sum of every unit's own wall time
+} pool;
+
+// on_done hook for a worker's job entry: reap_children() calls it when the worker exits.
+static void unit_done(job_t *j, int status) {
+    punit_t *u = j->on_done_arg;
+    u->exited = 1;
+    u->end_ns = now_ns();
+    u->status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    pool.running--;
+}
+
+// pool_pump: one round of my -j event loop. I poll the signalfd and every unit's pipe,
+// read whatever output is there, and then print finished units in script order. Their
+// statuses are taken in that order too, so mine ends up as the last line's, whatever
+// order the units finished in.
+static void pool_pump(int block) {
+    struct pollfd pfd[pool.win_size + 1];
+    int           who[pool.win_size + 1];
+    int           n = 0;
+    pfd[n].fd     = sig_fd;
+    pfd[n].events = POLLIN;
+    who[n++]      = -1;
+    for (long long k = pool.printed; k < pool.started; k++) {
+        punit_t *u = &pool.win[k % pool.win_size];
+        if (u->out_fd >= 0) {
+            pfd[n].fd     = u->out_fd;
+            pfd[n].events = POLLIN;
+            who[n++]      = (int)(k % pool.win_size);
         }
+    }
 
-        if (is_echo) {
-            // handle "echo $?" or just echo arguments
-            char **args = tokens + 1;
-            if (args[0] && strcmp(args[0], "$?") == 0) {
-                printf("%d\n", last_status);
-            } else {
-                int i = 0;
-                while (args[i]) {
-                    printf("%s", args[i]);
-                    if (args[i+1]) printf(" ");
-                    i++;
-                }
-                printf("\n");
-            }
+    if (poll(pfd, n, block ? -1 : 0) > 0) {
+        if (pfd[0].revents & POLLIN) {
+            handle_signal_events();
         }
-        else {  // exit built-in
-            int code = 0;
-            if (tokens[1]) {
-                code = atoi(tokens[1]) & 0xFF;
+        for (int i = 1; i < n; i++) {
+            if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            punit_t *u = &pool.win[who[i]];
+            if (u->out_len == u->out_cap) {
+                size_t cap  = u->out_cap ? u->out_cap * 2 : 4096;
+                char  *grown = realloc(u->out, cap);
+                if (grown == NULL) continue;
+                u->out     = grown;
+                u->out_cap = cap;
+            }
+            ssize_t got = read(u->out_fd, u->out + u->out_len, u->out_cap - u->out_len);
+            if (got > 0) {
+                u->out_len += got;
+            } else if (got == 0 || errno != EINTR) {
+                close(u->out_fd);
+                u->out_fd = -1;
             }
-            printf("bye\n");
-            exit(code);
         }
+    }
 
-    restore_fds:
-        // restore stdout if I changed it
-        if (saved_out != -1) {
-            dup2(saved_out, STDOUT_FILENO);
-            close(saved_out);
-        }
-        // restore stdin if I changed it
-        if (saved_in != -1) {
-            dup2(saved_in, STDIN_FILENO);
-            close(saved_in);
+    while (pool.printed < pool.started) {
+        punit_t *u = &pool.win[pool.printed % pool.win_size];
+        if (!u->exited || u->out_fd >= 0) break;
+        tty_sync();
+        for (size_t off = 0; off < u->out_len; ) {
+            ssize_t w = write(STDOUT_FILENO, u->out + off, u->out_len - off);
+            if (w <= 0) break;
+            off += w;
         }
-        return;
+        pool.serial_ns += u->end_ns - u->start_ns;
+        last_status     = u->status;
+        free(u->out);
+        pool.printed++;
+    }
+}
+
+// pool_start: I start one line as a worker, waiting first if N are already running
+// or the ring is full of units that cannot be printed yet.
+static void pool_start(const char *line, size_t len) {
+    while (pool.running >= pool.max_jobs || pool.started - pool.printed >= pool.win_size) {
+        pool_pump(1);
     }
+    punit_t *u = &pool.win[pool.started % pool.win_size];
+    memset(u, 0, sizeof(*u));
 
-    // 6) Otherwise, I must run an external command: I fork, handle redirection in the child, then execvp.
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return;
+    }
+    tty_sync();
     pid_t pid = fork();
     if (pid < 0) {
         perror("failed to fork");
-        last_status = 1;
+        close(p[0]);
+        close(p[1]);
         return;
     }
     if (pid == 0) {
-        // child process: apply infile/outfile if requested
-        if (infile != NULL) {
-            int fd = open(infile, O_RDONLY);
-            if (fd < 0) {
-                perror("open input");
-                exit(1);
-            }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
-        }
-        if (outfile != NULL) {
-            int fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd < 0) {
-                perror("open output");
-                exit(1);
-            }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-        }
-        // now execute the command
-        execvp(tokens[0], tokens);
-        perror("failed to execute");
-        exit(1);
+        dup2(p[1], STDOUT_FILENO);
+        dup2(p[1], STDERR_FILENO);
+        job_control = 0;
+        deadlines_forget();
+        joblogs_forget();
+        trace_forget();
+        runCmd(line, len);
+        tty_sync();
+        trace_drain();
+        _exit(last_status);
     }
-    else {
-        // parent process:
-        if (background) {
-            // if user said "&", I add it to my job list and return without waiting
-            add_job(pid, jobcmd);
-            return;
-        }
+    close(p[1]);
+    u->pid      = pid;
+    u->out_fd   = p[0];
+    u->start_ns = now_ns();
 
-        // otherwise this is a foreground command: wait for it, but allow it to stop (WUNTRACED)
-        fg_pid = pid;
-        int status;
-        if (waitpid(pid, &status, WUNTRACED) < 0) {
-            perror("waitpid");
-        }
-        fg_pid = -1;
+    job_t j;
+    memset(&j, 0, sizeof(j));
+    j.pids[0]     = pid;
+    j.npids       = 1;
+    j.nlive       = 1;
+    j.last_pid    = pid;
+    j.cmdline     = strndup(line, len);
+    j.start_ns    = u->start_ns;
+    j.on_done     = unit_done;
+    j.on_done_arg = u;
+    add_job_entry(&j, JOB_RUNNING);
+    pool.running++;
+    pool.started++;
+}
+
+// pool_drain: a barrier. I wait until every started unit is done and printed.
+static void pool_drain(void) {
+    while (pool.printed < pool.started) {
+        pool_pump(1);
+    }
+}
+
+static void pool_report(long long wall_ns) {
+    double wall   = wall_ns / 1e9;
+    double serial = pool.serial_ns / 1e9;
+    fprintf(stderr, "icsh: -j %d: %lld commands, wall %.3fs, serial %.3fs (%.2fx)\n",
+            pool.max_jobs, pool.started, wall, serial, wall > 0 ? serial / wall : 0.0);
+}
 
-        // if it got stopped by Ctrl-Z, re-add as a stopped job
-        if (WIFSTOPPED(status)) {
-            if (num_jobs < MAX_JOBS) {
-                job_t *newj = &job_list[num_jobs++];
-                newj->id    = next_job_id++;
-                newj->pid   = pid;
-                newj->state = JOB_STOPPED;
-                strncpy(newj->cmdline, jobcmd, MAX_CMD_BUFFER - 1);
-                newj->cmdline[MAX_CMD_BUFFER - 1] = '\0';
+// If the line is one simple command, I return its command word as written, else NULL.
+static const char *simple_command_name(const node_t *root) {
+    if (root == NULL || root->kind != NODE_CMD || root->cmd.nwords == 0) {
+        return NULL;
+    }
+    return root->cmd.words[0].text;
+}
 
-                // overwrite prompt, print "[id]  Stopped  cmdline", then reprint prompt
-                printf("\r[%d]  Stopped     %s\n", newj->id, newj->cmdline);
-                printf("icsh $ ");
-                fflush(stdout);
+// parallelScriptMode: like scriptMode, but lines run on a pool of max_jobs workers.
+void parallelScriptMode(const char *filename, int max_jobs) {
+    line_reader_t reader;
+    const char   *line;
+    size_t        len;
 
-                just_handled_stop = 1;
-            } else {
-                fprintf(stderr, "icsh: cannot add stopped job (max %d)\n", MAX_JOBS);
-            }
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || reader_open(&reader, fd, 0) < 0) {
+        tty_put(&tty_out, "Could not open the file.\n", 25);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    pool.max_jobs = max_jobs;
+    pool.win_size = 4 * max_jobs;
+    pool.win      = calloc(pool.win_size, sizeof(punit_t));
+    if (pool.win == NULL) {
+        perror("icsh");
+        reader_close(&reader);
+        close(fd);
+        last_status = 1;
+        return;
+    }
+
+    int       stable = (reader.map != NULL);
+    long long t0     = now_ns();
+    while (reader_next(&reader, &line, &len)) {
+        if (!handleHistory(&line, &len, stable)) continue;
+        if (!read_complete(&reader, &line, &len)) continue;
+        ast_entry_t *held;
+        if (!read_heredocs(&reader, &line, &len, &held)) continue;
+
+        ast_entry_t *e = ast_acquire(line, len);
+        if (e == NULL) continue;   // syntax error, already reported
+        const char *name = simple_command_name(e->root);
+        int         blank = (e->root == NULL);
+        int         defn  = (e->root != NULL && e->root->kind == NODE_FUNC);
+        int         assigns = (name != NULL && is_assignment(&e->root->cmd.words[0]));
+        ast_release(e);
+        if (blank) continue;
+
+        if (name != NULL && strcmp(name, "wait") == 0) {
+            pool_drain();
+        }
+        else if (name != NULL && strcmp(name, "jobs") == 0) {
+            // just a look at the table, no need to wait for anything
+            runCmd(line, len);
+        }
+        else if (defn || assigns ||
+                 (name != NULL && builtin_find(name) != NULL &&
+                  (builtin_find(name)->flags & BI_SHELL))) {
+            // variables and functions live in this process, and every later line must
+            // see them
+            pool_drain();
+            if (name != NULL && strcmp(name, "exit") == 0) pool_report(now_ns() - t0);
+            runCmd(line, len);
         }
         else {
-            // if it exited normally or by signal, record its exit code
-            if (WIFEXITED(status)) {
-                last_status = WEXITSTATUS(status);
-            } else {
-                last_status = 1;
-            }
+            pool_start(line, len);
         }
+        pool_pump(0);
+        if (held != NULL) ast_release(held);
     }
-}
+    pool_drain();
+    pool_report(now_ns() - t0);
 
-// I always call this to print my prompt "icsh $ ".
-static void prompt() {
-    printf("icsh $ ");
-    fflush(stdout);
+    free(pool.win);
+    reader_close(&reader);
+    close(fd);
 }
 
-// interactiveMode: I print "Starting IC shell", then loop reading lines.
-// I handle "!!" history, then call runCmd() on each line.
-void interactiveMode() {
-    char buffer[MAX_CMD_BUFFER];
-    char last_cmd[MAX_CMD_BUFFER] = "";
+// worker_mode: "icsh --worker", the other end of "coproc -f". I read one script line
+// per request from stdin and answer "<status> <length>\n" plus everything the line
+// printed (stdout and stderr). Output goes into a memfd that I send back with
+// sendfile() and then truncate for the next request. Commands get /dev/null as stdin,
+// so they cannot eat the requests that follow.
+static int worker_mode(void) {
+    line_reader_t reader;
+    const char   *line;
+    size_t        len;
 
-    printf("Starting IC shell\n");
-    while (1) {
-        // if runCmd already printed a prompt after a stop, skip printing
-        if (just_handled_stop) {
-            just_handled_stop = 0;
-        } else {
-            prompt();
+    int req_fd  = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+    int resp_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    int out_fd  = memfd_create("icsh-worker", MFD_CLOEXEC);
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (req_fd < 0 || resp_fd < 0 || out_fd < 0 || null_fd < 0 ||
+        reader_open(&reader, req_fd, 0) < 0) {
+        perror("icsh --worker");
+        return 1;
+    }
+    dup2(null_fd, STDIN_FILENO);
+    dup2(out_fd, STDOUT_FILENO);
+    dup2(out_fd, STDERR_FILENO);
+    close(null_fd);
+
+    while (reader_next(&reader, &line, &len)) {
+        runCmd(line, len);
+        tty_sync();
+        fflush(stderr);
+        wait_for_events(-1, 0);   // reap anything the line left in the background
+
+        off_t body = lseek(out_fd, 0, SEEK_END);
+        char  head[48];
+        int   hlen = snprintf(head, sizeof(head), "%d %lld\n", last_status, (long long)body);
+        if (write(resp_fd, head, hlen) != hlen) break;
+        off_t off = 0;
+        while (off < body) {
+            ssize_t n = sendfile(resp_fd, out_fd, &off, body - off);
+            if (n <= 0) break;
         }
+        if (ftruncate(out_fd, 0) < 0 || lseek(out_fd, 0, SEEK_SET) < 0) break;
+    }
+    reader_close(&reader);
+    return 0;
+}
 
-        if (fgets(buffer, MAX_CMD_BUFFER, stdin) == NULL) {
-            break;  // EOF (Ctrl-D), exit loop
+// parse_bench: "icsh --parse-bench corpus [iterations]" parses every line of the corpus
+// over and over and reports lines/sec, first with a fresh parse each time, then through
+// the parse cache (what script loops and "!!" get).
+static int parse_bench(const char *corpus, int iters) {
+    int fd = open(corpus, O_RDONLY | O_CLOEXEC);
+    line_reader_t reader;
+    if (fd < 0 || reader_open(&reader, fd, 0) < 0) {
+        perror(corpus);
+        return 1;
+    }
+    const char **lines = NULL;
+    size_t      *lens  = NULL;
+    size_t       n = 0, cap = 0;
+    const char  *line;
+    size_t       len;
+    while (reader_next(&reader, &line, &len)) {
+        if (n == cap) {
+            cap   = cap ? cap * 2 : 64;
+            lines = realloc(lines, cap * sizeof(*lines));
+            lens  = realloc(lens, cap * sizeof(*lens));
         }
-        buffer[strcspn(buffer, "\n")] = '\0';
+        // views from a mapped file stay valid; a pipe's buffer does not, so I copy those
+        lines[n] = reader.map ? line : strndup(line, len);
+        lens[n]  = len;
+        n++;
+    }
 
-        if (!handleHistory(buffer, last_cmd)) {
-            continue;
+    long long start = now_ns();
+    for (int it = 0; it < iters; it++) {
+        for (size_t i = 0; i < n; i++) {
+            arena_t     arena = { NULL };
+            const char *error;
+            redir_t    *heredocs;
+            parse_text(lines[i], lens[i], &arena, &error, &heredocs, NULL);
+            arena_free(&arena);
         }
-        runCmd(last_cmd, buffer);
     }
-}
+    long long parse_ns = now_ns() - start;
 
-// scriptMode: similar to interactive, but I read commands from a file instead of stdin.
-void scriptMode(const char *filename) {
-    char buffer[MAX_CMD_BUFFER];
-    char last_cmd[MAX_CMD_BUFFER] = "";
-    FILE *input = fopen(filename, "r");
-    if (!input) {
-        printf("Could not open the file.\n");
-        return;
+    start = now_ns();
+    for (int it = 0; it < iters; it++) {
+        for (size_t i = 0; i < n; i++) {
+            ast_entry_t *e = ast_acquire(lines[i], lens[i]);
+            if (e != NULL) ast_release(e);
+        }
     }
-    while (fgets(buffer, MAX_CMD_BUFFER, input) != NULL) {
-        buffer[strcspn(buffer, "\n")] = '\0';
-        if (!handleHistory(buffer, last_cmd)) continue;
-        runCmd(last_cmd, buffer);
+    long long cached_ns = now_ns() - start;
+
+    double total = (double)n * iters;
+    printf("corpus: %zu lines x %d iterations\n", n, iters);
+    printf("parse:  %.0f lines/sec\n", total * 1e9 / (parse_ns ? parse_ns : 1));
+    printf("cached: %.0f lines/sec\n", total * 1e9 / (cached_ns ? cached_ns : 1));
+
+    if (reader.map == NULL) {
+        for (size_t i = 0; i < n; i++) free((char *)lines[i]);
     }
-    fclose(input);
+    free(lines);
+    free(lens);
+    reader_close(&reader);
+    close(fd);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
-    // I install the SIGINT and SIGTSTP handlers so my shell isn't killed or suspended by Ctrl-C/Z.
-    signal(SIGINT,  handle_sigint_int);
-    signal(SIGTSTP, handle_sigtstp_int);
+    // I block SIGCHLD, SIGINT and SIGTSTP and read them from a signalfd in my main loop
+    // instead of installing handlers. Ctrl-C/Z still don't kill or suspend me, and job
+    // changes are reaped by reap_children() between commands.
+    sigset_t ev_mask;
+    sigemptyset(&ev_mask);
+    sigaddset(&ev_mask, SIGCHLD);
+    sigaddset(&ev_mask, SIGINT);
+    sigaddset(&ev_mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &ev_mask, NULL);
+    sig_fd = signalfd(-1, &ev_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd < 0) {
+        perror("signalfd");
+        return 1;
+    }
+
+    // Output I queued (see tty_out) is written out however I exit, and before any
+    // diagnostic.
+    atexit(tty_sync);
+    stderr_hook();
+
+    // Feeding a pipe whose reader is gone must not kill me; vmsplice/splice get EPIPE instead.
+    signal(SIGPIPE, SIG_IGN);
+
+    // My variables start as a copy of my environment, all exported.
+    vars_init();
 
-    // I install the SIGCHLD handler so I can track background job changes.
-    struct sigaction sa_chld;
-    sa_chld.sa_handler = handle_sigchld;
-    sigemptyset(&sa_chld.sa_mask);
-    sa_chld.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    sigaction(SIGCHLD, &sa_chld, NULL);
+    // I decide once whether external commands go through posix_spawn or fork.
+    init_launcher();
+
+    // "--parse-bench corpus [iterations]" only measures my parser.
+    if (argc >= 3 && strcmp(argv[1], "--parse-bench") == 0) {
+        return parse_bench(argv[2], argc >= 4 ? atoi(argv[3]) : 10000);
+    }
+
+    // "--worker" is the far end of "coproc -f": framed requests on stdin.
+    if (argc == 2 && strcmp(argv[1], "--worker") == 0) {
+        return worker_mode();
+    }
+
+    // ICSH_TRACE: time every phase of every command (not in the modes above).
+    trace_init();
+
+    // "-j N script" runs the script's lines in parallel on N workers.
+    if (argc == 4 && strcmp(argv[1], "-j") == 0) {
+        int n = atoi(argv[2]);
+        if (n < 1) {
+            fprintf(stderr, "icsh: -j needs a positive number\n");
+            return 2;
+        }
+        parallelScriptMode(argv[3], n);
+        return last_status;
+    }
 
     // If there’s a script file argument, run in script mode; otherwise interactive.
-    if (argc == 2) {
+    // Any further arguments are the script's $1, $2 ...
+    if (argc >= 2) {
+        pos_zero  = argv[1];
+        pos_args  = argv + 2;
+        pos_count = argc - 2;
         scriptMode(argv[1]);
     } else {
         interactiveMode();
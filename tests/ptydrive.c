@@ -0,0 +1,352 @@
+/* ptydrive: runs a program on a pseudo-terminal and plays a step file against it,
+ * so interactive and job-control behaviour of icsh can be tested and timed.
+ *
+ * Usage: tests/ptydrive [-n name] steps.pty program [args...]
+ *
+ * One step per line; blank lines and lines starting with '#' are skipped. TEXT
+ * takes C escapes: \n \r \t \\ \e and \xHH (so \x03 is Ctrl-C, \x1a is Ctrl-Z,
+ * \x04 is Ctrl-D).
+ *   send TEXT       write TEXT to the terminal
+ *   expect TEXT     wait until TEXT appears in the output after the last match
+ *   reject TEXT     fail if TEXT appeared since the last match
+ *   timeout MS      how long expect and status wait (default 5000)
+ *   sleep MS        pause
+ *   mark            start the stopwatch
+ *   lap NAME        time since mark goes into NAME (count, mean, median, min, max)
+ *   repeat N ... end   run the steps in between N times (nesting works)
+ *   status N        wait for the program to exit with status N
+ *
+ * I print one JSON object on stdout: the test name, whether it passed, its wall
+ * time, the laps and, on failure, the reason. The last of the output goes to
+ * stderr on failure, so a broken test shows what the shell said.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define MAX_LAPS  16
+#define MAX_DEPTH 8
+
+typedef struct {
+    char    name[32];
+    long    n, cap;
+    double  sum, min, max;
+    double *v;   // every sample, for the median
+} lap_t;
+
+static int    master = -1;
+static pid_t  child  = -1;
+static int    exited = 0, exit_status = 0;
+static char  *out    = NULL;   // everything the program printed
+static size_t out_len = 0, out_cap = 0;
+static size_t cursor  = 0;     // where the next expect starts looking
+static lap_t  laps[MAX_LAPS];
+static int    nlaps   = 0;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// unescape: I decode TEXT in place and return its length.
+static size_t unescape(char *s) {
+    char *start = s, *d = s;
+    while (*s) {
+        if (*s != '\\' || s[1] == '\0') {
+            *d++ = *s++;
+            continue;
+        }
+        s++;
+        switch (*s) {
+            case 'n': *d++ = '\n'; s++; break;
+            case 'r': *d++ = '\r'; s++; break;
+            case 't': *d++ = '\t'; s++; break;
+            case 'e': *d++ = 27;   s++; break;
+            case 'x': {
+                char hex[3] = { s[1], s[1] ? s[2] : '\0', '\0' };
+                *d++ = (char)strtol(hex, NULL, 16);
+                s += 1 + strlen(hex);
+                break;
+            }
+            default:  *d++ = *s++; break;
+        }
+    }
+    *d = '\0';
+    return d - start;
+}
+
+// pump: I read whatever the program has written, waiting at most ms for some. I
+// return 1 if I read something, 0 if there was nothing, -1 once the terminal is closed.
+static int pump(int ms) {
+    struct pollfd pfd = { .fd = master, .events = POLLIN };
+    int r = poll(&pfd, 1, ms);
+    if (r <= 0) return 0;
+    if (out_len + 4096 > out_cap) {
+        out_cap = out_cap ? out_cap * 2 : 65536;
+        out     = realloc(out, out_cap);
+        if (out == NULL) exit(2);
+    }
+    ssize_t n = read(master, out + out_len, out_cap - out_len - 1);
+    if (n < 0 && errno == EINTR) return 0;
+    if (n <= 0) return -1;   // EIO: every slave fd is closed
+    out_len += n;
+    out[out_len] = '\0';
+    return 1;
+}
+
+static void reap(int options) {
+    int status;
+    if (!exited && waitpid(child, &status, options) == child) {
+        exited      = 1;
+        exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+}
+
+static void send_text(const char *s, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(master, s, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return;
+        s += w;
+        n -= w;
+    }
+}
+
+// expect: I wait until text (len bytes) shows up after the cursor.
+static int expect(const char *text, size_t len, int timeout_ms) {
+    double deadline = now_ms() + timeout_ms;
+    for (;;) {
+        if (out_len >= cursor + len) {
+            char *hit = memmem(out + cursor, out_len - cursor, text, len);
+            if (hit != NULL) {
+                cursor = hit - out + len;
+                return 1;
+            }
+        }
+        double left = deadline - now_ms();
+        if (left <= 0) return 0;
+        if (pump(left < 50 ? (int)left + 1 : 50) < 0) return 0;
+    }
+}
+
+static lap_t *lap_find(const char *name) {
+    for (int i = 0; i < nlaps; i++) {
+        if (strcmp(laps[i].name, name) == 0) return &laps[i];
+    }
+    if (nlaps == MAX_LAPS) return NULL;
+    lap_t *l = &laps[nlaps++];
+    snprintf(l->name, sizeof(l->name), "%s", name);
+    return l;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void json_string(const char *s, size_t n) {
+    putchar('"');
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') printf("\\%c", c);
+        else if (c < 0x20)        printf("\\u%04x", c);
+        else                      putchar(c);
+    }
+    putchar('"');
+}
+
+int main(int argc, char **argv) {
+    const char *name = NULL;
+    int argi = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        name = argv[2];
+        argi = 3;
+    }
+    if (argc - argi < 2) {
+        fprintf(stderr, "usage: ptydrive [-n name] steps.pty program [args...]\n");
+        return 2;
+    }
+    const char *steps_path = argv[argi];
+    if (name == NULL) {
+        const char *slash = strrchr(steps_path, '/');
+        name = slash ? slash + 1 : steps_path;
+    }
+
+    // the whole step file, split into lines
+    FILE *f = fopen(steps_path, "r");
+    if (f == NULL) {
+        perror(steps_path);
+        return 2;
+    }
+    char  **lines  = NULL;
+    int     nlines = 0, cap = 0;
+    char   *line   = NULL;
+    size_t  lcap   = 0;
+    ssize_t n;
+    while ((n = getline(&line, &lcap, f)) >= 0) {
+        if (n > 0 && line[n - 1] == '\n') line[--n] = '\0';
+        if (nlines == cap) {
+            cap   = cap ? cap * 2 : 64;
+            lines = realloc(lines, cap * sizeof(char *));
+        }
+        lines[nlines++] = strdup(line);
+    }
+    free(line);
+    fclose(f);
+
+    struct winsize ws = { .ws_row = 24, .ws_col = 120 };
+    child = forkpty(&master, NULL, NULL, &ws);
+    if (child < 0) {
+        perror("forkpty");
+        return 2;
+    }
+    if (child == 0) {
+        execv(argv[argi + 1], argv + argi + 1);
+        perror(argv[argi + 1]);
+        _exit(127);
+    }
+
+    int         timeout_ms = 5000;
+    double      t0 = now_ms(), mark = t0;
+    const char *error = NULL;
+    char        why[256];
+    int         loop_pc[MAX_DEPTH], loop_left[MAX_DEPTH], depth = 0;
+
+    for (int pc = 0; pc < nlines && error == NULL; pc++) {
+        char *cmd = lines[pc];
+        while (*cmd == ' ' || *cmd == '\t') cmd++;
+        if (*cmd == '\0' || *cmd == '#') continue;
+        char *arg = strchr(cmd, ' ');
+        size_t clen = arg ? (size_t)(arg - cmd) : strlen(cmd);
+        arg = arg ? arg + 1 : cmd + clen;
+
+        char text[4096];
+        snprintf(text, sizeof(text), "%s", arg);
+        size_t tlen = unescape(text);
+
+        while (pump(0) > 0) {}
+        if (clen == 4 && strncmp(cmd, "send", 4) == 0) {
+            send_text(text, tlen);
+        } else if (clen == 6 && strncmp(cmd, "expect", 6) == 0) {
+            if (!expect(text, tlen, timeout_ms)) {
+                snprintf(why, sizeof(why), "line %d: expected \"%s\"", pc + 1, arg);
+                error = why;
+            }
+        } else if (clen == 6 && strncmp(cmd, "reject", 6) == 0) {
+            while (pump(100) > 0) {}
+            if (memmem(out + cursor, out_len - cursor, text, tlen) != NULL) {
+                snprintf(why, sizeof(why), "line %d: did not expect \"%s\"", pc + 1, arg);
+                error = why;
+            }
+        } else if (clen == 7 && strncmp(cmd, "timeout", 7) == 0) {
+            timeout_ms = atoi(arg);
+        } else if (clen == 5 && strncmp(cmd, "sleep", 5) == 0) {
+            double until = now_ms() + atoi(arg);
+            for (double left; (left = until - now_ms()) > 0; ) pump((int)left + 1);
+        } else if (clen == 4 && strncmp(cmd, "mark", 4) == 0) {
+            mark = now_ms();
+        } else if (clen == 3 && strncmp(cmd, "lap", 3) == 0) {
+            double ms = now_ms() - mark;
+            lap_t *l  = lap_find(arg);
+            if (l != NULL) {
+                if (l->n == 0 || ms < l->min) l->min = ms;
+                if (l->n == 0 || ms > l->max) l->max = ms;
+                if (l->n == l->cap) {
+                    l->cap = l->cap ? l->cap * 2 : 64;
+                    l->v   = realloc(l->v, l->cap * sizeof(double));
+                    if (l->v == NULL) exit(2);
+                }
+                l->v[l->n++] = ms;
+                l->sum      += ms;
+            }
+        } else if (clen == 6 && strncmp(cmd, "repeat", 6) == 0) {
+            if (depth == MAX_DEPTH) {
+                error = "repeat nested too deep";
+                break;
+            }
+            loop_pc[depth]   = pc;
+            loop_left[depth] = atoi(arg);
+            depth++;
+        } else if (clen == 3 && strncmp(cmd, "end", 3) == 0) {
+            if (depth == 0) {
+                error = "end without repeat";
+                break;
+            }
+            if (--loop_left[depth - 1] > 0) pc = loop_pc[depth - 1];
+            else depth--;
+        } else if (clen == 6 && strncmp(cmd, "status", 6) == 0) {
+            double deadline = now_ms() + timeout_ms;
+            while (!exited && now_ms() < deadline) {
+                pump(20);
+                reap(WNOHANG);
+            }
+            if (!exited) {
+                snprintf(why, sizeof(why), "line %d: program did not exit", pc + 1);
+                error = why;
+            } else if (exit_status != atoi(arg)) {
+                snprintf(why, sizeof(why), "line %d: exit status %d, not %s", pc + 1,
+                         exit_status, arg);
+                error = why;
+            }
+        } else {
+            snprintf(why, sizeof(why), "line %d: unknown step \"%.*s\"", pc + 1, (int)clen, cmd);
+            error = why;
+        }
+    }
+    double wall = now_ms() - t0;
+
+    // a program still running is hung up on, then killed
+    reap(WNOHANG);
+    if (!exited) {
+        kill(child, SIGHUP);
+        kill(child, SIGCONT);
+        for (int i = 0; i < 50 && !exited; i++) {
+            pump(10);
+            reap(WNOHANG);
+        }
+        if (!exited) {
+            kill(child, SIGKILL);
+            reap(0);
+        }
+    }
+    close(master);
+
+    printf("{\"test\": ");
+    json_string(name, strlen(name));
+    printf(", \"ok\": %s, \"ms\": %.3f", error ? "false" : "true", wall);
+    if (nlaps > 0) {
+        printf(", \"laps\": {");
+        for (int i = 0; i < nlaps; i++) {
+            lap_t *l = &laps[i];
+            qsort(l->v, l->n, sizeof(double), cmp_double);
+            double median = (l->n % 2) ? l->v[l->n / 2] : (l->v[l->n / 2 - 1] + l->v[l->n / 2]) / 2;
+            printf("%s", i ? ", " : "");
+            json_string(l->name, strlen(l->name));
+            printf(": {\"n\": %ld, \"mean_ms\": %.3f, \"median_ms\": %.3f, \"min_ms\": %.3f, "
+                   "\"max_ms\": %.3f}", l->n, l->sum / l->n, median, l->min, l->max);
+        }
+        printf("}");
+    }
+    if (error != NULL) {
+        printf(", \"error\": ");
+        json_string(error, strlen(error));
+    }
+    printf("}\n");
+
+    if (error != NULL) {
+        size_t from = out_len > 600 ? out_len - 600 : 0;
+        fprintf(stderr, "%s: %s\n--- last output ---\n%.*s\n-------------------\n", name, error,
+                (int)(out_len - from), out + from);
+    }
+    return error ? 1 : 0;
+}
@@ -0,0 +1,110 @@
+#!/bin/sh
+# Regression tests: `make test`, from the repo root.
+#   - the old test*.sh scripts, checked for their exit status
+#   - tests/scripts/NAME.sh, run as a script with a fresh scratch directory as $1;
+#     stdout plus a final "status N" line must match tests/scripts/NAME.out
+#   - tests/pty/NAME.pty, played against an interactive icsh on a pseudo-terminal
+#     by tests/ptydrive (job control, Ctrl-C/Ctrl-Z, prompts)
+# Results also go to $TEST_OUT (default test-results.json) as JSON.
+# Usage: tests/run.sh [name...]   (only the tests whose name is given)
+
+ICSH=${ICSH:-./icsh}
+export ICSH   # tests/scripts start a second icsh through it
+DRIVE=${DRIVE:-tests/ptydrive}
+OUT=${TEST_OUT:-test-results.json}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# the interactive shell must not touch the user's history
+ICSH_HISTFILE=$TMP/history
+export ICSH_HISTFILE
+
+pass=0
+fail=0
+: > "$TMP/results"
+
+wanted() {
+    [ $# -le 2 ] && return 0
+    n=$1
+    shift 2
+    for w in "$@"; do
+        [ "$w" = "$n" ] && return 0
+    done
+    return 1
+}
+
+# record NAME OK MS [ERROR]
+record() {
+    if [ "$2" = true ]; then
+        pass=$((pass + 1))
+        echo "ok    $1"
+    else
+        fail=$((fail + 1))
+        echo "FAIL  $1: $4"
+    fi
+    if [ -n "$4" ]; then
+        err=$(printf '%s' "$4" | sed 's/\\/\\\\/g; s/"/\\"/g')
+        echo "{\"test\": \"$1\", \"ok\": $2, \"ms\": $3, \"error\": \"$err\"}" >> "$TMP/results"
+    else
+        echo "{\"test\": \"$1\", \"ok\": $2, \"ms\": $3}" >> "$TMP/results"
+    fi
+}
+
+ms_since() {
+    echo $((($(date +%s%N) - $1) / 1000000))
+}
+
+for spec in test.sh:5 test2.sh:7 test3.sh:0 test4.sh:0 test5.sh:5 test6.sh:0 test7.sh:0 test8.sh:0; do
+    t=${spec%:*}
+    want=${spec#*:}
+    wanted "$t" -- "$@" || continue
+    start=$(date +%s%N)
+    "$ICSH" "$t" > /dev/null 2>&1
+    got=$?
+    if [ "$got" = "$want" ]; then
+        record "$t" true "$(ms_since "$start")"
+    else
+        record "$t" false "$(ms_since "$start")" "exit status $got, not $want"
+    fi
+done
+
+for t in tests/scripts/*.sh; do
+    name=${t#tests/}
+    wanted "$(basename "$t" .sh)" -- "$@" || continue
+    work="$TMP/work"
+    rm -rf "$work"
+    mkdir "$work"
+    start=$(date +%s%N)
+    { "$ICSH" "$t" "$work"; echo "status $?"; } > "$TMP/out" 2> "$TMP/err"
+    ms=$(ms_since "$start")
+    if cmp -s "$TMP/out" "${t%.sh}.out"; then
+        record "$name" true "$ms"
+    else
+        record "$name" false "$ms" "output differs from ${t%.sh}.out"
+        diff "${t%.sh}.out" "$TMP/out" | head -20
+        head -5 "$TMP/err"
+    fi
+done
+
+for t in tests/pty/*.pty; do
+    name=${t#tests/}
+    wanted "$(basename "$t" .pty)" -- "$@" || continue
+    if "$DRIVE" -n "$name" "$t" "$ICSH" > "$TMP/one" 2> "$TMP/err"; then
+        pass=$((pass + 1))
+        echo "ok    $name"
+    else
+        fail=$((fail + 1))
+        echo "FAIL  $name"
+        cat "$TMP/err"
+    fi
+    cat "$TMP/one" >> "$TMP/results"
+done
+
+{
+    echo "{\"suite\": \"icsh\", \"commit\": \"$(git rev-parse --short HEAD 2>/dev/null)\", \"passed\": $pass, \"failed\": $fail, \"tests\": ["
+    sed '$!s/$/,/; s/^/  /' "$TMP/results"
+    echo "]}"
+} > "$OUT"
+
+echo "$pass passed, $fail failed (details in $OUT)"
+[ "$fail" -eq 0 ]
@@ -0,0 +1,21 @@
+# echo, printf, test, read, true/false and $?
+echo plain words
+printf '%s-%d\n' a 1 b 2
+printf 'no newline'
+echo
+test 3 -gt 2 && echo gt
+[ abc = abd ] || echo ne
+false
+echo status $?
+true
+echo status $?
+read -r line <<< "read this"
+echo "got $line"
+printf '%00000000000000000000000000000000000000012345678901234567890.*o\n' 1234567890 8 2> /dev/null
+echo long spec $?
+# read takes the lines the shell's own reader has already buffered
+printf 'read x\nhello\necho got:$x\n' | "$ICSH" | grep -o "got:.*"
+# piped commands keep "!!" but record no history and write no history file
+printf 'echo hist\n!!\n' | ICSH_HISTFILE="$1/history" "$ICSH" | grep -c hist
+test -e "$1/history"
+echo saved $?
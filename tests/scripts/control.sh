@@ -0,0 +1,21 @@
+# if/elif/else, while, until, for, break, continue and functions
+for i in 1 2 3 4 5; do
+    if [ $i = 2 ]; then continue; fi
+    if [ $i = 4 ]; then break; fi
+    echo for $i
+done
+n=0
+while [ $n != 3 ]; do
+    n=3
+done
+echo while done
+until true; do echo never; done
+greet() { echo "hello $1, $# args"; return 4; }
+greet world extra
+echo ret $?
+up() { tr a-z A-Z; }
+echo piped | up | cat
+greet stage | up
+echo $?
+if false; then echo no; elif true; then echo elif; else echo no; fi
+{ echo group; echo block; }
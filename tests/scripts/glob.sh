@@ -0,0 +1,10 @@
+# filename globbing; $1 is a scratch directory
+cd $1
+: > a1.txt
+: > a2.txt
+: > b1.log
+echo *.txt
+echo a?.*
+echo [ab]1*
+echo *.nomatch
+echo '*.txt' "a?"
@@ -0,0 +1,16 @@
+# pipelines, && || and time
+echo a b c | tr ' ' '\n' | sort -r
+seq 1000 | tail -1
+false && echo never
+false || echo fallback
+true && echo chained
+echo in-shell | cat
+ls /nonexistent 2>/dev/null | wc -l
+# built-ins run as pipeline stages in a forked copy of the shell
+history | wc -l
+echo history $?
+ulimit -n 512; ulimit -n | cat
+# icsh -j exits with the status of the script's last line, not of the last unit to end
+printf 'sleep 0.3; false\ntrue\n' > "$1/j.sh"
+"$ICSH" -j 2 "$1/j.sh" 2> /dev/null
+echo parallel $?
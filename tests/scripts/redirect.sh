@@ -0,0 +1,19 @@
+# redirections, heredocs and here-strings; $1 is a scratch directory
+cd $1
+echo one > f
+echo two >> f
+cat < f
+ls nosuchfile 2> err
+cat err | wc -l
+v=expanded
+cat <<END
+body $v line
+END
+cat <<'END'
+quoted $v
+END
+tr a-z A-Z <<< shout
+echo to-stderr 1>&2 2>/dev/null
+# every file lands on an fd an earlier redirection targets, so each one is moved
+for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15; do echo $i > $1/f$i; done
+cat 17<$1/f1 16<$1/f2 15<$1/f3 14<$1/f4 13<$1/f5 12<$1/f6 11<$1/f7 10<$1/f8 9<$1/f9 8<$1/f10 7<$1/f11 6<$1/f12 5<$1/f13 4<$1/f14 3<$1/f15 <&9
@@ -0,0 +1,24 @@
+# command substitution and subshells
+echo $(echo in shell)
+echo "$(printf 'a  b')"
+printf '[%s]\n' $(printf 'x y\nz')
+echo `echo back quotes`
+echo $(echo $(echo nested))
+n=$(seq 5 | wc -l)
+echo lines $n
+for f in $(seq 3); do echo item $f; done
+x=$(false)
+echo status $?
+(cd /; pwd)
+(exit 3)
+echo subshell $?
+echo pre$(echo " mid ")post
+(
+    echo multi-line subshell
+)
+echo after subshell
+# a traced subshell writes its own events once, and none of mine again
+printf '/bin/echo m1\n( for i in $(seq 3000); do true; done )\n' > "$1/t.sh"
+ICSH_TRACE="$1/trace" "$ICSH" "$1/t.sh" 2> /dev/null
+grep -c 'echo m1' "$1/trace"
+grep -c '"phase":"builtin"' "$1/trace"
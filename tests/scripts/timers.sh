@@ -0,0 +1,22 @@
+# timeout on foreground jobs, and the at/every list
+timeout 0.2 sleep 5
+echo timeout $?
+timeout 5 /bin/echo quick
+echo quick $?
+timeout -s KILL 0.1 sleep 5
+echo kill $?
+timeout -k 0.1 0.1 sh -c 'trap "" TERM; sleep 5'
+echo grace $?
+timeout 0 /bin/echo no deadline
+timeout 1
+echo usage $?
+timeout -s NOPE 1 sleep 1
+echo badsig $?
+at 1h echo one
+every 30m 'echo two > "$1/two"'
+at 10
+echo at usage $?
+at -d 1
+at
+at -d 1 2> /dev/null
+echo gone $?
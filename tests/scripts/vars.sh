@@ -0,0 +1,10 @@
+# variables, export and the environment
+x=hello
+echo $x ${x}world "$x"
+export y=exported
+sh -c 'echo child sees $y'
+z=local sh -c 'echo prefix $z'
+echo after prefix "[$z]"
+unset x
+echo unset "[$x]"
+echo pid-is-number $(test $$ -gt 0 && echo yes)